@@ -14,52 +14,121 @@
  */
 #include "acphasespace.h"
 
+/*
+ * Receive -> publish -> log benchmark driver.
+ *
+ * Usage: main [[udp:]host [port [frames [log]]]]
+ *        main file:capture [speed [frames [log]]]
+ *
+ * Reads frames from an OWL server (or phsp-sim, with -u for the udp:
+ * prefix), or replays a raw stream
+ * capture at 'speed' times its original pace (0, the default, for as fast
+ * as possible), publishes them through the triple buffer and optionally
+ * logs them, then reports the frame rate and the time spent per frame in
+ * that chain.
+ */
+
 #include <sys/time.h>
-#include <fcntl.h>
 #include <stdio.h>
-#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 #include "phasespace_c_types.h"
-#include "ports.c"  
 #include "phsp.h"
-struct phasespace_server_s *server;
-struct phasespace_log_s *log = NULL;
-struct phasespace_bodies frame;
+#include "owl.h"
 
-owl_port_init(&server, "192.168.1.10", "23");
-phsp_log_start("motion_log.txt", 1, &log, NULL);
+static double
+now(void)
+{
+    struct timespec ts;
 
-for (int i = 0; i < 1000; i++) {
-    owl_fetch_frame(server, &frame);
-    owl_log_frame(log, &frame);
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
 }
 
-phsp_log_stop(&log, NULL);
-owl_port_shutdown(&server);
+int main(int argc, char *argv[])
+{
+    const char *host = argc > 1 ? argv[1] : "127.0.0.1";
+    const char *port = argc > 2 ? argv[2] : "23";
+    unsigned long frames = argc > 3 ? strtoul(argv[3], NULL, 0) : 1000;
+    const char *path = argc > 4 ? argv[4] : NULL;
+    struct phasespace_server_s *server;
+    struct phasespace_frames_s *pub;
+    struct phasespace_log_s *log = NULL;
+    phasespace_log_stats stats;
+    unsigned long n = 0;
+    double start, t, dt, total = 0., max = 0.;
+    uint64_t seq;
+    int s;
 
+    if (argc > 5) {
+        fprintf(stderr, "usage: %s [[udp:]host [port [frames [log]]]]\n"
+                "       %s file:capture [speed [frames [log]]]\n",
+                argv[0], argv[0]);
+        return 2;
+    }
 
-int main(void)
-{
-    struct phasespace_server_s *server=NULL;
-    struct phasespace_log_s *log=NULL;
-    struct phasespace_bodies frame;
+    if (!strncmp(host, "file:", 5))
+        server = owl_replay(host + 5, argc > 2 ? strtod(port, NULL) : 0.);
+    else if (!strncmp(host, "udp:", 4))
+        server = owl_connect(host + 4, port, PHSP_TRANSPORT_UDP, 0);
+    else
+        server = owl_connect(host, port, PHSP_TRANSPORT_TCP, 0);
+    if (!server) { fprintf(stderr, "Failed to connect\n"); return 1; }
 
-    server = owl_connect("127.0.0.1","23");
-    if(!server){fprintf(stderr,"Failed to connect\n"); return 1;}
+    pub = phsp_frames_create();
+    if (!pub) { perror("phsp_frames_create"); return 1; }
 
-    phsp_log_start("motion_capture_log.txt",1,&log);
+    if (path) {
+        log = malloc(sizeof(*log));
+        if (!log ||
+            owl_log_init(log, path, 1, PHSP_LOG_TEXT, PHSP_LOG_BLOCK)) {
+            perror(path);
+            return 1;
+        }
+    }
+
+    start = now();
+    while (n < frames) {
+        struct timeval tv = { 1, 0 };
+
+        s = owl_poll(server, &tv);
+        if (s < 0) { perror("poll"); break; }
+        if (s == 0) { fprintf(stderr, "timeout\n"); break; }
+
+        t = now();
+        while (n < frames &&
+               (s = owl_fetch_frame(server, phsp_frames_back(pub))) > 0) {
+            phsp_frames_publish(pub, &seq);
+            if (log) owl_log(log, phsp_frames_read(pub, &seq));
+            n++;
 
-    struct timeval tv={0,100000};
-    for(int i=0;i<100;i++){
-        int ready=owl_poll(server,&tv);
-        if(ready>0){
-            owl_fetch_frame(server,&frame);
-            owl_log(log,&frame);
+            dt = now() - t;
+            total += dt;
+            if (dt > max) max = dt;
+            t = now();
         }
-        usleep(5000);
+        if (s < 0) { fprintf(stderr, "connection closed\n"); break; }
     }
+    t = now() - start;
 
-    phsp_log_stop(&log);
-    owl_disconnect(&server);
+    printf("%lu frames in %.3fs: %.0f Hz, %.2f us/frame (max %.2f us)\n",
+           n, t, n / t, n ? 1e6 * total / n : 0., 1e6 * max);
+    if (server->transport == PHSP_TRANSPORT_UDP)
+        printf("udp: %zu lost, %zu reordered, %zu invalid\n",
+               server->lost, server->reordered, server->invalid);
+
+    if (log) {
+        owl_log_stats(log, &stats);
+        printf("log: %" PRIu64 " logged, %" PRIu64 " missed, "
+               "%" PRIu64 " blocked, %" PRIu64 " truncated\n",
+               stats.logged, stats.missed, stats.blocked, stats.truncated);
+        owl_log_fini(log);
+        free(log);
+    }
+
+    phsp_frames_destroy(pub);
+    owl_disconnect(server);
     return 0;
-}
\ No newline at end of file
+}
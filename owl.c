@@ -15,60 +15,317 @@
 
 #include "phasespace_c_types.h"
 #include "phsp.h"
+#include "owl.h"
+#include "phsp_euler.h"
 
 #include <arpa/inet.h>
 #include <assert.h>
 #include <aio.h>
+#include <endian.h>
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <linux/net_tstamp.h>
 #include <math.h>
 #include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <poll.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
 #include <sys/socket.h>
 #include <time.h>
 #include <unistd.h>
 
+static inline uint64_t
+owl_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* ---------------------------------------------------------------------- */
+/* Address resolution ---------------------------------------------------- */
+
+#define OWL_RESOLVE_TTL		60	/* s */
+#define OWL_CONNECT_ADDRS	8	/* addresses tried per connection */
+#define OWL_CONNECT_STAGGER	250	/* ms before racing the next address */
+
+struct owl_addr {
+    int family;
+    socklen_t len;
+    struct sockaddr_storage addr;
+};
+
+/* last resolution, so that reconnections do not wait for the resolver */
+static struct {
+    pthread_mutex_t lock;
+    char host[128], port[128];
+    int socktype;
+    uint64_t expires;		/* CLOCK_MONOTONIC, ns */
+    size_t n;
+    struct owl_addr a[OWL_CONNECT_ADDRS];
+} owl_resolved = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/*
+ * Resolve host:port into at most OWL_CONNECT_ADDRS addresses, alternating
+ * address families in the resolver order (RFC 8305). Results are cached
+ * for OWL_RESOLVE_TTL seconds. Returns the number of addresses, or -1.
+ */
+static ssize_t
+owl_resolve(const char *host, const char *port, int socktype,
+            struct owl_addr *a)
+{
+    struct addrinfo hints, *res, *res0, *next[2];
+    uint64_t now = owl_now_ns();
+    size_t n = 0;
+    int e, f;
+
+    pthread_mutex_lock(&owl_resolved.lock);
+    if (owl_resolved.n && now < owl_resolved.expires &&
+        owl_resolved.socktype == socktype &&
+        !strcmp(owl_resolved.host, host) && !strcmp(owl_resolved.port, port)) {
+        n = owl_resolved.n;
+        memcpy(a, owl_resolved.a, n * sizeof(*a));
+    }
+    pthread_mutex_unlock(&owl_resolved.lock);
+    if (n) return n;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = socktype;
+    hints.ai_flags = AI_ADDRCONFIG;
+
+    e = getaddrinfo(host, port, &hints, &res0);
+    if (e) {
+        errno = e == EAI_SYSTEM ? errno :
+            e == EAI_MEMORY ? ENOMEM : EHOSTUNREACH;
+        return -1;
+    }
+
+    /* interleave the first family with the others */
+    next[0] = res0;
+    for (next[1] = res0; next[1] && next[1]->ai_family == res0->ai_family;
+         next[1] = next[1]->ai_next);
+    for (f = 0; n < OWL_CONNECT_ADDRS && (next[0] || next[1]); f = !f) {
+        res = next[f];
+        if (!res) continue;
+        for (next[f] = res->ai_next;
+             next[f] && (next[f]->ai_family == res0->ai_family) == f;
+             next[f] = next[f]->ai_next);
+        if (res->ai_addrlen > sizeof(a[n].addr)) continue;
+
+        a[n].family = res->ai_family;
+        a[n].len = res->ai_addrlen;
+        memcpy(&a[n].addr, res->ai_addr, res->ai_addrlen);
+        n++;
+    }
+    freeaddrinfo(res0);
+    if (!n) { errno = EHOSTUNREACH; return -1; }
+
+    pthread_mutex_lock(&owl_resolved.lock);
+    snprintf(owl_resolved.host, sizeof(owl_resolved.host), "%s", host);
+    snprintf(owl_resolved.port, sizeof(owl_resolved.port), "%s", port);
+    owl_resolved.socktype = socktype;
+    owl_resolved.expires = now + OWL_RESOLVE_TTL * 1000000000ULL;
+    owl_resolved.n = n;
+    memcpy(owl_resolved.a, a, n * sizeof(*a));
+    pthread_mutex_unlock(&owl_resolved.lock);
+
+    return n;
+}
+
+/* forget the cached resolution, e.g. when none of its addresses answer */
+static void
+owl_resolve_flush(void)
+{
+    pthread_mutex_lock(&owl_resolved.lock);
+    owl_resolved.n = 0;
+    pthread_mutex_unlock(&owl_resolved.lock);
+}
+
+/*
+ * Race non-blocking connections to the n addresses: a new attempt starts
+ * every OWL_CONNECT_STAGGER ms, or as soon as one fails, and the first
+ * one established wins (RFC 8305). Returns a connected, non-blocking
+ * socket, or -1 with errno set to ETIMEDOUT when 'end' (CLOCK_MONOTONIC
+ * ns) passed, or to the error of the last failed attempt.
+ */
+static int
+owl_connect_race(const struct owl_addr *a, size_t n, uint64_t end)
+{
+    struct pollfd pfd[OWL_CONNECT_ADDRS];
+    size_t started = 0, pending = 0, i;
+    uint64_t now, next = 0, until;
+    int fd = -1, e = ETIMEDOUT, s, r;
+    socklen_t len;
+
+    while (fd < 0) {
+        now = owl_now_ns();
+        if (now >= end) { e = ETIMEDOUT; break; }
+
+        /* start the next attempt when due */
+        if (started < n && (now >= next || !pending)) {
+            i = started++;
+            pfd[i].fd = -1;
+            pfd[i].events = POLLOUT;
+            pfd[i].revents = 0;
+
+            s = socket(a[i].family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                       0);
+            if (s < 0) { e = errno; continue; }
+            if (!connect(s, (const struct sockaddr *)&a[i].addr, a[i].len)) {
+                fd = s;
+                break;
+            }
+            if (errno != EINPROGRESS) {
+                e = errno;
+                close(s);
+                continue;
+            }
+
+            pfd[i].fd = s;
+            pending++;
+            next = now + OWL_CONNECT_STAGGER * 1000000ULL;
+            continue;
+        }
+        if (!pending) break;
+
+        /* wait for any attempt, until the next one is due */
+        until = (started < n && next < end) ? next : end;
+        now = owl_now_ns();
+        r = poll(pfd, started,
+                 until > now ? (until - now + 999999) / 1000000 : 0);
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            e = errno;
+            break;
+        }
+
+        for (i = 0; r > 0 && i < started && fd < 0; i++) {
+            if (pfd[i].fd < 0 || !pfd[i].revents) continue;
+
+            len = sizeof(s);
+            if (getsockopt(pfd[i].fd, SOL_SOCKET, SO_ERROR, &s, &len))
+                s = errno;
+            if (!s) {
+                fd = pfd[i].fd;
+            } else {
+                e = s;
+                close(pfd[i].fd);
+                pending--;
+                next = 0; /* do not wait to try the next address */
+            }
+            pfd[i].fd = -1;
+        }
+    }
+
+    for (i = 0; i < started; i++)
+        if (pfd[i].fd >= 0) close(pfd[i].fd);
+
+    if (fd < 0) errno = e;
+    return fd;
+}
+
+
 /* ---------------------------------------------------------------------- */
 /* OWL connection -------------------------------------------------------- */
+/*
+ * Connects to host:port with the given transport (an enum phsp_transport),
+ * within 'timeout' ms (PHSP_CONNECT_TIMEOUT if 0), not counting a name
+ * resolution that is not cached yet. TCP connections to all the resolved
+ * addresses are raced. With UDP, the socket is connected to the first
+ * server address to filter out other sources, and a subscription datagram
+ * is sent. owl_recv() renews it every PHSP_UDP_RESUBSCRIBE ms, and fails
+ * with ETIMEDOUT after PHSP_UDP_TIMEOUT ms without a datagram.
+ */
 struct phasespace_server_s *
-owl_connect(const char *host, const char *port)
+owl_connect(const char *host, const char *port, uint32_t transport,
+            uint32_t timeout)
 {
     struct phasespace_server_s *server;
-    struct addrinfo hints, *res, *res0;
-    int sfd;
+    struct owl_addr a[OWL_CONNECT_ADDRS];
+    uint64_t end;
+    ssize_t n, i;
+    int sfd, e;
+
+    if (!host || !port || transport > PHSP_TRANSPORT_UDP) {
+        errno = EINVAL;
+        return NULL;
+    }
 
     server = malloc(sizeof(*server));
     if (!server) return NULL;
     server->fd = -1;
+    server->transport = transport;
+    server->dgram = NULL;
+    server->dgram_size = PHSP_UDP_DGRAM_SIZE;
+    server->seq = 0;
+    server->seq_valid = false;
+    server->subscribed = server->alive = 0;
+    server->lost = server->reordered = server->invalid = 0;
     server->ctx = NULL; /* store SDK context if needed */
+    server->r = server->w = 0;
+    server->discard = 0;
+    server->oversized = 0;
+    server->frames = server->coalesced = 0;
+    server->capture = NULL;
+    server->replay = NULL;
+    server->epfd = -1;
+    server->busy_poll = 0;
+    server->timestamps = false;
+    server->rx_bytes = 0;
+    server->rx_head = server->rx_count = 0;
 
-    memset(&hints, 0, sizeof(hints));
-    hints.ai_family = AF_UNSPEC;
-    hints.ai_socktype = SOCK_STREAM;
-
-    if (getaddrinfo(host, port, &hints, &res0) != 0) {
-        free(server);
-        return NULL;
+    if (transport == PHSP_TRANSPORT_UDP) {
+        server->dgram = malloc(PHSP_UDP_BATCH * PHSP_UDP_DGRAM_SIZE);
+        if (!server->dgram) {
+            free(server);
+            return NULL;
+        }
     }
 
-    for (res = res0; res; res = res->ai_next) {
-        sfd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
-        if (sfd < 0) continue;
-        if (connect(sfd, res->ai_addr, res->ai_addrlen) == 0) {
+    n = owl_resolve(host, port,
+                    transport == PHSP_TRANSPORT_UDP ? SOCK_DGRAM : SOCK_STREAM,
+                    a);
+    if (n < 0) goto err;
+    end = owl_now_ns() +
+        (timeout ? timeout : PHSP_CONNECT_TIMEOUT) * 1000000ULL;
+
+    if (transport == PHSP_TRANSPORT_UDP) {
+        /* no handshake: connect() only sets the peer address */
+        for (i = 0; i < n && server->fd < 0; i++) {
+            sfd = socket(a[i].family, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+            if (sfd < 0) continue;
+            if (!connect(sfd, (const struct sockaddr *)&a[i].addr, a[i].len) &&
+                send(sfd, OWL_UDP_SUBSCRIBE, sizeof(OWL_UDP_SUBSCRIBE), 0) ==
+                sizeof(OWL_UDP_SUBSCRIBE))
+                server->fd = sfd;
+            else
+                close(sfd);
+        }
+        /* renewed and watched by owl_recv() */
+        server->subscribed = server->alive = owl_now_ns();
+    } else {
+        sfd = owl_connect_race(a, n, end);
+        if (sfd >= 0) {
+            /* back to a blocking socket, reads use MSG_DONTWAIT */
+            fcntl(sfd, F_SETFL, fcntl(sfd, F_GETFL) & ~O_NONBLOCK);
             server->fd = sfd;
-            break;
         }
-        close(sfd);
     }
 
-    freeaddrinfo(res0);
     if (server->fd < 0) {
-        free(server);
-        return NULL;
+        /* the addresses may have changed */
+        e = errno;
+        owl_resolve_flush();
+        errno = e;
+        goto err;
     }
 
     /* TODO: initialize SDK context if using libowl2
@@ -77,17 +334,101 @@ owl_connect(const char *host, const char *port)
     */
 
     return server;
+
+err:
+    e = errno;
+    free(server->dgram);
+    free(server);
+    errno = e;
+    return NULL;
+}
+
+/* ---------------------------------------------------------------------- */
+/* Socket options -------------------------------------------------------- */
+
+/* set an int option, keep the first error in *e */
+static void
+owl_setsockopt(int fd, int level, int opt, int v, int *e)
+{
+    if (setsockopt(fd, level, opt, &v, sizeof(v)) && !*e) *e = errno;
+}
+
+/*
+ * Applies all the options in opts to the server socket, even if one
+ * fails. With timestamps, frames get the kernel software receive time of
+ * their last byte instead of the time owl_recv() read them. Returns 0, or
+ * -1 with the errno of the first failure.
+ */
+int
+owl_tune(struct phasespace_server_s *server, const phasespace_sock_opts *opts)
+{
+    struct sockaddr_storage sa;
+    socklen_t len = sizeof(sa);
+    int v, e = 0;
+
+    if (!server || server->fd < 0 || !opts) { errno = EINVAL; return -1; }
+
+    if (server->transport == PHSP_TRANSPORT_TCP)
+        owl_setsockopt(server->fd, IPPROTO_TCP, TCP_NODELAY, opts->nodelay,
+                       &e);
+
+    /* beyond rmem_max when privileged */
+    if (opts->rcvbuf &&
+        setsockopt(server->fd, SOL_SOCKET, SO_RCVBUFFORCE, &opts->rcvbuf,
+                   sizeof(int)))
+        owl_setsockopt(server->fd, SOL_SOCKET, SO_RCVBUF, opts->rcvbuf, &e);
+
+#ifdef SO_BUSY_POLL
+    owl_setsockopt(server->fd, SOL_SOCKET, SO_BUSY_POLL, opts->busy_poll, &e);
+    server->busy_poll = opts->busy_poll;
+#endif
+
+    if (opts->tos >= 0 &&
+        !getsockname(server->fd, (struct sockaddr *)&sa, &len)) {
+        if (sa.ss_family == AF_INET6)
+            owl_setsockopt(server->fd, IPPROTO_IPV6, IPV6_TCLASS, opts->tos,
+                           &e);
+        else
+            owl_setsockopt(server->fd, IPPROTO_IP, IP_TOS, opts->tos, &e);
+    }
+
+    v = opts->timestamps ?
+        SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE : 0;
+    if (setsockopt(server->fd, SOL_SOCKET, SO_TIMESTAMPING, &v, sizeof(v))) {
+        if (!e) e = errno;
+        server->timestamps = false;
+    } else
+        server->timestamps = opts->timestamps;
+
+    if (e) { errno = e; return -1; }
+    return 0;
 }
 
 /* ---------------------------------------------------------------------- */
 /* Poll for data --------------------------------------------------------- */
+
+/* a complete frame is already in rbuf, see owl_frame_pending() */
+static bool
+owl_frame_buffered(const struct phasespace_server_s *server)
+{
+    const uint8_t *p = server->rbuf + server->r;
+    size_t avail = server->w - server->r;
+
+    if (server->discard || avail < OWL_HEADER_SIZE) return false;
+    return avail >= (size_t)OWL_FRAME_SIZE(
+        (p[0] << 8) | p[1], (p[2] << 8) | p[3]);
+}
+
+/* returns 1 when a frame can be decoded without blocking, including one
+ * already buffered, 0 on timeout and -1 on error */
 int
-owl_poll(struct phasespace_server_s server, struct timeval *timeout)
+owl_poll(const struct phasespace_server_s *server, struct timeval *timeout)
 {
-    assert(server.fd >= 0);
+    assert(server->fd >= 0);
+    if (owl_frame_buffered(server)) return 1;
 
     struct pollfd fds[1];
-    fds[0].fd = server.fd;
+    fds[0].fd = server->fd;
     fds[0].events = POLLIN;
 
     int t_ms = timeout ? (timeout->tv_sec * 1000 + timeout->tv_usec / 1000) : -1;
@@ -103,10 +444,89 @@ owl_poll(struct phasespace_server_s server, struct timeval *timeout)
     return 0;
 }
 
+/* ---------------------------------------------------------------------- */
+/* Wait for a complete frame --------------------------------------------- */
+
+static inline void
+owl_cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ volatile("yield");
+#endif
+}
+
+static int
+owl_wait_init(struct phasespace_server_s *server, uint32_t spin_us)
+{
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLRDHUP | EPOLLET };
+
+    server->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (server->epfd < 0) return -1;
+
+    ev.data.fd = server->fd;
+    if (epoll_ctl(server->epfd, EPOLL_CTL_ADD, server->fd, &ev)) {
+        close(server->epfd);
+        server->epfd = -1;
+        return -1;
+    }
+
+#ifdef SO_BUSY_POLL
+    /* let the kernel busy poll the device queue too, when permitted and
+     * not configured by owl_tune() */
+    if (spin_us && !server->busy_poll) {
+        int us = spin_us;
+        setsockopt(server->fd, SOL_SOCKET, SO_BUSY_POLL, &us, sizeof(us));
+    }
+#endif
+    return 0;
+}
+
+/*
+ * Returns 1 as soon as a complete frame is buffered, 0 after 'timeout' ms
+ * without one (-1 waits forever), -1 on error or disconnection.
+ *
+ * The socket is first read without blocking for up to spin_us, then
+ * waited for with an edge-triggered epoll. It is always read until EAGAIN
+ * before blocking, so that no edge can be missed.
+ */
+int
+owl_wait(struct phasespace_server_s *server, uint32_t spin_us, int timeout)
+{
+    struct epoll_event ev;
+    uint64_t now, deadline = 0;
+    ssize_t n;
+    int s;
+
+    while (1) {
+        if (owl_frame_pending(server)) return 1;
+
+        n = owl_recv(server);
+        if (n < 0) return -1;
+        if (n > 0) continue;
+
+        /* spin, including for the rest of a partially received frame */
+        if (spin_us) {
+            now = owl_now_ns();
+            if (!deadline) deadline = now + spin_us * 1000ULL;
+            if (now < deadline) { owl_cpu_relax(); continue; }
+        }
+
+        if (server->epfd < 0 && owl_wait_init(server, spin_us)) return -1;
+        do {
+            s = epoll_wait(server->epfd, &ev, 1, timeout);
+        } while (s < 0 && errno == EINTR);
+        if (s < 0) return -1;
+        if (s == 0) return 0;
+        deadline = 0;
+    }
+}
+
 /* ---------------------------------------------------------------------- */
 /* OWL version (dummy if SDK does not provide) --------------------------- */
 uint32_t
-owl_version(struct phasespace_server_s server)
+owl_version(const struct phasespace_server_s *server)
 {
     (void)server;
     return 2*1000 + 12; /* example: 2.12 */
@@ -122,136 +542,562 @@ owl_disconnect(struct phasespace_server_s *server)
     /* TODO: destroy SDK context if used
        if (server->ctx) owl2_destroy_context(server->ctx);
     */
+    owl_capture_stop(server);
+    owl_replay_stop(server);
+    if (server->epfd >= 0) close(server->epfd);
     if (server->fd >= 0) close(server->fd);
+    free(server->dgram);
     free(server);
 }
 
+/* ---------------------------------------------------------------------- */
+/* Log slots ring -------------------------------------------------------- */
+
+_Static_assert(PHSP_LOG_SLOT_SIZE % 32 == 0, "misaligned log slots");
+_Static_assert(PHSP_LOG_SLOT_SIZE >=
+               sizeof(struct phsp_log_frame_rec) +
+               PHASESPACE_MAX_MARKERS * sizeof(struct phsp_log_marker_rec) +
+               PHASESPACE_MAX_RIGIDS * sizeof(struct phsp_log_rigid_rec),
+               "log slots too small for a binary frame");
+
+/* check whether the aio write of a slot completed */
+static int
+owl_log_aio_done(struct phasespace_log_s *log, struct phsp_log_slot *s,
+                 bool wait)
+{
+    const struct aiocb *l[1] = { &s->req };
+    ssize_t n;
+
+    while (aio_error(&s->req) == EINPROGRESS) {
+        if (!wait) return 0;
+        if (aio_suspend(l, 1, NULL) && errno != EINTR) return -1;
+    }
+
+    s->state = PHSP_LOG_DONE;
+    n = aio_return(&s->req);
+    if (n < 0 || (size_t)n != s->req.aio_nbytes) return -1;
+    return 0;
+}
+
+/* reap completed writes, in order; wait for the oldest one if 'wait' */
+static int
+owl_log_reap(struct phasespace_log_s *log, bool wait)
+{
+    while (log->inflight) {
+        struct phsp_log_slot *s = &log->slot[log->head];
+
+        if (s->state != PHSP_LOG_DONE) {
+            if (log->uring) {
+                if (owl_uring_reap(log, wait)) goto err;
+            } else {
+                if (owl_log_aio_done(log, s, wait)) goto err;
+            }
+            if (s->state != PHSP_LOG_DONE) {
+                if (!wait) break;
+                continue;
+            }
+        }
+
+        s->state = PHSP_LOG_FREE;
+        log->head = (log->head + 1) % PHSP_LOG_SLOTS;
+        log->count--;
+        log->inflight--;
+        wait = false;
+    }
+
+    return 0;
+
+err:
+    warnx("log %s", log->path);
+    return -1;
+}
+
+/* submit queued slots as one batch. With aio, the next batch starts once
+ * the previous one is complete; with io_uring, as soon as the disk is idle
+ * or PHSP_LOG_URING_BATCH frames are waiting. */
+static int
+owl_log_kick(struct phasespace_log_s *log, bool force)
+{
+    struct phsp_log_slot *s;
+    uint32_t queued = log->count - log->inflight;
+
+    if (!queued) return 0;
+    if (log->inflight && !log->uring) return 0;
+    if (log->inflight && !force && queued < PHSP_LOG_URING_BATCH) return 0;
+
+    while (log->inflight < log->count) {
+        s = &log->slot[(log->head + log->inflight) % PHSP_LOG_SLOTS];
+        s->req.aio_offset = log->offset;
+        if (log->uring ? owl_uring_prep(log, s) : aio_write(&s->req)) {
+            /* out of resources: retry with the next batch */
+            if (errno == EAGAIN) break;
+            warnx("log %s", log->path);
+            return -1;
+        }
+
+        s->state = PHSP_LOG_INFLIGHT;
+        log->offset += s->req.aio_nbytes;
+        log->inflight++;
+    }
+
+    if (log->uring && owl_uring_submit(log)) {
+        warnx("log %s", log->path);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* get a slot buffer for a new frame, applying the high-water policy.
+ * *slot is NULL if the frame must be dropped. */
+static int
+owl_log_slot_get(struct phasespace_log_s *log, struct phsp_log_slot **slot)
+{
+    struct phsp_log_slot *s;
+    uint32_t i, j;
+    char *buffer;
+
+    *slot = NULL;
+    if (log->count == PHSP_LOG_SLOTS) {
+        switch(log->policy) {
+            case PHSP_LOG_BLOCK:
+                /* submit whatever is still queued (the ring may be full of
+                 * queued frames with nothing in flight) and wait for the
+                 * oldest write until a slot is free */
+                log->blocked++;
+                while (log->count == PHSP_LOG_SLOTS) {
+                    if (owl_log_kick(log, true)) return -1;
+                    if (!log->inflight) break;
+                    if (owl_log_reap(log, true)) return -1;
+                }
+                break;
+
+            case PHSP_LOG_DROP_OLDEST:
+                if (log->inflight == log->count) break;
+
+                /* shift queued frames down to free the last slot */
+                i = (log->head + log->inflight) % PHSP_LOG_SLOTS;
+                buffer = log->slot[i].buffer;
+                for (j = log->inflight + 1; j < log->count; j++) {
+                    uint32_t k = (log->head + j) % PHSP_LOG_SLOTS;
+                    log->slot[i].buffer = log->slot[k].buffer;
+                    log->slot[i].req.aio_buf = log->slot[k].buffer;
+                    log->slot[i].req.aio_nbytes = log->slot[k].req.aio_nbytes;
+                    i = k;
+                }
+                log->slot[i].buffer = buffer;
+                log->slot[i].req.aio_buf = buffer;
+                log->slot[i].state = PHSP_LOG_FREE;
+                log->count--;
+                log->dropped_oldest++;
+                log->missed++;
+                break;
+        }
+
+        /* no slot could be recycled: drop the current frame */
+        if (log->count == PHSP_LOG_SLOTS) {
+            log->dropped_newest++;
+            log->missed++;
+            log->skipped = true;
+            return 0;
+        }
+    }
+
+    i = (log->head + log->count) % PHSP_LOG_SLOTS;
+    s = &log->slot[i];
+    s->state = PHSP_LOG_QUEUED;
+    s->req.aio_nbytes = 0;
+    log->count++;
+    *slot = s;
+    return 0;
+}
+
+/* queue a filled slot and start writing if the disk is idle */
+static int
+owl_log_slot_put(struct phasespace_log_s *log, struct phsp_log_slot *s,
+                 size_t len)
+{
+    s->req.aio_nbytes = len;
+    log->logged++;
+    log->skipped = false;
+
+    return owl_log_kick(log, false);
+}
+
 /* ---------------------------------------------------------------------- */
 /* Initialize async logging ---------------------------------------------- */
-void
-owl_log_init(struct phasespace_log_s *log, const char *path, uint32_t decimation)
+int
+owl_log_init(struct phasespace_log_s *log, const char *path,
+             uint32_t decimation, uint32_t format, uint32_t policy)
 {
-    if (!log || !path) return;
+    struct phsp_log_slot *s;
+    char *arena;
+    size_t n;
+    int i;
+
+    if (!log || !path) { errno = EINVAL; return -1; }
+
+    /* slot buffers, then current and previous positions for noise */
+    if (posix_memalign((void **)&arena, 64,
+                       PHSP_LOG_SLOTS * PHSP_LOG_SLOT_SIZE +
+                       4 * sizeof(phasespace_soa)))
+        return -1;
 
     memset(log, 0, sizeof(*log));
     strncpy(log->path, path, sizeof(log->path)-1);
-    log->decimation = decimation;
-    log->req.aio_fildes = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-    if (log->req.aio_fildes < 0) {
-        warnx("Failed to open log file: %s", path);
-        return;
+    log->decimation = decimation < 1 ? 1 : decimation;
+    log->format = format == PHSP_LOG_BINARY ? PHSP_LOG_BINARY : PHSP_LOG_TEXT;
+    log->policy = policy <= PHSP_LOG_DROP_NEWEST ? policy : PHSP_LOG_BLOCK;
+
+    log->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (log->fd < 0) { free(arena); return -1; }
+    log->arena = arena;
+    for (i = 0; i < 2; i++) {
+        log->markers[i] = (phasespace_soa *)
+            (arena + PHSP_LOG_SLOTS * PHSP_LOG_SLOT_SIZE) + i;
+        log->rigids[i] = log->markers[i] + 2;
+        log->markers[i]->n = log->rigids[i]->n = 0;
     }
 
-    log->req.aio_buf = log->buffer;
-    log->req.aio_offset = 0;
-    log->req.aio_nbytes = 0;
-    log->pending = false;
-    log->skipped = false;
-    log->missed = 0;
-    log->total = 0;
+    for (i = 0; i < PHSP_LOG_SLOTS; i++) {
+        log->slot[i].buffer = arena + i * PHSP_LOG_SLOT_SIZE;
+        log->slot[i].state = PHSP_LOG_FREE;
+        log->slot[i].req.aio_fildes = log->fd;
+        log->slot[i].req.aio_buf = log->slot[i].buffer;
+        log->slot[i].req.aio_sigevent.sigev_notify = SIGEV_NONE;
+        log->slot[i].req.aio_lio_opcode = LIO_WRITE;
+    }
+
+    /* prefer io_uring, keep POSIX aio if the kernel does not support it */
+    if (owl_uring_init(log)) log->uring = NULL;
 
     /* Write header */
-    int n = snprintf(log->buffer, sizeof(log->buffer),
-                     "name ts_sec ts_nsec x y z roll pitch yaw cond noise\n");
-    if (n > 0) {
-        log->req.aio_nbytes = n;
-        if (aio_write(&log->req)) {
-            warnx("Failed to write log header: %s", path);
-        } else {
-            log->pending = true;
-        }
+    owl_log_slot_get(log, &s);
+    if (log->format == PHSP_LOG_BINARY)
+        n = owl_log_binary_header(log, s->buffer, PHSP_LOG_SLOT_SIZE);
+    else
+        n = snprintf(s->buffer, PHSP_LOG_SLOT_SIZE, "%s\n", phsp_log_header);
+    if (owl_log_slot_put(log, s, n)) {
+        owl_log_fini(log);
+        return -1;
     }
+    log->logged = 0;
+
+    return 0;
 }
 
 /* ---------------------------------------------------------------------- */
-/* Log a frame with condition and noise ---------------------------------- */
+/* Flush pending frames and close the log -------------------------------- */
+
+/* back-off when aio is out of resources with nothing in flight */
+#define OWL_LOG_FINI_RETRIES	100
+#define OWL_LOG_FINI_BACKOFF	10000000	/* ns */
+
 void
-owl_log(struct phasespace_log_s *log, const phasespace_bodies *bodies)
+owl_log_fini(struct phasespace_log_s *log)
 {
-    if (!log || !bodies || log->req.aio_fildes < 0) return;
+    const struct timespec backoff = { 0, OWL_LOG_FINI_BACKOFF };
+    int retries = 0;
 
-    log->total++;
-    if (log->total % log->decimation != 0) return;
+    if (!log) return;
 
-    if (log->pending) {
-        if (aio_error(&log->req) != EINPROGRESS) {
-            log->pending = false;
-            if (aio_return(&log->req) <= 0) {
-                warnx("log %s", log->path);
-                close(log->req.aio_fildes);
-                log->req.aio_fildes = -1;
+    /* wait for everything queued to reach the file; frames that cannot be
+     * submitted after the retries are counted as missed */
+    if (log->fd >= 0) {
+        while (log->count) {
+            if (owl_log_kick(log, true)) break;
+            if (!log->inflight) {
+                if (retries++ == OWL_LOG_FINI_RETRIES) {
+                    warnx("log %s: %u frames not written", log->path,
+                          log->count);
+                    log->missed += log->count;
+                    break;
+                }
+                nanosleep(&backoff, NULL);
+                continue;
             }
-        } else {
-            log->skipped = true;
-            log->missed++;
-            return;
+            if (owl_log_reap(log, true)) break;
         }
+        close(log->fd);
+        log->fd = -1;
+    }
+    if (!log->uring) {
+        /* the buffers of failed writes must not be freed under aio */
+        for (int i = 0; i < PHSP_LOG_SLOTS; i++) {
+            const struct aiocb *l[1] = { &log->slot[i].req };
+
+            if (log->slot[i].state != PHSP_LOG_INFLIGHT) continue;
+            while (aio_error(l[0]) == EINPROGRESS) aio_suspend(l, 1, NULL);
+        }
+    }
+
+    owl_uring_fini(log);
+    free(log->arena);
+    log->arena = NULL;
+}
+
+/* ---------------------------------------------------------------------- */
+/* Logger counters ------------------------------------------------------- */
+void
+owl_log_stats(const struct phasespace_log_s *log, phasespace_log_stats *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    if (!log) return;
+
+    stats->total = log->total;
+    stats->logged = log->logged;
+    stats->missed = log->missed;
+    stats->dropped_oldest = log->dropped_oldest;
+    stats->dropped_newest = log->dropped_newest;
+    stats->blocked = log->blocked;
+    stats->truncated = log->truncated;
+    stats->queued = log->count - log->inflight;
+    stats->inflight = log->inflight;
+    stats->uring = log->uring != NULL;
+}
+
+/* ---------------------------------------------------------------------- */
+/* Format a frame as text lines ------------------------------------------ */
+
+/*
+ * Frame-to-frame displacement of each entry of cur from the entry of prev
+ * with the same id, 0 for ids not in prev (or 0, unknown). Entries are
+ * matched by index while both frames list the same ids in the same order,
+ * and through a hash of the previous ids otherwise, e.g. when markers are
+ * tracked.
+ */
+static void
+owl_log_noise(const phasespace_soa *cur, const phasespace_soa *prev,
+              double *d)
+{
+    enum { SIZE = 2 * PHASESPACE_MAX_MARKERS };
+    phasespace_soa matched;
+    int32_t slot[SIZE];
+    size_t i, n = cur->n < prev->n ? cur->n : prev->n;
+    uint32_t h;
+
+    for (i = 0; i < n && cur->id[i] == prev->id[i]; i++);
+    if (i == cur->n) {
+        phsp_soa_norms(cur, prev, cur->n, d);
+        return;
+    }
+
+    for (h = 0; h < SIZE; h++) slot[h] = -1;
+    for (i = 0; i < prev->n; i++) {
+        if (!prev->id[i]) continue;
+        h = (uint32_t)prev->id[i] % SIZE;
+        while (slot[h] >= 0) h = (h + 1) % SIZE;
+        slot[h] = i;
     }
 
-    char *bufptr = log->buffer;
-    size_t bufrem = sizeof(log->buffer);
+    matched.n = cur->n;
+    for (i = 0; i < cur->n; i++) {
+        int32_t j = -1;
+
+        if (cur->id[i])
+            for (h = (uint32_t)cur->id[i] % SIZE; slot[h] >= 0;
+                 h = (h + 1) % SIZE)
+                if (prev->id[slot[h]] == cur->id[i]) { j = slot[h]; break; }
+
+        /* unmatched entries have no displacement */
+        matched.x[i] = j < 0 ? cur->x[i] : prev->x[j];
+        matched.y[i] = j < 0 ? cur->y[i] : prev->y[j];
+        matched.z[i] = j < 0 ? cur->z[i] : prev->z[j];
+    }
+    phsp_soa_norms(cur, &matched, cur->n, d);
+}
+
+static size_t
+owl_log_text(struct phasespace_log_s *log, const phasespace_bodies *bodies,
+             char *buf, size_t size)
+{
+    double mnoise[PHASESPACE_MAX_MARKERS], rnoise[PHASESPACE_MAX_RIGIDS];
+    double qw[PHASESPACE_MAX_RIGIDS], qx[PHASESPACE_MAX_RIGIDS];
+    double qy[PHASESPACE_MAX_RIGIDS], qz[PHASESPACE_MAX_RIGIDS];
+    double roll[PHASESPACE_MAX_RIGIDS], pitch[PHASESPACE_MAX_RIGIDS];
+    double yaw[PHASESPACE_MAX_RIGIDS];
+    phasespace_soa *t;
+    char *bufptr = buf;
+    size_t bufrem = size;
+
+    /* Frame-to-frame displacement of all markers and rigids at once */
+    phsp_soa_from_markers(log->markers[0], bodies->markers,
+                          bodies->num_markers);
+    owl_log_noise(log->markers[0], log->markers[1], mnoise);
+
+    phsp_soa_from_rigids(log->rigids[0], bodies->rigids, bodies->num_rigids);
+    owl_log_noise(log->rigids[0], log->rigids[1], rnoise);
+
+    /* Save frame for next noise calculation */
+    t = log->markers[1]; log->markers[1] = log->markers[0]; log->markers[0] = t;
+    t = log->rigids[1]; log->rigids[1] = log->rigids[0]; log->rigids[0] = t;
 
     /* Markers */
     for (size_t i = 0; i < bodies->num_markers; i++) {
         const phasespace_marker_s *m = &bodies->markers[i];
-        double noise = 0.0;
-        if (i < log->prev_bodies.num_markers) {
-            const phasespace_marker_s *prev = &log->prev_bodies.markers[i];
-            double dx = m->x - prev->x;
-            double dy = m->y - prev->y;
-            double dz = m->z - prev->z;
-            noise = sqrt(dx*dx + dy*dy + dz*dz);
-        }
-        int n = snprintf(bufptr, bufrem,
-                         "marker %" PRIu64 ".%09d %g %g %g 0 0 0 %g %g\n",
-                         (uint64_t)m->time, 0,
+        int n = snprintf(bufptr, bufrem, phsp_log_marker_line,
+                         phsp_log_ts(m->time),
                          m->x, m->y, m->z,
-                         m->cond, noise);
-        if (n <= 0 || (size_t)n >= bufrem) break;
+                         m->cond, mnoise[i]);
+        if (n <= 0 || (size_t)n >= bufrem) { log->truncated++; goto done; }
         bufptr += n;
         bufrem -= n;
     }
 
-    /* Rigid bodies */
+    /* Rigid bodies, with all orientations converted in one pass */
     for (size_t i = 0; i < bodies->num_rigids; i++) {
-        const phasespace_rigid_s *r = &bodies->rigids[i];
-        double qw = r->qw, qx = r->qx, qy = r->qy, qz = r->qz;
-        double roll = atan2(2*(qw*qx + qy*qz), 1 - 2*(qx*qx + qy*qy));
-        double pitch = asin(fmax(fmin(2*(qw*qy - qz*qx), 1.0), -1.0));
-        double yaw = atan2(2*(qw*qz + qx*qy), 1 - 2*(qy*qy + qz*qz));
-
-        double noise = 0.0;
-        if (i < log->prev_bodies.num_rigids) {
-            const phasespace_rigid_s *prev = &log->prev_bodies.rigids[i];
-            double dx = r->x - prev->x;
-            double dy = r->y - prev->y;
-            double dz = r->z - prev->z;
-            noise = sqrt(dx*dx + dy*dy + dz*dz);
-        }
+        qw[i] = bodies->rigids[i].qw;
+        qx[i] = bodies->rigids[i].qx;
+        qy[i] = bodies->rigids[i].qy;
+        qz[i] = bodies->rigids[i].qz;
+    }
+    phsp_quat2euler(bodies->num_rigids, qw, qx, qy, qz, roll, pitch, yaw,
+                    false);
 
-        int n = snprintf(bufptr, bufrem,
-                         "rigid %" PRIu64 ".%09d %g %g %g %g %g %g %g %g\n",
-                         (uint64_t)r->time, 0,
+    for (size_t i = 0; i < bodies->num_rigids; i++) {
+        const phasespace_rigid_s *r = &bodies->rigids[i];
+        int n = snprintf(bufptr, bufrem, phsp_log_rigid_line,
+                         phsp_log_ts(r->time),
                          r->x, r->y, r->z,
-                         roll, pitch, yaw,
-                         r->cond, noise);
-        if (n <= 0 || (size_t)n >= bufrem) break;
+                         roll[i], pitch[i], yaw[i],
+                         r->cond, rnoise[i]);
+        if (n <= 0 || (size_t)n >= bufrem) { log->truncated++; break; }
         bufptr += n;
         bufrem -= n;
     }
 
-    log->req.aio_nbytes = bufptr - log->buffer;
+done:
+    return bufptr - buf;
+}
 
-    if (aio_write(&log->req)) {
-        warnx("log %s", log->path);
-        close(log->req.aio_fildes);
-        log->req.aio_fildes = -1;
-    } else {
-        log->pending = true;
-        log->skipped = false;
+/* ---------------------------------------------------------------------- */
+/* Format a frame as binary records -------------------------------------- */
+static inline double
+owl_htoled(double v)
+{
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+    uint64_t u;
+
+    memcpy(&u, &v, sizeof(u));
+    u = htole64(u);
+    memcpy(&v, &u, sizeof(v));
+#endif
+    return v;
+}
+
+static size_t
+owl_log_binary(struct phasespace_log_s *log, const phasespace_bodies *bodies,
+               char *buf, size_t size)
+{
+    struct phsp_log_frame_rec f;
+    struct phsp_log_marker_rec mr;
+    struct phsp_log_rigid_rec rr;
+    size_t nm, nr, i;
+    char *bufptr;
+
+    /* records are fixed size: emit only what fits, with matching counts */
+    if (size < sizeof(f)) return 0;
+    size -= sizeof(f);
+    nm = bodies->num_markers;
+    if (nm > size / sizeof(mr)) nm = size / sizeof(mr);
+    size -= nm * sizeof(mr);
+    nr = bodies->num_rigids;
+    if (nr > size / sizeof(rr)) nr = size / sizeof(rr);
+    if (nm < bodies->num_markers || nr < bodies->num_rigids) log->truncated++;
+
+    f.seq = htole64(log->total);
+    f.num_markers = htole32(nm);
+    f.num_rigids = htole32(nr);
+    memcpy(buf, &f, sizeof(f));
+    bufptr = buf + sizeof(f);
+
+    for (i = 0; i < nm; i++) {
+        const phasespace_marker_s *m = &bodies->markers[i];
+
+        mr.id = htole32(m->id);
+        mr.flags = htole32(m->flags);
+        mr.time = htole64(m->time);
+        mr.x = owl_htoled(m->x);
+        mr.y = owl_htoled(m->y);
+        mr.z = owl_htoled(m->z);
+        mr.cond = owl_htoled(m->cond);
+        memcpy(bufptr, &mr, sizeof(mr));
+        bufptr += sizeof(mr);
     }
 
-    /* Save frame for next noise calculation */
-    log->prev_bodies = *bodies;
+    for (i = 0; i < nr; i++) {
+        const phasespace_rigid_s *r = &bodies->rigids[i];
+
+        rr.id = htole32(r->id);
+        rr.flags = htole32(r->flags);
+        rr.time = htole64(r->time);
+        rr.x = owl_htoled(r->x);
+        rr.y = owl_htoled(r->y);
+        rr.z = owl_htoled(r->z);
+        rr.qw = owl_htoled(r->qw);
+        rr.qx = owl_htoled(r->qx);
+        rr.qy = owl_htoled(r->qy);
+        rr.qz = owl_htoled(r->qz);
+        rr.cond = owl_htoled(r->cond);
+        memcpy(bufptr, &rr, sizeof(rr));
+        bufptr += sizeof(rr);
+    }
+
+    return bufptr - buf;
+}
+
+/* ---------------------------------------------------------------------- */
+/* Binary log file header ------------------------------------------------ */
+size_t
+owl_log_binary_header(const struct phasespace_log_s *log, char *buf,
+                      size_t size)
+{
+    struct phsp_log_file_hdr h;
+
+    if (size < sizeof(h)) return 0;
+
+    memset(&h, 0, sizeof(h));
+    strncpy(h.magic, PHSP_LOG_MAGIC, sizeof(h.magic));
+    h.version = htole16(PHSP_LOG_VERSION);
+    h.hdr_size = htole16(sizeof(struct phsp_log_file_hdr));
+    h.frame_size = htole16(sizeof(struct phsp_log_frame_rec));
+    h.marker_size = htole16(sizeof(struct phsp_log_marker_rec));
+    h.rigid_size = htole16(sizeof(struct phsp_log_rigid_rec));
+    h.decimation = htole32(log->decimation);
+    memcpy(buf, &h, sizeof(h));
+
+    return sizeof(h);
 }
 
+/* ---------------------------------------------------------------------- */
+/* Log a frame with condition and noise ---------------------------------- */
+void
+owl_log(struct phasespace_log_s *log, const phasespace_bodies *bodies)
+{
+    struct phsp_log_slot *s;
+    size_t n;
+
+    if (!log || !bodies || log->fd < 0) return;
+
+    log->total++;
+    if (log->total % log->decimation != 0) return;
+
+    /* recycle slots whose write completed */
+    if (owl_log_reap(log, false) || owl_log_kick(log, false)) goto err;
+
+    if (owl_log_slot_get(log, &s)) goto err;
+    if (!s) return;
+
+    if (log->format == PHSP_LOG_BINARY)
+        n = owl_log_binary(log, bodies, s->buffer, PHSP_LOG_SLOT_SIZE);
+    else
+        n = owl_log_text(log, bodies, s->buffer, PHSP_LOG_SLOT_SIZE);
+
+    if (owl_log_slot_put(log, s, n)) goto err;
+    return;
+
+err:
+    warnx("log %s", log->path);
+    close(log->fd);
+    log->fd = -1;
+}
@@ -20,21 +20,110 @@
 #include <stdint.h>
 #include "phasespace_c_types.h"
 
-typedef struct phasespace_server_s *phasespace_server_s;
+struct phasespace_server_s *
+    owl_connect(const char *host, const char *port, uint32_t transport,
+                uint32_t timeout);
 
-phasespace_server_s
-    owl_connect(const char *host, const char *port);
+int
+    owl_tune(struct phasespace_server_s *server,
+             const phasespace_sock_opts *opts);
+
+int
+    owl_poll(const struct phasespace_server_s *server,
+             struct timeval *timeout);
 
 int
-    owl_poll(phasespace_server_s server, struct timeval *timeout);
+    owl_wait(struct phasespace_server_s *server, uint32_t spin_us,
+             int timeout);
 
 uint32_t
-    owl_version(phasespace_server_s server);
+    owl_version(const struct phasespace_server_s *server);
+
+void
+    owl_disconnect(struct phasespace_server_s *server);
+
+int
+    owl_log_init(struct phasespace_log_s *log, const char *path,
+                 uint32_t decimation, uint32_t format, uint32_t policy);
+
+void
+    owl_log_fini(struct phasespace_log_s *log);
+
+void
+    owl_log(struct phasespace_log_s *log, const phasespace_bodies *bodies);
+
+void
+    owl_log_stats(const struct phasespace_log_s *log,
+                  phasespace_log_stats *stats);
+
+size_t
+    owl_log_binary_header(const struct phasespace_log_s *log, char *buf,
+                          size_t size);
+
+/* raw stream capture and replay (owl_capture.c) */
+int
+    owl_capture_start(struct phasespace_server_s *server, const char *path);
+
+void
+    owl_capture_stop(struct phasespace_server_s *server);
+
+void
+    owl_capture(struct phasespace_server_s *server, const void *data,
+                size_t len);
+
+struct phasespace_server_s *
+    owl_replay(const char *path, double speed);
+
+bool
+    owl_replay_chunk(struct phasespace_server_s *server, uint64_t at,
+                     uint64_t *end, int64_t *t);
 
 void
-    owl_disconnect(phasespace_server_s *server);
+    owl_replay_stop(struct phasespace_server_s *server);
+
+/* supervised connection (owl_reconnect.c) */
+struct phasespace_reconnect_s *
+    owl_reconnect_create(void);
+
+void
+    owl_reconnect_destroy(struct phasespace_reconnect_s *rc);
+
+void
+    owl_reconnect_supervise(struct phasespace_reconnect_s *rc,
+                            const char *host, const char *port,
+                            uint32_t transport, uint32_t timeout);
+
+void
+    owl_reconnect_cancel(struct phasespace_reconnect_s *rc);
+
+void
+    owl_reconnect_lost(struct phasespace_reconnect_s *rc);
+
+struct phasespace_server_s *
+    owl_reconnect_take(struct phasespace_reconnect_s *rc);
+
+int
+    owl_reconnect_backoff(struct phasespace_reconnect_s *rc, uint32_t min,
+                          uint32_t max);
+
+void
+    owl_reconnect_stats(struct phasespace_reconnect_s *rc,
+                        phasespace_conn_stats *stats);
+
+/* io_uring logger backend (owl_uring.c) */
+int
+    owl_uring_init(struct phasespace_log_s *log);
 
 void
-    owl_log(struct phasespace_log_s *log, const struct phasespace_bodies *bodies);
+    owl_uring_fini(struct phasespace_log_s *log);
+
+int
+    owl_uring_prep(struct phasespace_log_s *log, struct phsp_log_slot *s);
+
+int
+    owl_uring_submit(struct phasespace_log_s *log);
+
+int
+    owl_uring_reap(struct phasespace_log_s *log, bool wait);
 
 #endif /* H_PHASESPACE_OWL */
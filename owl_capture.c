@@ -0,0 +1,448 @@
+/*
+ * Copyright (c) 2025 UCL
+ * All rights reserved.
+ *
+ * Redistribution and use  in source  and binary  forms,  with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *   1. Redistributions of  source  code must retain the  above copyright
+ *      notice and this list of conditions.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice and  this list of  conditions in the  documentation and/or
+ *      other materials provided with the distribution.
+ *
+ * owl_capture.c — record and replay of raw OWL streams
+ *
+ * Capture tees every chunk returned by recv() in owl_recv() to a file,
+ * with its receive time (see phsp_wire.h for the format). Chunks are copied
+ * into a ring and written by a thread, so that the receiving task never
+ * waits for the disk; if the disk falls behind by a full ring, the capture
+ * ends there and the file stays valid up to that point. Replay creates a
+ * server whose fd is one end of a socketpair, and a thread writes the
+ * captured chunks to the other end at their original pace scaled by a
+ * speed factor (0 for as fast as possible). The replayed bytes go through
+ * the very same owl_recv()/owl_decode_frame() path as a live stream, and
+ * the replay ends like a server disconnection. The thread queues the
+ * recorded receive time of each chunk before sending it, and owl_recv()
+ * reads the chunks one at a time with that time instead of the current
+ * one, so that frame times do not depend on the replay speed.
+ */
+
+#include "phasespace_c_types.h"
+#include "owl.h"
+#include "phsp.h"
+
+#include <endian.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define OWL_CAPTURE_BUFSZ	(256 * 1024)
+#define OWL_CAPTURE_RING	(4 * 1024 * 1024)	/* power of 2 */
+#define OWL_REPLAY_CHUNKS	1024	/* power of 2 */
+#define OWL_REPLAY_WAIT	1000000	/* reader poll when chunks are full, ns */
+
+struct owl_capture {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool stop;
+
+    int fd;
+    int error;			/* errno of a failed write, read on stop */
+    bool overrun;		/* ring was full, later chunks are ignored */
+    char *ring;
+    uint64_t head;		/* bytes written to the file */
+    uint64_t tail;		/* bytes queued by owl_capture() */
+};
+
+struct owl_replay {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool stop;
+
+    FILE *file;
+    int fd;			/* writing end of the socketpair */
+    double speed;
+
+    /* recorded receive time of the chunks sent, see owl_replay_chunk() */
+    int64_t start;		/* CLOCK_REALTIME of the capture start, ns */
+    uint64_t sent;		/* stream offset after the last chunk queued */
+    struct { uint64_t end; int64_t t; } chunk[OWL_REPLAY_CHUNKS];
+    uint64_t chunk_head;	/* chunks read, written by the reader */
+    uint64_t chunk_tail;	/* chunks queued, written by the thread */
+};
+
+static inline uint64_t
+owl_capture_now(clockid_t clock)
+{
+    struct timespec ts;
+
+    clock_gettime(clock, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+/* ---------------------------------------------------------------------- */
+/* Capture --------------------------------------------------------------- */
+
+/* write queued bytes until stopped and the ring is empty */
+static void *
+owl_capture_thread(void *arg)
+{
+    struct owl_capture *c = arg;
+    uint64_t head = c->head, tail;
+    size_t off, len;
+    ssize_t n;
+    bool stop;
+
+    while (1) {
+        pthread_mutex_lock(&c->lock);
+        while (!c->stop &&
+               __atomic_load_n(&c->tail, __ATOMIC_ACQUIRE) == head)
+            pthread_cond_wait(&c->cond, &c->lock);
+        stop = c->stop;
+        pthread_mutex_unlock(&c->lock);
+
+        tail = __atomic_load_n(&c->tail, __ATOMIC_ACQUIRE);
+        if (tail == head && stop) break;
+
+        while (head != tail && !c->error) {
+            off = head % OWL_CAPTURE_RING;
+            len = tail - head;
+            if (len > OWL_CAPTURE_RING - off) len = OWL_CAPTURE_RING - off;
+
+            n = write(c->fd, c->ring + off, len);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                __atomic_store_n(&c->error, errno, __ATOMIC_RELAXED);
+                break;
+            }
+            head += n;
+            __atomic_store_n(&c->head, head, __ATOMIC_RELEASE);
+        }
+        if (c->error) break;
+    }
+
+    return NULL;
+}
+
+static void
+owl_capture_copy(struct owl_capture *c, uint64_t at, const void *data,
+                 size_t len)
+{
+    size_t off = at % OWL_CAPTURE_RING, n = OWL_CAPTURE_RING - off;
+
+    if (n > len) n = len;
+    memcpy(c->ring + off, data, n);
+    memcpy(c->ring, (const char *)data + n, len - n);
+}
+
+int
+owl_capture_start(struct phasespace_server_s *server, const char *path)
+{
+    struct owl_capture_hdr h;
+    struct owl_capture *c;
+    int e;
+
+    if (!server || !path) { errno = EINVAL; return -1; }
+    owl_capture_stop(server);
+
+    c = calloc(1, sizeof(*c));
+    if (!c) return -1;
+    c->ring = malloc(OWL_CAPTURE_RING);
+    if (!c->ring) goto err;
+
+    c->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (c->fd < 0) goto err;
+
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, OWL_CAPTURE_MAGIC, sizeof(OWL_CAPTURE_MAGIC));
+    h.version = htole16(OWL_CAPTURE_VERSION);
+    h.hdr_size = htole16(sizeof(h));
+    h.start = htole64(owl_capture_now(CLOCK_REALTIME));
+    if (write(c->fd, &h, sizeof(h)) != sizeof(h)) {
+        if (!errno) errno = EIO;
+        goto err_fd;
+    }
+
+    pthread_mutex_init(&c->lock, NULL);
+    pthread_cond_init(&c->cond, NULL);
+    e = pthread_create(&c->thread, NULL, owl_capture_thread, c);
+    if (e) {
+        pthread_cond_destroy(&c->cond);
+        pthread_mutex_destroy(&c->lock);
+        errno = e;
+        goto err_fd;
+    }
+
+    server->capture_t0 = owl_capture_now(CLOCK_MONOTONIC);
+    server->capture = c;
+    return 0;
+
+err_fd:
+    e = errno;
+    close(c->fd);
+    errno = e;
+err:
+    free(c->ring);
+    free(c);
+    return -1;
+}
+
+/* write out the queued chunks and close the file */
+void
+owl_capture_stop(struct phasespace_server_s *server)
+{
+    struct owl_capture *c;
+
+    if (!server || !server->capture) return;
+    c = server->capture;
+
+    pthread_mutex_lock(&c->lock);
+    c->stop = true;
+    pthread_cond_signal(&c->cond);
+    pthread_mutex_unlock(&c->lock);
+    pthread_join(c->thread, NULL);
+
+    if (c->error) { errno = c->error; warn("owl capture"); }
+    if (c->overrun) warnx("owl capture: disk too slow, capture truncated");
+    if (close(c->fd)) warn("owl capture");
+
+    pthread_cond_destroy(&c->cond);
+    pthread_mutex_destroy(&c->lock);
+    free(c->ring);
+    free(c);
+    server->capture = NULL;
+}
+
+/* queue one received chunk for the writer thread; never blocks on the
+ * disk */
+void
+owl_capture(struct phasespace_server_s *server, const void *data, size_t len)
+{
+    struct owl_capture *c = server->capture;
+    struct owl_capture_chunk h;
+    uint64_t tail = c->tail;
+
+    if (c->overrun || __atomic_load_n(&c->error, __ATOMIC_RELAXED)) return;
+    if (sizeof(h) + len > OWL_CAPTURE_RING -
+        (tail - __atomic_load_n(&c->head, __ATOMIC_ACQUIRE))) {
+        c->overrun = true;
+        return;
+    }
+
+    h.t = htole64(owl_capture_now(CLOCK_MONOTONIC) - server->capture_t0);
+    h.len = htole32(len);
+    h.reserved = 0;
+    owl_capture_copy(c, tail, &h, sizeof(h));
+    owl_capture_copy(c, tail + sizeof(h), data, len);
+    __atomic_store_n(&c->tail, tail + sizeof(h) + len, __ATOMIC_RELEASE);
+
+    pthread_mutex_lock(&c->lock);
+    pthread_cond_signal(&c->cond);
+    pthread_mutex_unlock(&c->lock);
+}
+
+
+/* ---------------------------------------------------------------------- */
+/* Replay ---------------------------------------------------------------- */
+
+/* wait until the absolute CLOCK_MONOTONIC time 'at', return true if the
+ * replay was stopped meanwhile */
+static bool
+owl_replay_sleep(struct owl_replay *r, uint64_t at)
+{
+    struct timespec ts = {
+        .tv_sec = at / 1000000000ULL, .tv_nsec = at % 1000000000ULL
+    };
+    bool stop;
+
+    pthread_mutex_lock(&r->lock);
+    while (!r->stop &&
+           pthread_cond_timedwait(&r->cond, &r->lock, &ts) != ETIMEDOUT);
+    stop = r->stop;
+    pthread_mutex_unlock(&r->lock);
+
+    return stop;
+}
+
+static void *
+owl_replay_thread(void *arg)
+{
+    struct owl_replay *r = arg;
+    struct owl_capture_chunk c;
+    uint64_t start = owl_capture_now(CLOCK_MONOTONIC);
+    char *buf = NULL;
+    size_t size = 0, len;
+    ssize_t n;
+
+    while (fread(&c, sizeof(c), 1, r->file) == 1) {
+        len = le32toh(c.len);
+        if (len > size) {
+            char *b = realloc(buf, len);
+            if (!b) { warn("owl replay"); break; }
+            buf = b;
+            size = len;
+        }
+        if (fread(buf, len, 1, r->file) != 1) {
+            warnx("owl replay: truncated capture");
+            break;
+        }
+
+        if (r->speed > 0. &&
+            owl_replay_sleep(r, start + le64toh(c.t) / r->speed))
+            break;
+
+        /* queue the chunk time before its bytes can be read */
+        while (r->chunk_tail - __atomic_load_n(&r->chunk_head,
+                                               __ATOMIC_ACQUIRE)
+               == OWL_REPLAY_CHUNKS)
+            if (owl_replay_sleep(r, owl_capture_now(CLOCK_MONOTONIC) +
+                                 OWL_REPLAY_WAIT))
+                goto done;
+        r->sent += len;
+        r->chunk[r->chunk_tail % OWL_REPLAY_CHUNKS].end = r->sent;
+        r->chunk[r->chunk_tail % OWL_REPLAY_CHUNKS].t =
+            r->start + le64toh(c.t);
+        __atomic_store_n(&r->chunk_tail, r->chunk_tail + 1, __ATOMIC_RELEASE);
+
+        for (char *p = buf; len > 0; p += n, len -= n) {
+            n = send(r->fd, p, len, MSG_NOSIGNAL);
+            if (n < 0) {
+                if (errno == EINTR) { n = 0; continue; }
+                goto done; /* reader went away */
+            }
+        }
+    }
+
+done:
+    /* signal the end of the stream to the reader */
+    shutdown(r->fd, SHUT_WR);
+    free(buf);
+    return NULL;
+}
+
+struct phasespace_server_s *
+owl_replay(const char *path, double speed)
+{
+    struct phasespace_server_s *server;
+    struct owl_capture_hdr h;
+    struct owl_replay *r;
+    pthread_condattr_t attr;
+    int sv[2], e;
+
+    if (!path || speed < 0.) { errno = EINVAL; return NULL; }
+
+    server = calloc(1, sizeof(*server));
+    r = calloc(1, sizeof(*r));
+    if (!server || !r) {
+        free(server);
+        free(r);
+        errno = ENOMEM;
+        return NULL;
+    }
+    server->fd = -1;
+    server->epfd = -1;
+    r->fd = -1;
+    r->speed = speed;
+
+    r->file = fopen(path, "rb");
+    if (!r->file) goto err;
+    setvbuf(r->file, NULL, _IOFBF, OWL_CAPTURE_BUFSZ);
+    if (fread(&h, sizeof(h), 1, r->file) != 1 ||
+        memcmp(h.magic, OWL_CAPTURE_MAGIC, sizeof(OWL_CAPTURE_MAGIC)) ||
+        le16toh(h.version) > OWL_CAPTURE_VERSION ||
+        le16toh(h.hdr_size) < sizeof(h) ||
+        fseek(r->file, le16toh(h.hdr_size) - sizeof(h), SEEK_CUR)) {
+        errno = EINVAL;
+        goto err;
+    }
+    r->start = le64toh(h.start);
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv)) goto err;
+    server->fd = sv[0];
+    r->fd = sv[1];
+
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&r->cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    e = pthread_create(&r->thread, NULL, owl_replay_thread, r);
+    if (e) {
+        pthread_cond_destroy(&r->cond);
+        pthread_mutex_destroy(&r->lock);
+        errno = e;
+        goto err;
+    }
+
+    server->replay = r;
+    return server;
+
+err:
+    e = errno;
+    if (r->file) fclose(r->file);
+    if (r->fd >= 0) close(r->fd);
+    free(r);
+    if (server->fd >= 0) close(server->fd);
+    free(server);
+    errno = e;
+    return NULL;
+}
+
+/* recorded receive time t of the replayed stream up to offset *end, for the
+ * first chunk not entirely read at offset 'at'. Returns false if no such
+ * chunk was queued yet. */
+bool
+owl_replay_chunk(struct phasespace_server_s *server, uint64_t at,
+                 uint64_t *end, int64_t *t)
+{
+    struct owl_replay *r = server->replay;
+    uint64_t head = r->chunk_head;
+    uint64_t tail = __atomic_load_n(&r->chunk_tail, __ATOMIC_ACQUIRE);
+
+    while (head != tail && r->chunk[head % OWL_REPLAY_CHUNKS].end <= at)
+        head++;
+    __atomic_store_n(&r->chunk_head, head, __ATOMIC_RELEASE);
+    if (head == tail) return false;
+
+    *end = r->chunk[head % OWL_REPLAY_CHUNKS].end;
+    *t = r->chunk[head % OWL_REPLAY_CHUNKS].t;
+    return true;
+}
+
+/* stop the feeder thread of a replayed server, before its fd is closed */
+void
+owl_replay_stop(struct phasespace_server_s *server)
+{
+    struct owl_replay *r;
+
+    if (!server || !server->replay) return;
+    r = server->replay;
+
+    pthread_mutex_lock(&r->lock);
+    r->stop = true;
+    pthread_cond_signal(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+
+    /* unblock a pending send() */
+    shutdown(server->fd, SHUT_RDWR);
+    pthread_join(r->thread, NULL);
+
+    pthread_cond_destroy(&r->cond);
+    pthread_mutex_destroy(&r->lock);
+    fclose(r->file);
+    close(r->fd);
+    free(r);
+    server->replay = NULL;
+}
@@ -0,0 +1,298 @@
+/*
+ * Copyright (c) 2025 UCL
+ * All rights reserved.
+ *
+ * Redistribution and use  in source  and binary  forms,  with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *   1. Redistributions of  source  code must retain the  above copyright
+ *      notice and this list of conditions.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice and  this list of  conditions in the  documentation and/or
+ *      other materials provided with the distribution.
+ *
+ * owl_reconnect.c — supervised OWL connection
+ *
+ * Once a connection was established by the connect activity, the
+ * supervisor remembers its target. When the publish task loses the
+ * connection, it reports it with owl_reconnect_lost() and a thread
+ * reconnects, first at once and then with an exponential backoff, so that
+ * the time-bounded owl_connect() never runs in the publish task. The
+ * new server is handed over with owl_reconnect_take(), which never blocks.
+ */
+
+#include "phasespace_c_types.h"
+#include "owl.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define OWL_RECONNECT_MIN	10	/* default backoff bounds, ms */
+#define OWL_RECONNECT_MAX	1000
+
+struct phasespace_reconnect_s {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool quit;
+
+    /* target and state, under lock */
+    char host[128], port[128];
+    uint32_t transport;
+    uint32_t timeout;		/* connection deadline, ms */
+    uint32_t generation;	/* bumped by each new target or cancel */
+    uint32_t state;		/* enum phsp_conn_state */
+    struct phasespace_server_s *ready; /* connected, not yet taken */
+
+    uint32_t backoff_min, backoff_max, backoff; /* ms */
+    uint64_t rng;
+    uint64_t attempts, reconnects, failures;
+    int error;			/* errno of the last failed attempt */
+};
+
+/* absolute CLOCK_MONOTONIC time in ms from now, with +-25% jitter so that
+ * several clients do not retry in lockstep */
+static struct timespec
+owl_reconnect_deadline(struct phasespace_reconnect_s *rc, uint32_t ms)
+{
+    struct timespec ts;
+    uint64_t ns;
+
+    rc->rng ^= rc->rng >> 12;
+    rc->rng ^= rc->rng << 25;
+    rc->rng ^= rc->rng >> 27;
+    ns = ms * 1000000ULL;
+    ns = ns * 3 / 4 + (rc->rng * 0x2545f4914f6cdd1dULL >> 11) % (ns / 2 + 1);
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    ns += ts.tv_nsec;
+    ts.tv_sec += ns / 1000000000ULL;
+    ts.tv_nsec = ns % 1000000000ULL;
+    return ts;
+}
+
+static void *
+owl_reconnect_thread(void *arg)
+{
+    struct phasespace_reconnect_s *rc = arg;
+    struct phasespace_server_s *server;
+    char host[128], port[128];
+    uint32_t transport, timeout, generation;
+    struct timespec at;
+    int e;
+
+    pthread_mutex_lock(&rc->lock);
+    while (!rc->quit) {
+        if (rc->state != PHSP_CONN_CONNECTING) {
+            pthread_cond_wait(&rc->cond, &rc->lock);
+            continue;
+        }
+
+        memcpy(host, rc->host, sizeof(host));
+        memcpy(port, rc->port, sizeof(port));
+        transport = rc->transport;
+        timeout = rc->timeout;
+        generation = rc->generation;
+        rc->attempts++;
+        pthread_mutex_unlock(&rc->lock);
+
+        server = owl_connect(host, port, transport, timeout);
+        e = errno;
+
+        pthread_mutex_lock(&rc->lock);
+        if (generation != rc->generation ||
+            rc->state != PHSP_CONN_CONNECTING) {
+            /* target changed or cancelled meanwhile */
+            if (server) owl_disconnect(server);
+            continue;
+        }
+
+        if (server) {
+            rc->ready = server;
+            rc->state = PHSP_CONN_CONNECTED;
+            rc->backoff = 0;
+            rc->reconnects++;
+            continue;
+        }
+
+        rc->failures++;
+        rc->error = e;
+        rc->backoff = rc->backoff ?
+            (rc->backoff > rc->backoff_max / 2 ?
+             rc->backoff_max : 2 * rc->backoff) : rc->backoff_min;
+        rc->state = PHSP_CONN_BACKOFF;
+
+        at = owl_reconnect_deadline(rc, rc->backoff);
+        while (!rc->quit && generation == rc->generation &&
+               pthread_cond_timedwait(&rc->cond, &rc->lock, &at) != ETIMEDOUT);
+        if (generation == rc->generation && rc->state == PHSP_CONN_BACKOFF)
+            rc->state = PHSP_CONN_CONNECTING;
+    }
+    pthread_mutex_unlock(&rc->lock);
+
+    return NULL;
+}
+
+
+/* ---------------------------------------------------------------------- */
+/* Supervisor ------------------------------------------------------------ */
+struct phasespace_reconnect_s *
+owl_reconnect_create(void)
+{
+    struct phasespace_reconnect_s *rc;
+    pthread_condattr_t attr;
+    struct timespec ts;
+    int e;
+
+    rc = calloc(1, sizeof(*rc));
+    if (!rc) return NULL;
+
+    rc->state = PHSP_CONN_IDLE;
+    rc->backoff_min = OWL_RECONNECT_MIN;
+    rc->backoff_max = OWL_RECONNECT_MAX;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    rc->rng = (ts.tv_sec * 1000000000ULL + ts.tv_nsec) | 1;
+
+    pthread_mutex_init(&rc->lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&rc->cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    e = pthread_create(&rc->thread, NULL, owl_reconnect_thread, rc);
+    if (e) {
+        pthread_cond_destroy(&rc->cond);
+        pthread_mutex_destroy(&rc->lock);
+        free(rc);
+        errno = e;
+        return NULL;
+    }
+
+    return rc;
+}
+
+void
+owl_reconnect_destroy(struct phasespace_reconnect_s *rc)
+{
+    if (!rc) return;
+
+    /* an attempt in progress is not interrupted, but has a deadline */
+    pthread_mutex_lock(&rc->lock);
+    rc->quit = true;
+    pthread_cond_signal(&rc->cond);
+    pthread_mutex_unlock(&rc->lock);
+    pthread_join(rc->thread, NULL);
+
+    if (rc->ready) owl_disconnect(rc->ready);
+    pthread_cond_destroy(&rc->cond);
+    pthread_mutex_destroy(&rc->lock);
+    free(rc);
+}
+
+/*
+ * Remember the target of a server that was just connected, to reconnect
+ * to it when it is lost.
+ */
+void
+owl_reconnect_supervise(struct phasespace_reconnect_s *rc, const char *host,
+                        const char *port, uint32_t transport,
+                        uint32_t timeout)
+{
+    if (!rc) return;
+
+    pthread_mutex_lock(&rc->lock);
+    snprintf(rc->host, sizeof(rc->host), "%s", host);
+    snprintf(rc->port, sizeof(rc->port), "%s", port);
+    rc->transport = transport;
+    rc->timeout = timeout;
+    rc->generation++;
+    rc->state = PHSP_CONN_CONNECTED;
+    rc->backoff = 0;
+    if (rc->ready) owl_disconnect(rc->ready);
+    rc->ready = NULL;
+    pthread_cond_signal(&rc->cond);
+    pthread_mutex_unlock(&rc->lock);
+}
+
+/* stop supervising, e.g. after an explicit disconnection */
+void
+owl_reconnect_cancel(struct phasespace_reconnect_s *rc)
+{
+    if (!rc) return;
+
+    pthread_mutex_lock(&rc->lock);
+    rc->generation++;
+    rc->state = PHSP_CONN_IDLE;
+    if (rc->ready) owl_disconnect(rc->ready);
+    rc->ready = NULL;
+    pthread_cond_signal(&rc->cond);
+    pthread_mutex_unlock(&rc->lock);
+}
+
+/* the supervised connection was lost: start reconnecting */
+void
+owl_reconnect_lost(struct phasespace_reconnect_s *rc)
+{
+    if (!rc) return;
+
+    pthread_mutex_lock(&rc->lock);
+    if (rc->state == PHSP_CONN_CONNECTED && !rc->ready) {
+        rc->state = PHSP_CONN_CONNECTING;
+        pthread_cond_signal(&rc->cond);
+    }
+    pthread_mutex_unlock(&rc->lock);
+}
+
+/* a new connection if one was established since the loss, or NULL */
+struct phasespace_server_s *
+owl_reconnect_take(struct phasespace_reconnect_s *rc)
+{
+    struct phasespace_server_s *server;
+
+    if (!rc) return NULL;
+
+    pthread_mutex_lock(&rc->lock);
+    server = rc->ready;
+    rc->ready = NULL;
+    pthread_mutex_unlock(&rc->lock);
+
+    return server;
+}
+
+/* backoff bounds in ms, min > 0 and max >= min */
+int
+owl_reconnect_backoff(struct phasespace_reconnect_s *rc, uint32_t min,
+                      uint32_t max)
+{
+    if (!rc || !min || max < min) { errno = EINVAL; return -1; }
+
+    pthread_mutex_lock(&rc->lock);
+    rc->backoff_min = min;
+    rc->backoff_max = max;
+    if (rc->backoff > max) rc->backoff = max;
+    pthread_mutex_unlock(&rc->lock);
+
+    return 0;
+}
+
+void
+owl_reconnect_stats(struct phasespace_reconnect_s *rc,
+                    phasespace_conn_stats *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    if (!rc) return;
+
+    pthread_mutex_lock(&rc->lock);
+    stats->state = rc->state;
+    stats->attempts = rc->attempts;
+    stats->reconnects = rc->reconnects;
+    stats->failures = rc->failures;
+    stats->backoff = rc->backoff;
+    stats->error = rc->error;
+    pthread_mutex_unlock(&rc->lock);
+}
@@ -0,0 +1,319 @@
+/*
+ * Copyright (c) 2025 UCL
+ * All rights reserved.
+ *
+ * Redistribution and use  in source  and binary  forms,  with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *   1. Redistributions of  source  code must retain the  above copyright
+ *      notice and this list of conditions.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice and  this list of  conditions in the  documentation and/or
+ *      other materials provided with the distribution.
+ *
+ * owl_uring.c — io_uring backend for the asynchronous logger
+ *
+ * Slot buffers are registered once as fixed buffers, and the writes of
+ * several queued frames are submitted with a single io_uring_enter(). The
+ * ring is driven with raw system calls so that no extra library is needed;
+ * owl_uring_init() fails when the kernel (or a seccomp filter) does not
+ * provide io_uring and the logger then keeps using POSIX aio.
+ */
+
+#include "phasespace_c_types.h"
+#include "owl.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+# define HAVE_IO_URING
+#endif
+
+#ifdef HAVE_IO_URING
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+struct owl_uring {
+    int fd;
+    bool fixed;			/* slot buffers are registered */
+
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    unsigned tail;		/* local sq tail, published on submit */
+    unsigned pending;		/* prepared but not yet submitted */
+    unsigned busy;		/* submitted, completion not yet reaped */
+
+    void *sq_ptr, *cq_ptr;
+    size_t sq_sz, cq_sz, sqes_sz;
+};
+
+static int
+owl_uring_enter(struct owl_uring *u, unsigned submit, unsigned wait)
+{
+    int s;
+
+    do {
+        s = syscall(__NR_io_uring_enter, u->fd, submit, wait,
+                    wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    } while (s < 0 && errno == EINTR);
+
+    return s;
+}
+
+/* ---------------------------------------------------------------------- */
+/* Setup and teardown ---------------------------------------------------- */
+int
+owl_uring_init(struct phasespace_log_s *log)
+{
+    struct io_uring_params p;
+    struct iovec iov[PHSP_LOG_SLOTS];
+    struct owl_uring *u;
+    int i;
+
+    u = calloc(1, sizeof(*u));
+    if (!u) return -1;
+
+    memset(&p, 0, sizeof(p));
+    u->fd = syscall(__NR_io_uring_setup, PHSP_LOG_SLOTS, &p);
+    if (u->fd < 0) { free(u); return -1; }
+
+    u->sq_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cq_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (u->cq_sz > u->sq_sz) u->sq_sz = u->cq_sz;
+        u->cq_sz = u->sq_sz;
+    }
+    u->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    u->sq_ptr = mmap(NULL, u->sq_sz, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    if (u->sq_ptr == MAP_FAILED) goto err_fd;
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        u->cq_ptr = u->sq_ptr;
+    else {
+        u->cq_ptr = mmap(NULL, u->cq_sz, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+        if (u->cq_ptr == MAP_FAILED) goto err_sq;
+    }
+
+    u->sqes = mmap(NULL, u->sqes_sz, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED) goto err_cq;
+
+    u->sq_head = (unsigned *)((char *)u->sq_ptr + p.sq_off.head);
+    u->sq_tail = (unsigned *)((char *)u->sq_ptr + p.sq_off.tail);
+    u->sq_mask = (unsigned *)((char *)u->sq_ptr + p.sq_off.ring_mask);
+    u->sq_array = (unsigned *)((char *)u->sq_ptr + p.sq_off.array);
+    u->cq_head = (unsigned *)((char *)u->cq_ptr + p.cq_off.head);
+    u->cq_tail = (unsigned *)((char *)u->cq_ptr + p.cq_off.tail);
+    u->cq_mask = (unsigned *)((char *)u->cq_ptr + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)((char *)u->cq_ptr + p.cq_off.cqes);
+    u->tail = *u->sq_tail;
+
+    /* register slot buffers; plain writes are used if this is refused
+     * (e.g. RLIMIT_MEMLOCK too low) */
+    for (i = 0; i < PHSP_LOG_SLOTS; i++) {
+        iov[i].iov_base = log->arena + i * PHSP_LOG_SLOT_SIZE;
+        iov[i].iov_len = PHSP_LOG_SLOT_SIZE;
+    }
+    u->fixed = !syscall(__NR_io_uring_register, u->fd,
+                        IORING_REGISTER_BUFFERS, iov, PHSP_LOG_SLOTS);
+
+    log->uring = u;
+    return 0;
+
+err_cq:
+    if (u->cq_ptr != u->sq_ptr) munmap(u->cq_ptr, u->cq_sz);
+err_sq:
+    munmap(u->sq_ptr, u->sq_sz);
+err_fd:
+    close(u->fd);
+    free(u);
+    return -1;
+}
+
+/* Closing the ring does not wait for in-flight requests, which would then
+ * complete into freed slot buffers: cancel the writes still in flight and
+ * reap every outstanding completion first. */
+static void
+owl_uring_drain(struct phasespace_log_s *log)
+{
+    struct owl_uring *u = log->uring;
+    struct io_uring_sqe *sqe;
+    unsigned i, j, busy;
+
+    for (i = 0; i < PHSP_LOG_SLOTS; i++) {
+        if (log->slot[i].state != PHSP_LOG_INFLIGHT) continue;
+        if (u->tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >
+            *u->sq_mask)
+            break;
+
+        j = u->tail & *u->sq_mask;
+        sqe = &u->sqes[j];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = -1;
+        sqe->addr = i;
+        sqe->user_data = PHSP_LOG_SLOTS + i;
+        u->sq_array[j] = j;
+        u->tail++;
+        u->pending++;
+    }
+    owl_uring_submit(log);
+
+    while (u->busy) {
+        busy = u->busy;
+        if (owl_uring_reap(log, true) && u->busy == busy) break;
+    }
+}
+
+void
+owl_uring_fini(struct phasespace_log_s *log)
+{
+    struct owl_uring *u = log->uring;
+
+    if (!u) return;
+
+    owl_uring_drain(log);
+    munmap(u->sqes, u->sqes_sz);
+    if (u->cq_ptr != u->sq_ptr) munmap(u->cq_ptr, u->cq_sz);
+    munmap(u->sq_ptr, u->sq_sz);
+    close(u->fd);
+    free(u);
+    log->uring = NULL;
+}
+
+/* ---------------------------------------------------------------------- */
+/* Queue the write of a slot, submitted by owl_uring_submit() ------------ */
+int
+owl_uring_prep(struct phasespace_log_s *log, struct phsp_log_slot *s)
+{
+    struct owl_uring *u = log->uring;
+    struct io_uring_sqe *sqe;
+    unsigned i;
+
+    if (u->tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >
+        *u->sq_mask) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    i = u->tail & *u->sq_mask;
+    sqe = &u->sqes[i];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->fd = log->fd;
+    sqe->addr = (uintptr_t)s->buffer;
+    sqe->len = s->req.aio_nbytes;
+    sqe->off = s->req.aio_offset;
+    sqe->user_data = s - log->slot;
+    if (u->fixed) {
+        sqe->opcode = IORING_OP_WRITE_FIXED;
+        sqe->buf_index = (s->buffer - log->arena) / PHSP_LOG_SLOT_SIZE;
+    } else
+        sqe->opcode = IORING_OP_WRITE;
+
+    u->sq_array[i] = i;
+    u->tail++;
+    u->pending++;
+    return 0;
+}
+
+int
+owl_uring_submit(struct phasespace_log_s *log)
+{
+    struct owl_uring *u = log->uring;
+    int s;
+
+    if (!u->pending) return 0;
+
+    __atomic_store_n(u->sq_tail, u->tail, __ATOMIC_RELEASE);
+    s = owl_uring_enter(u, u->pending, 0);
+    if (s < 0) return -1;
+    u->pending -= s;
+    u->busy += s;
+    return 0;
+}
+
+/* ---------------------------------------------------------------------- */
+/* Mark slots whose write completed -------------------------------------- */
+int
+owl_uring_reap(struct phasespace_log_s *log, bool wait)
+{
+    struct owl_uring *u = log->uring;
+    struct io_uring_cqe *cqe;
+    struct phsp_log_slot *s;
+    unsigned head, tail;
+    int e = 0;
+
+    while (1) {
+        head = *u->cq_head;
+        tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+        if (head != tail || !wait) break;
+        if (owl_uring_enter(u, 0, 1) < 0) return -1;
+    }
+
+    for (; head != tail; head++) {
+        cqe = &u->cqes[head & *u->cq_mask];
+        u->busy--;
+        if (cqe->user_data >= PHSP_LOG_SLOTS) continue;
+
+        s = &log->slot[cqe->user_data];
+        if (cqe->res < 0 || (size_t)cqe->res != s->req.aio_nbytes) {
+            errno = cqe->res < 0 ? -cqe->res : EIO;
+            e = -1;
+        }
+        s->state = PHSP_LOG_DONE;
+    }
+    __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+
+    return e;
+}
+
+#else /* HAVE_IO_URING */
+
+int
+owl_uring_init(struct phasespace_log_s *log)
+{
+    (void)log;
+    errno = ENOSYS;
+    return -1;
+}
+
+void
+owl_uring_fini(struct phasespace_log_s *log) { (void)log; }
+
+int
+owl_uring_prep(struct phasespace_log_s *log, struct phsp_log_slot *s)
+{
+    (void)log; (void)s;
+    errno = ENOSYS;
+    return -1;
+}
+
+int
+owl_uring_submit(struct phasespace_log_s *log)
+{
+    (void)log;
+    errno = ENOSYS;
+    return -1;
+}
+
+int
+owl_uring_reap(struct phasespace_log_s *log, bool wait)
+{
+    (void)log; (void)wait;
+    errno = ENOSYS;
+    return -1;
+}
+
+#endif /* HAVE_IO_URING */
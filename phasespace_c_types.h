@@ -23,39 +23,124 @@
 #include <stdio.h>
 #include <string.h>
 
+#include "phsp_logfmt.h"
+#include "phsp_wire.h"
+
 /* ---------------------------------------------------------------------- */
 /* Server connection wrapper                                              */
 /* ---------------------------------------------------------------------- */
+#define PHSP_RBUF_SIZE 16384
+
+/* OWL stream transport, see owl_connect() */
+enum phsp_transport {
+  PHSP_TRANSPORT_TCP = 0,
+  PHSP_TRANSPORT_UDP = 1,
+};
+
+#define PHSP_CONNECT_TIMEOUT	2000	/* default owl_connect() deadline, ms */
+
+#define PHSP_UDP_BATCH	16	/* datagrams per recvmmsg() */
+#define PHSP_UDP_RESUBSCRIBE	1000	/* subscription renewal period, ms */
+#define PHSP_UDP_TIMEOUT	2000	/* silence reported as an error, ms */
+#define PHSP_RX_STAMPS	32	/* receive times of unread chunks */
+
+/* socket options, see owl_tune() */
+typedef struct phasespace_sock_opts {
+  bool nodelay;			/* TCP_NODELAY */
+  uint32_t rcvbuf;		/* SO_RCVBUF, bytes, 0 for the default */
+  uint32_t busy_poll;		/* SO_BUSY_POLL, us, 0 to disable */
+  int32_t tos;			/* IP_TOS or IPV6_TCLASS, -1 for the default */
+  bool timestamps;		/* SO_TIMESTAMPING kernel receive times */
+} phasespace_sock_opts;
+#define PHSP_UDP_DGRAM_SIZE						\
+  (OWL_UDP_HEADER_SIZE +						\
+   OWL_FRAME_SIZE(PHASESPACE_MAX_MARKERS, PHASESPACE_MAX_RIGIDS))
+
 struct phasespace_server_s {
   /* private data for OWL protocol (e.g. libowl2 socket/context) */
   int fd; /* TCP socket or handle */
   void *ctx; /* opaque OWL context pointer if needed */
+  uint32_t transport;    /* enum phsp_transport */
+
+  /* stream receive buffer, see owl_recv() and owl_decode_frame() */
+  uint8_t rbuf[PHSP_RBUF_SIZE];
+  size_t r, w;           /* read and write offsets in rbuf */
+  size_t discard;        /* bytes left to drop from an oversized frame */
+  size_t oversized;      /* number of frames too large for rbuf */
+  size_t frames;         /* number of frames decoded */
+  size_t coalesced;      /* number of stale frames skipped unpublished */
+  int epfd;              /* edge-triggered epoll on fd, see owl_wait() */
+  uint32_t busy_poll;    /* SO_BUSY_POLL set by owl_tune(), us */
+
+  /* receive time of the chunks in rbuf, see owl_recv(): rx_stamp[] holds
+   * the stream offset after each chunk and its time, from rx_head */
+  bool timestamps;       /* kernel receive times enabled */
+  uint64_t rx_bytes;     /* stream offset of rbuf + w */
+  struct { uint64_t end; int64_t t; } rx_stamp[PHSP_RX_STAMPS];
+  uint32_t rx_head, rx_count;
+
+  /* UDP transport: datagram buffers and sequence tracking */
+  uint8_t *dgram;        /* PHSP_UDP_BATCH datagrams, NULL for TCP */
+  size_t dgram_size;     /* largest datagram of the last batch */
+  uint32_t seq;          /* next expected sequence number */
+  bool seq_valid;        /* seq was initialized by a first datagram */
+  uint64_t subscribed;   /* CLOCK_MONOTONIC of the last subscription, ns */
+  uint64_t alive;        /* CLOCK_MONOTONIC of the last datagram, ns */
+  size_t lost;           /* datagrams missing from the sequence */
+  size_t reordered;      /* late or duplicate datagrams, dropped */
+  size_t invalid;        /* truncated or malformed datagrams */
+
+  /* raw stream capture and replay, see owl_capture.c */
+  struct owl_capture *capture; /* tee of received bytes, or NULL */
+  uint64_t capture_t0;   /* CLOCK_MONOTONIC of the capture start, ns */
+  struct owl_replay *replay; /* feeder thread when replaying a capture */
 };
 
-/* ---------------------------------------------------------------------- */
-/* Logging struct                                                         */
-/* ---------------------------------------------------------------------- */
-struct phasespace_log_s {
-  struct aiocb req;
-  char path[1024];
-  char buffer[4096];
-  bool pending, skipped;
-  uint32_t decimation;
-  size_t missed, total;
+/* what the publish task does with a backlog of frames */
+enum phsp_rx_coalesce {
+  PHSP_RX_LATEST = 0,		/* skip stale frames from their header */
+  PHSP_RX_LATEST_LOG = 1,	/* decode stale frames for the logger, filters */
+  PHSP_RX_ALL = 2,		/* publish every frame, in order */
+};
+
+/* receive counters, see phsp_rx_info() */
+typedef struct phasespace_rx_stats {
+  uint64_t frames;		/* decoded */
+  uint64_t coalesced;		/* skipped because a newer frame was there */
+  uint64_t oversized;		/* too large for the receive buffer */
+  uint64_t lost, reordered, invalid; /* UDP datagrams */
+} phasespace_rx_stats;
 
-# define phsp_log_header \
-  "name ts  x y z  roll pitch yaw"
-# define phsp_log_line \
-  "%s %" PRIu64 ".%09d  %g %g %g  %g %g %g"
+/* supervised connection state, see owl_reconnect.c */
+enum phsp_conn_state {
+  PHSP_CONN_IDLE = 0,		/* no connection requested */
+  PHSP_CONN_CONNECTED = 1,	/* connected, or new connection not taken */
+  PHSP_CONN_CONNECTING = 2,	/* connection lost, attempt in progress */
+  PHSP_CONN_BACKOFF = 3,	/* waiting before the next attempt */
 };
 
+typedef struct phasespace_conn_stats {
+  uint32_t state;		/* enum phsp_conn_state */
+  uint64_t attempts;		/* reconnection attempts */
+  uint64_t reconnects;		/* successful ones */
+  uint64_t failures;
+  uint32_t backoff;		/* current backoff delay, ms */
+  int32_t error;		/* errno of the last failure */
+} phasespace_conn_stats;
+
 /* ---------------------------------------------------------------------- */
 /* Marker and rigid body definitions                                      */
 /* ---------------------------------------------------------------------- */
+/* marker and rigid flags */
+#define PHSP_FLAG_STALE	0x1	/* last frame before a disconnection */
+#define PHSP_FLAG_PREDICTED 0x2	/* filtered state without a measurement */
+#define PHSP_FLAG_SOLVED 0x4	/* rigid fitted on the component */
+#define PHSP_FLAG_REJECTED 0x8	/* failed the quality gate */
+
 typedef struct {
   int32_t id;
   int32_t flags;
-  int64_t time;          /* system timestamp */
+  int64_t time;          /* frame receive time, ns since the epoch */
   double x, y, z;        /* position */
   double cond;           /* condition number (<=0 = invalid) */
 } phasespace_marker_s;
@@ -63,7 +148,7 @@ typedef struct {
 typedef struct {
   int32_t id;
   int32_t flags;
-  int64_t time;          /* system timestamp */
+  int64_t time;          /* frame receive time, ns since the epoch */
   double x, y, z;        /* position */
   double qw, qx, qy, qz; /* orientation quaternion */
   double cond;           /* condition number (<=0 = invalid) */
@@ -72,8 +157,13 @@ typedef struct {
 /* ---------------------------------------------------------------------- */
 /* Bodies container (published to ports)                                  */
 /* ---------------------------------------------------------------------- */
-#define PHASESPACE_MAX_MARKERS 128
-#define PHASESPACE_MAX_RIGIDS   64
+/* capacities can be overridden at build time, e.g. -DPHASESPACE_MAX_RIGIDS=8 */
+#ifndef PHASESPACE_MAX_MARKERS
+# define PHASESPACE_MAX_MARKERS 128
+#endif
+#ifndef PHASESPACE_MAX_RIGIDS
+# define PHASESPACE_MAX_RIGIDS   64
+#endif
 
 typedef struct {
   size_t num_markers;
@@ -82,6 +172,444 @@ typedef struct {
   phasespace_rigid_s rigids[PHASESPACE_MAX_RIGIDS];
 } phasespace_bodies;
 
+/* ---------------------------------------------------------------------- */
+/* Frame clock                                                            */
+/* ---------------------------------------------------------------------- */
+/*
+ * Frames received together share a receive time. The frame clock, see
+ * phsp_frame_clock(), spaces them by PHSP_CLOCK_FLOOR of the mean frame
+ * interval instead, so that filters never see a zero time step. It is
+ * slightly shorter than the mean, so that the clock cannot drift ahead of
+ * the receive times.
+ */
+#define PHSP_CLOCK_GAIN		(1. / 64)	/* of the mean frame interval */
+#define PHSP_CLOCK_FLOOR	0.9
+
+struct phsp_frame_clock {
+  int64_t last;			/* receive time of the last frame, ns */
+  int64_t time;			/* clock of the last frame, ns */
+  double period;		/* mean frame interval, ns */
+};
+
+/* ---------------------------------------------------------------------- */
+/* Marker tracking                                                        */
+/* ---------------------------------------------------------------------- */
+/*
+ * Persistent marker ids, see phsp_track.c. Tracks are binned in a hashed
+ * uniform grid of cells twice the gate size, so that a marker only looks
+ * up the 8 cells that its gate overlaps. The tracks of a cell are
+ * contiguous, and only cells stamped with the current frame are filled.
+ */
+#define PHSP_TRACK_MAX		(2 * PHASESPACE_MAX_MARKERS)
+#define PHSP_TRACK_CELLS	16384	/* power of two */
+#define PHSP_TRACK_CANDIDATES	4	/* nearest tracks kept per marker */
+
+_Static_assert(!(PHSP_TRACK_CELLS & (PHSP_TRACK_CELLS - 1)),
+               "PHSP_TRACK_CELLS is not a power of two");
+
+typedef struct phasespace_track_params {
+  bool enable;			/* replace the ids sent by the server */
+  double gate;			/* max distance to a predicted track, mm */
+  double timeout;		/* s before the id of a lost marker is retired */
+} phasespace_track_params;
+
+struct phsp_track {
+  int32_t id;
+  uint32_t hits;		/* observations */
+  int64_t time;			/* of the last observation, ns */
+  double x, y, z;
+  double vx, vy, vz;		/* mm/s */
+};
+
+struct phsp_track_candidate {
+  uint32_t track;
+  double d2;
+};
+
+/* tracks of a grid cell, bin[start] to bin[start + count - 1] */
+struct phsp_track_cell {
+  uint32_t stamp;		/* frame of the bins, older if empty */
+  uint32_t start, count;
+};
+
+/* a predicted track in its cell */
+struct phsp_track_bin {
+  double x, y, z;
+  uint32_t track;
+};
+
+struct phasespace_track_s {
+  phasespace_track_params params;
+  struct phsp_frame_clock clock;
+  int32_t next_id;
+  uint32_t num_tracks;
+  struct phsp_track track[PHSP_TRACK_MAX];
+
+  /* per frame: grid of predicted tracks, candidates and matches */
+  struct { double x, y, z; } pred[PHSP_TRACK_MAX];
+  uint32_t frame;		/* count of track_predict() calls */
+  uint32_t num_touched;
+  uint32_t touched[PHSP_TRACK_MAX]; /* cells stamped with frame */
+  struct phsp_track_cell grid[PHSP_TRACK_CELLS];
+  uint32_t cell[PHSP_TRACK_MAX];	/* of each track */
+  struct phsp_track_bin bin[PHSP_TRACK_MAX]; /* sorted by cell */
+  int32_t owner[PHSP_TRACK_MAX];
+  double owner_d2[PHSP_TRACK_MAX];
+  struct phsp_track_candidate cand[PHASESPACE_MAX_MARKERS]
+                                  [PHSP_TRACK_CANDIDATES];
+  uint8_t num_cand[PHASESPACE_MAX_MARKERS], tried[PHASESPACE_MAX_MARKERS];
+  uint32_t queue[PHASESPACE_MAX_MARKERS];
+};
+
+/* ---------------------------------------------------------------------- */
+/* Quality gate                                                           */
+/* ---------------------------------------------------------------------- */
+/*
+ * Plausibility checks of decoded frames, see phsp_gate.c. Each visible
+ * marker and rigid is compared with the last accepted sample of the same
+ * id, and flagged PHSP_FLAG_REJECTED if it fails a check. Marker ids
+ * without one are held until a second sample confirms the first. A limit
+ * of 0 disables its check.
+ */
+#define PHSP_GATE_MAX		(2 * PHASESPACE_MAX_MARKERS)
+#define PHSP_GATE_SLOTS		(2 * PHSP_GATE_MAX)	/* id hash */
+
+typedef struct phasespace_gate_params {
+  bool enable;
+  double marker_cond;		/* max marker cond */
+  double marker_vel;		/* max marker velocity, mm/s */
+  double marker_acc;		/* max marker acceleration, mm/s^2 */
+  double rigid_cond;		/* max rigid cond */
+  double rigid_vel;		/* max rigid velocity, mm/s */
+  double rigid_acc;		/* max rigid acceleration, mm/s^2 */
+  double rigid_rate;		/* max rigid angular velocity, rad/s */
+  double quat_norm;		/* max | |q| - 1 | */
+  double timeout;		/* s before the reference of an id is dropped */
+} phasespace_gate_params;
+
+/* last accepted sample of an id, or held sample of a new marker id */
+struct phsp_gate_ref {
+  int32_t id;
+  uint32_t hits;		/* accepted samples, up to 2, 0 if held */
+  int64_t time;			/* ns */
+  double x, y, z;
+  double vx, vy, vz;		/* mm/s, from the last two samples */
+  double qw, qx, qy, qz;	/* unit, rigids only */
+};
+
+struct phsp_gate_refs {
+  uint32_t num;
+  struct phsp_gate_ref ref[PHSP_GATE_MAX];
+  int32_t last[PHASESPACE_MAX_MARKERS];	/* ref of each entry, last frame */
+  bool hashed;				/* slot is up to date */
+  int32_t slot[PHSP_GATE_SLOTS];	/* ref index by id, -1 when free */
+};
+
+/*
+ * One frame side by side with the references of its entries, for the
+ * vectorized checks. Entries without a reference have their own position
+ * and orientation as reference and idt 0, so that only the static checks
+ * apply to them; alim is infinite for those without a velocity.
+ */
+struct phsp_gate_frame {
+  double x[PHASESPACE_MAX_MARKERS] __attribute__((aligned(32)));
+  double y[PHASESPACE_MAX_MARKERS] __attribute__((aligned(32)));
+  double z[PHASESPACE_MAX_MARKERS] __attribute__((aligned(32)));
+  double cond[PHASESPACE_MAX_MARKERS] __attribute__((aligned(32)));
+  double qw[PHASESPACE_MAX_MARKERS] __attribute__((aligned(32)));
+  double qx[PHASESPACE_MAX_MARKERS] __attribute__((aligned(32)));
+  double qy[PHASESPACE_MAX_MARKERS] __attribute__((aligned(32)));
+  double qz[PHASESPACE_MAX_MARKERS] __attribute__((aligned(32)));
+  double px[PHASESPACE_MAX_MARKERS] __attribute__((aligned(32)));
+  double py[PHASESPACE_MAX_MARKERS] __attribute__((aligned(32)));
+  double pz[PHASESPACE_MAX_MARKERS] __attribute__((aligned(32)));
+  double vx[PHASESPACE_MAX_MARKERS] __attribute__((aligned(32)));
+  double vy[PHASESPACE_MAX_MARKERS] __attribute__((aligned(32)));
+  double vz[PHASESPACE_MAX_MARKERS] __attribute__((aligned(32)));
+  double rw[PHASESPACE_MAX_MARKERS] __attribute__((aligned(32)));
+  double rx[PHASESPACE_MAX_MARKERS] __attribute__((aligned(32)));
+  double ry[PHASESPACE_MAX_MARKERS] __attribute__((aligned(32)));
+  double rz[PHASESPACE_MAX_MARKERS] __attribute__((aligned(32)));
+  double idt[PHASESPACE_MAX_MARKERS] __attribute__((aligned(32))); /* 1/s */
+  double alim[PHASESPACE_MAX_MARKERS] __attribute__((aligned(32))); /* ^2 */
+  int32_t ref[PHASESPACE_MAX_MARKERS];	/* ref index, or -1 */
+};
+
+struct phasespace_gate_s {
+  phasespace_gate_params params;
+  struct phsp_frame_clock clock;
+  struct phsp_gate_refs markers, rigids;
+  struct phsp_gate_frame frame;
+  uint64_t ok[(PHASESPACE_MAX_MARKERS + 63) / 64]; /* accepted entries */
+};
+
+/* ---------------------------------------------------------------------- */
+/* Rigid body templates                                                   */
+/* ---------------------------------------------------------------------- */
+/*
+ * Marker ids of a rigid body and their positions in the body frame, for
+ * the on-component solver (phsp_solver.c). A rigid is fitted when at
+ * least 3 of its markers are visible and not collinear, and its cond is
+ * the weighted rms residual of the fit.
+ */
+#define PHSP_TEMPLATE_MAX_POINTS 32	/* multiple of 4 */
+
+typedef struct phasespace_template_point {
+  int32_t id;			/* marker id */
+  double x, y, z;		/* in the body frame, mm */
+} phasespace_template_point;
+
+typedef struct phasespace_template {
+  int32_t id;			/* rigid id, > 0 */
+  double max_residual;		/* rms, mm, 0 for the default */
+  uint32_t num_points;		/* 0 to remove the template */
+  phasespace_template_point points[PHSP_TEMPLATE_MAX_POINTS];
+} phasespace_template;
+
+/* one template, points padded to a multiple of 4 with zero weight */
+struct phsp_solver_body {
+  double lx[PHSP_TEMPLATE_MAX_POINTS] __attribute__((aligned(32)));
+  double ly[PHSP_TEMPLATE_MAX_POINTS] __attribute__((aligned(32)));
+  double lz[PHSP_TEMPLATE_MAX_POINTS] __attribute__((aligned(32)));
+  int32_t marker[PHSP_TEMPLATE_MAX_POINTS];
+  uint32_t slot[PHSP_TEMPLATE_MAX_POINTS]; /* marker index, last frame */
+  int32_t id;
+  uint32_t num_points, n;	/* points, and padded to a multiple of 4 */
+  double max_residual;
+};
+
+struct phasespace_solver_s {
+  uint32_t num_bodies;
+  struct phsp_solver_body body[PHASESPACE_MAX_RIGIDS];
+};
+
+/* ---------------------------------------------------------------------- */
+/* Filtered rigid body states                                             */
+/* ---------------------------------------------------------------------- */
+/*
+ * Output of the per-rigid constant acceleration filters, see phsp_kf.c.
+ * Velocities and accelerations are in the world frame. With isotropic
+ * noise the three axes have the same covariance, so variances are given
+ * once for all axes.
+ */
+typedef struct {
+  int32_t id;
+  int32_t flags;         /* PHSP_FLAG_PREDICTED when not measured */
+  int64_t time;          /* state time, ns since the epoch */
+  double x, y, z;        /* position, mm */
+  double qw, qx, qy, qz; /* orientation quaternion */
+  double vx, vy, vz;     /* linear velocity, mm/s */
+  double ax, ay, az;     /* linear acceleration, mm/s^2 */
+  double wx, wy, wz;     /* angular velocity, rad/s */
+  double dwx, dwy, dwz;  /* angular acceleration, rad/s^2 */
+  double pos_var, vel_var, acc_var; /* per axis, mm^2, (mm/s)^2, ... */
+  double att_var, rate_var;	    /* per axis, rad^2, (rad/s)^2 */
+} phasespace_rigid_state;
+
+typedef struct {
+  size_t num_rigids;
+  phasespace_rigid_state rigids[PHASESPACE_MAX_RIGIDS];
+} phasespace_states;
+
+/* filter tuning, see phsp_kf_params() */
+typedef struct phasespace_kf_params {
+  double pos_noise;		/* position measurement std, mm */
+  double jerk;			/* jerk white noise density, mm^2/s^5 */
+  double att_noise;		/* attitude measurement std, rad */
+  double ang_jerk;		/* angular jerk density, rad^2/s^5 */
+  double timeout;		/* s without measurement before a reset */
+  double latency;		/* s from capture to receive time, added to
+				 * the horizon of phsp_kf_predict() */
+} phasespace_kf_params;
+
+/* one filter: per axis [p v a] means, shared 3x3 covariances stored as
+ * the upper triangle p00 p01 p02 p11 p12 p22 */
+struct phsp_kf {
+  int32_t id;			/* 0 for a free slot, or PHSP_KF_TOMB */
+  bool valid;			/* initialized from a measurement */
+  int64_t time;			/* of the state, ns */
+  int64_t seen;			/* of the last measurement, ns */
+  double p[3], v[3], a[3];	/* position, velocity, acceleration */
+  double q[4];			/* orientation */
+  double w[3], dw[3];		/* angular velocity, acceleration */
+  double pt[6], pr[6];		/* translation and rotation covariances */
+};
+
+/* states of the last filtered frame for phsp_kf_predict(), under a
+ * seqlock: seq is odd while they are being written */
+struct phsp_kf_poses {
+  uint64_t seq;
+  int64_t latency;		/* params.latency, ns */
+  uint32_t num_rigids;
+  phasespace_rigid_state rigids[PHASESPACE_MAX_RIGIDS];
+} __attribute__((aligned(64)));
+
+#define PHSP_KF_TOMB	INT32_MIN	/* id of a released filter slot */
+
+struct phasespace_kf_s {
+  phasespace_kf_params params;
+  struct phsp_frame_clock clock;
+  struct phsp_kf filter[PHASESPACE_MAX_RIGIDS]; /* open addressing on id */
+  struct phsp_kf_poses poses;	/* read by any thread */
+};
+
+/* extrapolation models of phsp_kf_predict() */
+enum phsp_predict_model {
+  PHSP_PREDICT_VELOCITY = 0,	/* constant linear and angular velocity */
+  PHSP_PREDICT_ACCELERATION = 1, /* constant accelerations */
+};
+
+/* ---------------------------------------------------------------------- */
+/* Struct-of-arrays markers                                               */
+/* ---------------------------------------------------------------------- */
+/*
+ * Positions and cond of up to PHASESPACE_MAX_MARKERS markers (or rigids)
+ * as separate aligned arrays, for the vectorized kernels in phsp_soa.c.
+ * Bit masks over entries (bit i for entry i) take PHSP_SOA_MASK_WORDS words.
+ */
+#define PHSP_SOA_MASK_WORDS	((PHASESPACE_MAX_MARKERS + 63) / 64)
+
+typedef struct {
+  size_t n;
+  double x[PHASESPACE_MAX_MARKERS] __attribute__((aligned(32)));
+  double y[PHASESPACE_MAX_MARKERS] __attribute__((aligned(32)));
+  double z[PHASESPACE_MAX_MARKERS] __attribute__((aligned(32)));
+  double cond[PHASESPACE_MAX_MARKERS] __attribute__((aligned(32)));
+  int32_t id[PHASESPACE_MAX_MARKERS];
+} phasespace_soa;
+
+_Static_assert(PHASESPACE_MAX_RIGIDS <= PHASESPACE_MAX_MARKERS,
+               "phasespace_soa cannot hold all rigids");
+
+/* ---------------------------------------------------------------------- */
+/* Logging struct                                                         */
+/* ---------------------------------------------------------------------- */
+/* Slots are sized for the largest frame: PHASESPACE_MAX_MARKERS markers
+ * and PHASESPACE_MAX_RIGIDS rigids as text lines of at most
+ * PHSP_LOG_LINE_MAX bytes (the binary records are smaller). */
+#define PHSP_LOG_SLOTS		8
+#define PHSP_LOG_LINE_MAX	160
+#define PHSP_LOG_SLOT_SIZE						\
+  ((PHASESPACE_MAX_MARKERS + PHASESPACE_MAX_RIGIDS + 1) * PHSP_LOG_LINE_MAX)
+#define PHSP_LOG_URING_BATCH	4	/* queued frames per io_uring submit */
+
+/* what owl_log() does when all slots are busy */
+enum phsp_log_policy {
+  PHSP_LOG_BLOCK = 0,		/* wait for the oldest write to complete */
+  PHSP_LOG_DROP_OLDEST = 1,	/* replace the oldest frame not yet written */
+  PHSP_LOG_DROP_NEWEST = 2,	/* discard the current frame */
+};
+
+struct phsp_log_slot {
+  struct aiocb req;
+  char *buffer;			/* PHSP_LOG_SLOT_SIZE bytes */
+  enum {
+    PHSP_LOG_FREE, PHSP_LOG_QUEUED, PHSP_LOG_INFLIGHT, PHSP_LOG_DONE
+  } state;
+};
+
+struct phasespace_log_s {
+  int fd;
+  char path[1024];
+
+  /* ring of slots: [head, head+inflight) are being written, the next
+   * count-inflight ones are queued for the next batch */
+  struct phsp_log_slot slot[PHSP_LOG_SLOTS];
+  uint32_t head, count, inflight;
+  off_t offset;			/* file offset of the next submitted slot */
+  char *arena;			/* storage for all slot buffers */
+  struct owl_uring *uring;	/* io_uring backend, or NULL for POSIX aio */
+
+  bool skipped;
+  uint32_t decimation;
+  uint32_t format;		/* enum phsp_log_format */
+  uint32_t policy;		/* enum phsp_log_policy */
+  size_t total, logged;		/* frames seen / queued for writing */
+  size_t missed;		/* frames dropped, for any reason */
+  size_t dropped_oldest, dropped_newest, blocked;
+  size_t truncated;		/* frames that did not fit in a slot */
+
+  /* positions of the current and previous logged frame, for noise */
+  phasespace_soa *markers[2], *rigids[2];
+};
+
+/* logger counters, see owl_log_stats() */
+typedef struct phasespace_log_stats {
+  uint64_t total, logged;
+  uint64_t missed, dropped_oldest, dropped_newest, blocked;
+  uint64_t truncated;
+  uint32_t queued, inflight;
+  bool uring;			/* io_uring backend in use */
+} phasespace_log_stats;
+
+/* ---------------------------------------------------------------------- */
+/* Frame publication (triple buffer)                                      */
+/* ---------------------------------------------------------------------- */
+/*
+ * The publish task fills the back slot and swaps it with the middle one;
+ * the reader swaps the middle slot with its front one when a new frame is
+ * there. Neither side ever waits for the other. There must be a single
+ * reader.
+ */
+#define PHSP_FRAMES_NEW	0x4		/* middle holds an unread frame */
+
+struct phasespace_frames_s {
+  phasespace_bodies slot[3];
+  uint64_t seq[3];		/* frame sequence number of each slot */
+
+  uint32_t back;		/* owned by the publish task */
+  uint32_t middle;		/* slot index | PHSP_FRAMES_NEW, atomic */
+  uint32_t front;		/* owned by the reader */
+  uint64_t last;		/* last published sequence number */
+  uint32_t latest;		/* slot of the last published frame */
+  bool stale;			/* latest was republished as stale */
+  uint64_t stamp[3];		/* socket readable time of each slot, ns */
+  phasespace_states states[3];	/* filtered states of each slot */
+};
+
+/* ---------------------------------------------------------------------- */
+/* Latency histograms                                                     */
+/* ---------------------------------------------------------------------- */
+/*
+ * Log-linear buckets: values below 2^PHSP_HIST_SUB_BITS ns are exact, and
+ * every power of two above is split in 2^PHSP_HIST_SUB_BITS buckets, for a
+ * relative error of at most 3% up to 2^PHSP_HIST_MAX_BITS ns (68s). Each
+ * histogram has a single writer and lock-free readers.
+ */
+#define PHSP_HIST_SUB_BITS	5
+#define PHSP_HIST_MAX_BITS	36
+#define PHSP_HIST_BUCKETS						\
+  ((PHSP_HIST_MAX_BITS - PHSP_HIST_SUB_BITS + 1) << PHSP_HIST_SUB_BITS)
+
+struct phsp_hist {
+  uint64_t count[PHSP_HIST_BUCKETS];
+  uint64_t n, sum, max;		/* ns */
+};
+
+/* latencies measured from the time the OWL socket became readable */
+enum phsp_latency_stage {
+  PHSP_LAT_DECODE,		/* frame decoded */
+  PHSP_LAT_PUBLISH,		/* frame published and exported */
+  PHSP_LAT_LOG,			/* frame submitted to the logger */
+  PHSP_LAT_READ,		/* frame read by get_bodies (its age) */
+  PHSP_LAT_STAGES
+};
+
+struct phasespace_latency_s {
+  uint64_t ready;		/* last socket readable time, ns */
+  struct phsp_hist hist[PHSP_LAT_STAGES];
+};
+
+/* latency summary of one stage, in us, see phsp_latency_stats() */
+typedef struct phasespace_latency_stage {
+  uint64_t count;
+  double p50, p99, p999, max, mean;
+} phasespace_latency_stage;
+
+typedef struct phasespace_latency_stats {
+  phasespace_latency_stage decode, publish, log, read;
+} phasespace_latency_stats;
+
 /* ---------------------------------------------------------------------- */
 /* Error helper                                                           */
 /* ---------------------------------------------------------------------- */
@@ -100,18 +628,19 @@ phsp_e_sys_error(const char *s, genom_context self)
 /* OWL protocol wrappers (to be implemented with libowl2 or bindings)     */
 /* ---------------------------------------------------------------------- */
 struct phasespace_server_s *
-owl_connect(const char *host, const char *port);
+owl_connect(const char *host, const char *port, uint32_t transport,
+            uint32_t timeout);
 
 int
-owl_poll(struct phasespace_server_s server, struct timeval *timeout);
+owl_poll(const struct phasespace_server_s *server, struct timeval *timeout);
 
 uint32_t
-owl_version(struct phasespace_server_s server);
+owl_version(const struct phasespace_server_s *server);
 
 void
 owl_disconnect(struct phasespace_server_s *server);
 
 void
-owl_log(struct phasespace_log_s *log);
+owl_log(struct phasespace_log_s *log, const phasespace_bodies *bodies);
 
 #endif /* H_PHASESPACE_C_TYPES */
@@ -16,73 +16,570 @@
 
 #include <sys/time.h>
 
+#include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
 
 #include "phasespace_c_types.h"
 #include "phsp.h"
 #include "owl.h"
+#include "phsp_shm.h"
 
 
 /* --- Function phsp_log_start (async version) -------------------------- */
 
 /** Codel phsp_log_start of function log.
  *
- * Initializes a phasespace_log_s struct for asynchronous logging.
- * Writes the CSV header asynchronously.
+ * Initializes a phasespace_log_s struct for asynchronous logging, with a
+ * ring of PHSP_LOG_SLOTS buffers handled according to policy (an enum
+ * phsp_log_policy) when the disk cannot keep up. Writes the text header,
+ * or the binary file header when format is PHSP_LOG_BINARY,
+ * asynchronously.
  *
  * Returns genom_ok on success, or phasespace_e_sys on failure.
  */
 genom_event
-phsp_log_start(const char path[64], uint32_t decimation,
-               phasespace_log_s **log, const genom_context self)
+phsp_log_start(const char path[64], uint32_t decimation, uint32_t format,
+               uint32_t policy, phasespace_log_s **log,
+               const genom_context self)
 {
     if (!log || !path) return phsp_e_sys_error("Invalid log pointer", self);
 
-    /* Allocate if needed */
+    /* Allocate if needed, or flush and close the previous log */
     if (*log == NULL) {
         *log = malloc(sizeof(phasespace_log_s));
         if (!*log) return phsp_e_sys_error("Memory allocation failed", self);
+    } else
+        owl_log_fini(*log);
+
+    /* Open file and queue the header */
+    if (owl_log_init(*log, path, decimation, format, policy)) {
+        genom_event e = phsp_e_sys_error(path, self);
+        free(*log);
+        *log = NULL;
+        return e;
+    }
+
+    return genom_ok;
+}
+
+
+/* --- Function phsp_log_stop ------------------------------------------- */
+
+/** Codel phsp_log_stop of function log_stop.
+ *
+ * Waits for all queued frames to be written and closes the log.
+ *
+ * Returns genom_ok.
+ */
+genom_event
+phsp_log_stop(phasespace_log_s **log, const genom_context self)
+{
+    if (!log || !*log) return genom_ok;
+
+    owl_log_fini(*log);
+    free(*log);
+    *log = NULL;
+
+    return genom_ok;
+}
+
+
+/* --- Function phsp_log_info ------------------------------------------- */
+
+/** Codel phsp_log_info of function log_info.
+ *
+ * Reports the logger frame counters, including frames dropped by the
+ * high-water policy.
+ *
+ * Returns genom_ok.
+ */
+genom_event
+phsp_log_info(const phasespace_log_s *log, phasespace_log_stats *stats,
+              const genom_context self)
+{
+    owl_log_stats(log, stats);
+    return genom_ok;
+}
+
+
+/* --- Function phsp_get_bodies ----------------------------------------- */
+
+/** Codel phsp_get_bodies of function get_bodies.
+ *
+ * Copies the latest complete frame published by the publish task, with
+ * its sequence number (0 if no frame was received yet). Never waits for
+ * the publish task. When latency_start was called, the age of the frame
+ * is recorded in the read stage histogram.
+ *
+ * Returns genom_ok.
+ */
+genom_event
+phsp_get_bodies(phasespace_frames_s *frames, phasespace_latency_s *latency,
+                phasespace_bodies *bodies, uint64_t *seq,
+                const genom_context self)
+{
+    const phasespace_bodies *latest;
+    uint64_t stamp, t;
+
+    if (!frames) {
+        bodies->num_markers = bodies->num_rigids = 0;
+        *seq = 0;
+        return genom_ok;
     }
 
-    memset(*log, 0, sizeof(phasespace_log_s));
-
-    /* Store path */
-    snprintf((*log)->path, sizeof((*log)->path), "%s", path);
-    (*log)->decimation = decimation < 1 ? 1 : decimation;
-
-    /* Open file asynchronously */
-    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
-    if (fd < 0) return phsp_e_sys_error(path, self);
-
-    (*log)->req.aio_fildes = fd;
-    (*log)->req.aio_buf = (*log)->buffer;
-    (*log)->req.aio_offset = 0;
-    (*log)->req.aio_nbytes = 0;
-    (*log)->req.aio_sigevent.sigev_notify = SIGEV_NONE;
-    (*log)->req.aio_lio_opcode = LIO_NOP;
-    (*log)->pending = false;
-    (*log)->skipped = false;
-    (*log)->missed = 0;
-    (*log)->total = 0;
-
-    /* Prepare header in buffer */
-    int n = snprintf((*log)->buffer, sizeof((*log)->buffer), "%s\n", phsp_log_header);
-    if (n <= 0) {
-        close(fd);
-        return phsp_e_sys_error("Failed to format log header", self);
+    latest = phsp_frames_read(frames, seq);
+    phsp_bodies_copy(bodies, latest);
+
+    if (latency) {
+        stamp = phsp_frames_read_stamp(frames);
+        t = phsp_latency_now();
+        if (stamp && t >= stamp)
+            phsp_hist_record(&latency->hist[PHSP_LAT_READ], t - stamp);
+    }
+
+    return genom_ok;
+}
+
+
+/* --- Function phsp_get_states ----------------------------------------- */
+
+/** Codel phsp_get_states of function get_states.
+ *
+ * Copies the filtered rigid states of the latest published frame, with
+ * the frame sequence number. Like get_bodies, never waits for the publish
+ * task; both read the same frame until a newer one is published.
+ *
+ * Returns genom_ok.
+ */
+genom_event
+phsp_get_states(phasespace_frames_s *frames, phasespace_states *states,
+                uint64_t *seq, const genom_context self)
+{
+    const phasespace_states *latest;
+
+    if (!frames) {
+        states->num_rigids = 0;
+        *seq = 0;
+        return genom_ok;
     }
 
-    (*log)->req.aio_nbytes = n;
+    phsp_frames_read(frames, seq);
+    latest = phsp_frames_read_states(frames);
+    states->num_rigids = latest->num_rigids;
+    memcpy(states->rigids, latest->rigids,
+           latest->num_rigids * sizeof(*latest->rigids));
+
+    return genom_ok;
+}
+
+
+/* --- Function phsp_set_filter ----------------------------------------- */
+
+/** Codel phsp_set_filter of function set_filter.
+ *
+ * Sets the measurement and process noises of the rigid body filters, the
+ * time without measurement after which a filter restarts, and the latency
+ * from capture to reception added to the horizon of predict. All filters
+ * restart from their next measurement.
+ *
+ * Returns genom_ok, or phasespace_e_sys if a parameter is not positive,
+ * or the latency is negative.
+ */
+genom_event
+phsp_set_filter(const phasespace_kf_params *params, phasespace_kf_s *kf,
+                const genom_context self)
+{
+    if (phsp_kf_params(kf, params))
+        return phsp_e_sys_error("set_filter", self);
+
+    return genom_ok;
+}
+
+
+/* --- Function phsp_set_tracking --------------------------------------- */
+
+/** Codel phsp_set_tracking of function set_tracking.
+ *
+ * Enables or disables persistent marker ids, and sets the matching gate
+ * and the time after which the id of a lost marker is retired. Templates
+ * refer to marker ids as published, so they must use the tracked ids
+ * while tracking is enabled.
+ *
+ * Returns genom_ok, or phasespace_e_sys if gate or timeout is not
+ * positive.
+ */
+genom_event
+phsp_set_tracking(const phasespace_track_params *params,
+                  phasespace_track_s *track, const genom_context self)
+{
+    if (phsp_track_params(track, params))
+        return phsp_e_sys_error("set_tracking", self);
+
+    return genom_ok;
+}
+
+
+/* --- Function phsp_set_gate ------------------------------------------- */
+
+/** Codel phsp_set_gate of function set_gate.
+ *
+ * Enables or disables the quality gate and sets its limits: markers and
+ * rigids with a larger cond, velocity or acceleration than allowed since
+ * their last accepted sample, and rigids with a quaternion norm or an
+ * angular velocity off limits, are flagged PHSP_FLAG_REJECTED. So are
+ * markers with a new id, such as the tracked id of a ghost, until their
+ * next sample agrees with the first. A limit of 0 disables its check.
+ *
+ * Returns genom_ok, or phasespace_e_sys if a limit is negative or the
+ * timeout is not positive.
+ */
+genom_event
+phsp_set_gate(const phasespace_gate_params *params, phasespace_gate_s *gate,
+              const genom_context self)
+{
+    if (phsp_gate_params(gate, params))
+        return phsp_e_sys_error("set_gate", self);
+
+    return genom_ok;
+}
+
+
+/* --- Function phsp_set_template --------------------------------------- */
+
+/** Codel phsp_set_template of function set_template.
+ *
+ * Registers the marker template of a rigid body, fitted on the markers of
+ * each frame in which the server does not track that rigid. A template
+ * without points removes the previous one.
+ *
+ * Returns genom_ok, or phasespace_e_sys if the template is invalid,
+ * unknown when removing it, or there are too many templates.
+ */
+genom_event
+phsp_set_template(const phasespace_template *template,
+                  phasespace_solver_s *solver, const genom_context self)
+{
+    if (phsp_solver_set(solver, template))
+        return phsp_e_sys_error("set_template", self);
+
+    return genom_ok;
+}
+
+
+/* --- Function phsp_predict -------------------------------------------- */
+
+/** Codel phsp_predict of function predict.
+ *
+ * Extrapolates the filtered state of rigid id to time (ns since the
+ * epoch, 0 for now), with a constant velocity or constant acceleration
+ * model, over the time since the state plus the filter latency. The
+ * filter bank is not an input: its states are read from the copy shared
+ * by the publish task, so this never waits for a frame. Co-located
+ * controllers can call phsp_kf_predict() directly instead, from any
+ * thread.
+ *
+ * Returns genom_ok, with pose flagged PHSP_FLAG_STALE if time is more
+ * than max_age ns after the last state, or phasespace_e_sys if id is
+ * unknown or the model is invalid.
+ */
+genom_event
+phsp_predict(int32_t id, int64_t time, uint32_t model, int64_t max_age,
+             phasespace_rigid_state *pose, const genom_context self)
+{
+    if (phsp_kf_predict(phsp_kf_shared(), id, time, model, max_age, pose) &&
+        errno != ESTALE)
+        return phsp_e_sys_error("predict", self);
+
+    return genom_ok;
+}
+
+
+/* --- Function phsp_shm_start ------------------------------------------ */
 
-    /* Write header asynchronously */
-    if (aio_write(&(*log)->req)) {
-        close(fd);
-        return phsp_e_sys_error("Failed to write log header", self);
+/** Codel phsp_shm_start of function shm_start.
+ *
+ * Creates the POSIX shared memory object 'name' (e.g. "/phasespace") and
+ * starts exporting every published frame to it. See phsp_shm.h for the
+ * reader API.
+ *
+ * Returns genom_ok on success, or phasespace_e_sys on failure.
+ */
+genom_event
+phsp_shm_start(const char name[64], phasespace_shm_s **shm,
+               const genom_context self)
+{
+    if (*shm) {
+        phsp_shm_destroy(*shm);
+        *shm = NULL;
     }
 
-    (*log)->pending = true;
+    *shm = phsp_shm_create(name);
+    if (!*shm) return phsp_e_sys_error(name, self);
+
+    return genom_ok;
+}
+
+
+/* --- Function phsp_shm_stop ------------------------------------------- */
+
+/** Codel phsp_shm_stop of function shm_stop.
+ *
+ * Stops exporting frames and removes the shared memory object. Readers
+ * that still have it mapped keep the last frames.
+ *
+ * Returns genom_ok.
+ */
+genom_event
+phsp_shm_stop(phasespace_shm_s **shm, const genom_context self)
+{
+    phsp_shm_destroy(*shm);
+    *shm = NULL;
+
+    return genom_ok;
+}
+
+
+/* --- Function phsp_capture_start -------------------------------------- */
+
+/** Codel phsp_capture_start of function capture_start.
+ *
+ * Starts teeing the raw bytes received from the OWL server to 'path',
+ * with their receive time, for later replay with the replay activity.
+ * The capture stops on disconnection or with capture_stop.
+ *
+ * Returns genom_ok on success, or phasespace_e_sys on failure.
+ */
+genom_event
+phsp_capture_start(const char path[64], phasespace_server_s *server,
+                   const genom_context self)
+{
+    if (!server) {
+        errno = ENOTCONN;
+        return phsp_e_sys_error("capture", self);
+    }
+
+    if (owl_capture_start(server, path)) return phsp_e_sys_error(path, self);
+
+    return genom_ok;
+}
+
+
+/* --- Function phsp_capture_stop --------------------------------------- */
+
+/** Codel phsp_capture_stop of function capture_stop.
+ *
+ * Flushes and closes the current capture file, if any.
+ *
+ * Returns genom_ok.
+ */
+genom_event
+phsp_capture_stop(phasespace_server_s *server, const genom_context self)
+{
+    owl_capture_stop(server);
+
+    return genom_ok;
+}
+
+
+/* --- Function phsp_latency_start -------------------------------------- */
+
+/** Codel phsp_latency_start of function latency_start.
+ *
+ * Enables (or resets) the latency histograms: decode, publish and log
+ * latencies measured from the time the OWL socket became readable, and
+ * age of the frames returned by get_bodies. When disabled, the publish
+ * path only tests a NULL pointer.
+ *
+ * Returns genom_ok on success, or phasespace_e_sys on failure.
+ */
+genom_event
+phsp_latency_start(phasespace_latency_s **latency, const genom_context self)
+{
+    phsp_latency_destroy(*latency);
+
+    *latency = phsp_latency_create();
+    if (!*latency) return phsp_e_sys_error("latency", self);
+
+    return genom_ok;
+}
+
+
+/* --- Function phsp_latency_stop --------------------------------------- */
+
+/** Codel phsp_latency_stop of function latency_stop.
+ *
+ * Disables the latency histograms and discards them.
+ *
+ * Returns genom_ok.
+ */
+genom_event
+phsp_latency_stop(phasespace_latency_s **latency, const genom_context self)
+{
+    phsp_latency_destroy(*latency);
+    *latency = NULL;
+
+    return genom_ok;
+}
+
+
+/* --- Function phsp_latency_info --------------------------------------- */
+
+/** Codel phsp_latency_info of function latency_info.
+ *
+ * Returns the sample count, p50, p99, p99.9, max and mean latency (us) of
+ * each stage, all zero when the histograms are disabled.
+ *
+ * Returns genom_ok.
+ */
+genom_event
+phsp_latency_info(const phasespace_latency_s *latency,
+                  phasespace_latency_stats *stats, const genom_context self)
+{
+    phsp_latency_stats(latency, stats);
+
+    return genom_ok;
+}
+
+
+/* --- Function phsp_set_rx_spin ---------------------------------------- */
+
+/** Codel phsp_set_rx_spin of function set_rx_spin.
+ *
+ * Sets how long (us) the publish task busy polls the OWL socket before
+ * blocking in epoll. Spinning lowers the wake-up latency at the expense of
+ * a full core, so it only makes sense on an isolated core. 0 (the default)
+ * blocks right away.
+ *
+ * Returns genom_ok.
+ */
+genom_event
+phsp_set_rx_spin(uint32_t spin, uint32_t *rx_spin, const genom_context self)
+{
+    *rx_spin = spin;
+
+    return genom_ok;
+}
+
+
+/* --- Function phsp_set_rx_coalesce ------------------------------------ */
+
+/** Codel phsp_set_rx_coalesce of function set_rx_coalesce.
+ *
+ * Selects what the publish task does with frames that piled up while it
+ * was not running (an enum phsp_rx_coalesce): publish them all in order,
+ * or skip to the newest one (the default), optionally logging the skipped
+ * ones.
+ *
+ * Returns genom_ok, or phasespace_e_sys for an unknown mode.
+ */
+genom_event
+phsp_set_rx_coalesce(uint32_t mode, uint32_t *rx_coalesce,
+                     const genom_context self)
+{
+    if (mode > PHSP_RX_ALL) {
+        errno = EINVAL;
+        return phsp_e_sys_error("rx_coalesce", self);
+    }
+
+    *rx_coalesce = mode;
+
+    return genom_ok;
+}
+
+
+/* --- Function phsp_rx_info -------------------------------------------- */
+
+/** Codel phsp_rx_info of function rx_info.
+ *
+ * Returns the receive counters of the current connection: decoded frames,
+ * stale frames coalesced away and oversized frames dropped, and with the
+ * UDP transport the lost, reordered (late or duplicated) and invalid
+ * datagrams.
+ *
+ * Returns genom_ok.
+ */
+genom_event
+phsp_rx_info(const phasespace_server_s *server, phasespace_rx_stats *stats,
+             const genom_context self)
+{
+    memset(stats, 0, sizeof(*stats));
+    if (!server) return genom_ok;
+
+    stats->frames = server->frames;
+    stats->coalesced = server->coalesced;
+    stats->oversized = server->oversized;
+    stats->lost = server->lost;
+    stats->reordered = server->reordered;
+    stats->invalid = server->invalid;
+
+    return genom_ok;
+}
+
+
+/* --- Function phsp_set_socket ----------------------------------------- */
+
+/** Codel phsp_set_socket of function set_socket.
+ *
+ * Sets the socket options of the OWL connection: TCP_NODELAY, receive
+ * buffer size, busy polling, type of service and kernel receive
+ * timestamps (carried into the marker and rigid time fields). They are
+ * applied to the current connection, if any, and to the next ones.
+ *
+ * Returns genom_ok, or phasespace_e_sys if an option was refused (the
+ * others are still applied).
+ */
+genom_event
+phsp_set_socket(const phasespace_sock_opts *opts,
+                phasespace_sock_opts *sock_opts,
+                phasespace_server_s *server, const genom_context self)
+{
+    *sock_opts = *opts;
+    if (!server || server->replay) return genom_ok;
+
+    if (owl_tune(server, sock_opts))
+        return phsp_e_sys_error("set_socket", self);
+    return genom_ok;
+}
+
+
+/* --- Function phsp_conn_info ------------------------------------------ */
+
+/** Codel phsp_conn_info of function conn_info.
+ *
+ * Returns the state of the supervised connection (an enum
+ * phsp_conn_state), the number of reconnection attempts and successes,
+ * and the current backoff delay with the error of the last failure.
+ *
+ * Returns genom_ok.
+ */
+genom_event
+phsp_conn_info(phasespace_reconnect_s *reconnect,
+               phasespace_conn_stats *stats, const genom_context self)
+{
+    owl_reconnect_stats(reconnect, stats);
+    return genom_ok;
+}
+
+
+/* --- Function phsp_set_reconnect -------------------------------------- */
+
+/** Codel phsp_set_reconnect of function set_reconnect.
+ *
+ * Sets the bounds of the exponential backoff between reconnection
+ * attempts, in ms. The first attempt after a loss is immediate.
+ *
+ * Returns genom_ok, or phasespace_e_sys if min is 0 or max < min.
+ */
+genom_event
+phsp_set_reconnect(uint32_t min, uint32_t max,
+                   phasespace_reconnect_s *reconnect,
+                   const genom_context self)
+{
+    if (owl_reconnect_backoff(reconnect, min, max))
+        return phsp_e_sys_error("set_reconnect", self);
 
     return genom_ok;
 }
@@ -14,11 +14,15 @@
  */
 #include "acphasespace.h"
 
-#include <poll.h>
+#include <stdlib.h>
 
 #include "phasespace_c_types.h"
 #include "phsp.h"
 #include "owl.h"
+#include "phsp_shm.h"
+
+/* max socket reads while skipping a backlog, bounds the activation time */
+#define PHSP_RX_COALESCE_ROUNDS	16
 
 
 /* --- Task publish ----------------------------------------------------- */
@@ -34,6 +38,23 @@ phsp_publish_start(phasespace_ids *ids, const genom_context self)
 {
   /* init data */
   ids->server = NULL;
+  ids->sock_opts.nodelay = true;
+  ids->sock_opts.rcvbuf = 0;
+  ids->sock_opts.busy_poll = 0;
+  ids->sock_opts.tos = -1;
+  ids->sock_opts.timestamps = true;
+  ids->frames = phsp_frames_create();
+  if (!ids->frames) return phsp_e_sys_error("frames", self);
+  ids->reconnect = owl_reconnect_create();
+  if (!ids->reconnect) return phsp_e_sys_error("reconnect", self);
+  ids->track = phsp_track_create();
+  if (!ids->track) return phsp_e_sys_error("tracker", self);
+  ids->gate = phsp_gate_create();
+  if (!ids->gate) return phsp_e_sys_error("gate", self);
+  ids->solver = phsp_solver_create();
+  if (!ids->solver) return phsp_e_sys_error("solver", self);
+  ids->kf = phsp_kf_create();
+  if (!ids->kf) return phsp_e_sys_error("filters", self);
 
   return phasespace_pause_poll;
 }
@@ -45,28 +66,35 @@ phsp_publish_start(phasespace_ids *ids, const genom_context self)
  * Yields to phasespace_pause_poll, phasespace_poll, phasespace_recv,
  *           phasespace_err.
  * Throws phasespace_e_sys.
+ *
+ * Waits until at least one complete frame is buffered: the socket is read
+ * without blocking for up to rx_spin us (0 to block right away, for
+ * isolated cores) and then waited for with an edge-triggered epoll, for
+ * at most 500ms. Without a server, picks up the connection established
+ * by the reconnection thread, if any, and applies sock_opts to it.
  */
 genom_event
-phsp_publish_poll(const phasespace_server_s *server,
+phsp_publish_poll(phasespace_server_s **server, uint32_t rx_spin,
+                  phasespace_reconnect_s *reconnect,
+                  const phasespace_sock_opts *sock_opts,
+                  phasespace_latency_s **latency,
                   const genom_context self)
 {
-  struct pollfd pfd;
   int s;
 
   /* when there is no server connected, just wait */
-  if (server == NULL || server->fd < 0) return phasespace_pause_poll;
-
-  /* check if there is data to read, for at most 500ms */
-  pfd.fd = server->fd;
-  pfd.events = POLLIN;
-  do s = poll(&pfd, 1, 500/*ms*/); while (s < 0 && errno == EINTR);
+  if (*server == NULL) {
+    *server = owl_reconnect_take(reconnect);
+    if (*server) owl_tune(*server, sock_opts);
+  }
+  if (*server == NULL || (*server)->fd < 0) return phasespace_pause_poll;
 
-  /* return appropriate next state depending on the poll results */
+  s = owl_wait(*server, rx_spin, 500/*ms*/);
   if (s < 0) return phasespace_err;
   if (s == 0) return phasespace_poll;
-  if (pfd.revents & POLLHUP) return phasespace_err;
 
-  /* data to read */
+  /* frame to decode, latencies are measured from now */
+  if (*latency) (*latency)->ready = phsp_latency_now();
   return phasespace_recv;
 }
 
@@ -76,64 +104,74 @@ phsp_publish_poll(const phasespace_server_s *server,
  * Triggered by phasespace_recv.
  * Yields to phasespace_poll, phasespace_err.
  * Throws phasespace_e_sys.
+ *
+ * With rx_coalesce PHSP_RX_ALL, publishes the oldest buffered frame: the
+ * poll codel comes back at once while more are buffered. Otherwise, when
+ * the task fell behind, stale frames are skipped from their header only
+ * (or decoded just for the logger and the filters with
+ * PHSP_RX_LATEST_LOG), pulling the socket backlog as well, and only the
+ * newest frame is published. Every decoded frame gets persistent marker
+ * ids if tracking is enabled and goes through the quality gate, which
+ * flags implausible markers and rigids PHSP_FLAG_REJECTED. Then rigids
+ * the server could not track, or that were rejected, are fitted on their
+ * accepted markers when a template is registered, and the rigids go
+ * through the filter bank, whose states are published along with the
+ * frame.
  */
 genom_event
-phsp_publish_recv(const phasespace_server_s *server,
+phsp_publish_recv(phasespace_server_s *server, uint32_t rx_coalesce,
                   phasespace_log_s **log,
-                  phasespace_bodies *bodies,
+                  phasespace_track_s *track, phasespace_gate_s *gate,
+                  phasespace_solver_s *solver, phasespace_kf_s *kf,
+                  phasespace_frames_s *frames,
+                  phasespace_shm_s **shm,
+                  phasespace_latency_s **latency,
                   const genom_context self)
 {
-  // 1. Receive next OWL event
-  Event *evt = owl_nextEvent(server->ctx, 0);  // libowl2 API
+  phasespace_latency_s *lat = *latency;
+  phasespace_bodies *back = phsp_frames_back(frames);
+  phasespace_states *states = phsp_frames_back_states(frames);
+  const phasespace_bodies *bodies;
+  size_t n;
+  int round;
 
-  if (!evt) {
-    return phasespace_poll;  // nothing new yet
-  }
+  /* skip all but the newest frame */
+  if (rx_coalesce != PHSP_RX_ALL) {
+    for (round = 0; round < PHSP_RX_COALESCE_ROUNDS; round++) {
+      for (n = owl_frames_buffered(server); n > 1; n--) {
+        if (rx_coalesce == PHSP_RX_LATEST_LOG) {
+          owl_decode_frame(server, back);
+          phsp_track_update(track, back);
+          phsp_gate_update(gate, back);
+          phsp_solver_update(solver, back);
+          phsp_kf_update(kf, back, states);
+          owl_log(*log, back);
+          server->coalesced++;
+        } else
+          owl_skip_frame(server);
+      }
 
-  // 2. Handle FRAME events (markers + rigids)
-  if (evt->type_id == FRAME) {
-    /* Copy markers */
-    bodies->num_markers = evt->num_markers;
-    if (bodies->num_markers > PHASESPACE_MAX_MARKERS)
-      bodies->num_markers = PHASESPACE_MAX_MARKERS;
-
-    for (size_t i = 0; i < bodies->num_markers; i++) {
-      bodies->markers[i].id    = evt->markers[i].id;
-      bodies->markers[i].flags = evt->markers[i].flags;
-      bodies->markers[i].time  = evt->markers[i].time;
-      bodies->markers[i].x     = evt->markers[i].x;
-      bodies->markers[i].y     = evt->markers[i].y;
-      bodies->markers[i].z     = evt->markers[i].z;
-      bodies->markers[i].cond  = evt->markers[i].cond;
+      /* a disconnection is reported by the next poll */
+      if (owl_recv(server) <= 0) break;
     }
-
-    /* Copy rigids */
-    bodies->num_rigids = evt->num_rigids;
-    if (bodies->num_rigids > PHASESPACE_MAX_RIGIDS)
-      bodies->num_rigids = PHASESPACE_MAX_RIGIDS;
-
-    for (size_t i = 0; i < bodies->num_rigids; i++) {
-      bodies->rigids[i].id    = evt->rigids[i].id;
-      bodies->rigids[i].flags = evt->rigids[i].flags;
-      bodies->rigids[i].time  = evt->rigids[i].time;
-      bodies->rigids[i].x     = evt->rigids[i].pose[0];
-      bodies->rigids[i].y     = evt->rigids[i].pose[1];
-      bodies->rigids[i].z     = evt->rigids[i].pose[2];
-      bodies->rigids[i].qw    = evt->rigids[i].pose[3];
-      bodies->rigids[i].qx    = evt->rigids[i].pose[4];
-      bodies->rigids[i].qy    = evt->rigids[i].pose[5];
-      bodies->rigids[i].qz    = evt->rigids[i].pose[6];
-      bodies->rigids[i].cond  = evt->rigids[i].cond;
-    }
-  }
-  // 3. Handle ERROR events
-  else if (evt->type_id == ERROR) {
-    owl_log(*log);
-    return phasespace_e_sys(self);
   }
 
-  // 4. Log
-  owl_log(*log);
+  /* decode the frame to publish in the private back slot */
+  if (!owl_decode_frame(server, back)) return phasespace_poll;
+  if (lat) phsp_latency_record(lat, PHSP_LAT_DECODE, phsp_latency_now());
+  phsp_frames_stamp(frames, lat ? lat->ready : 0);
+  phsp_track_update(track, back);
+  phsp_gate_update(gate, back);
+  phsp_solver_update(solver, back);
+  phsp_kf_update(kf, back, states);
+
+  /* swap it in for readers, export it to local consumers, then log it */
+  bodies = phsp_frames_publish(frames, NULL);
+  if (*shm) phsp_frames_export(*shm, bodies);
+  if (lat) phsp_latency_record(lat, PHSP_LAT_PUBLISH, phsp_latency_now());
+
+  owl_log(*log, bodies);
+  if (lat) phsp_latency_record(lat, PHSP_LAT_LOG, phsp_latency_now());
 
   return phasespace_poll;
 }
@@ -144,19 +182,78 @@ phsp_publish_recv(const phasespace_server_s *server,
  * Triggered by phasespace_err.
  * Yields to phasespace_pause_poll.
  * Throws phasespace_e_sys.
+ *
+ * Republishes the last frame flagged PHSP_FLAG_STALE, so that readers
+ * keep the last known state, and has the connection re-established in
+ * the background if it was made by the connect activity.
  */
 genom_event
 phsp_publish_err(phasespace_server_s **server,
+                 phasespace_frames_s *frames,
+                 phasespace_shm_s **shm,
+                 phasespace_reconnect_s *reconnect,
                  const genom_context self)
 {
+  const phasespace_bodies *stale;
+
   if (*server) {
     owl_disconnect(*server);  // free ctx and close fd
     *server = NULL;
   }
+
+  stale = phsp_frames_stale(frames);
+  if (stale && *shm) phsp_frames_export(*shm, stale);
+
+  owl_reconnect_lost(reconnect);
   return phasespace_pause_poll;
 }
 
 
+/** Codel phsp_publish_stop of task publish.
+ *
+ * Triggered by phasespace_stop.
+ * Yields to phasespace_ether.
+ * Throws phasespace_e_sys.
+ *
+ * Stops the reconnection thread first, so that it cannot hand over a new
+ * connection, closes the server, flushes the log and releases everything
+ * phsp_publish_start and the functions allocated.
+ */
+genom_event
+phsp_publish_stop(phasespace_ids *ids, const genom_context self)
+{
+  owl_reconnect_destroy(ids->reconnect);
+  ids->reconnect = NULL;
+  if (ids->server) {
+    owl_disconnect(ids->server);
+    ids->server = NULL;
+  }
+
+  if (ids->log) {
+    owl_log_fini(ids->log);
+    free(ids->log);
+    ids->log = NULL;
+  }
+  phsp_shm_destroy(ids->shm);
+  ids->shm = NULL;
+  phsp_latency_destroy(ids->latency);
+  ids->latency = NULL;
+
+  phsp_kf_destroy(ids->kf);
+  ids->kf = NULL;
+  phsp_solver_destroy(ids->solver);
+  ids->solver = NULL;
+  phsp_gate_destroy(ids->gate);
+  ids->gate = NULL;
+  phsp_track_destroy(ids->track);
+  ids->track = NULL;
+  phsp_frames_destroy(ids->frames);
+  ids->frames = NULL;
+
+  return phasespace_ether;
+}
+
+
 /* --- Activity connect ------------------------------------------------- */
 
 /** Codel phsp_connect_start of activity connect.
@@ -164,23 +261,64 @@ phsp_publish_err(phasespace_server_s **server,
  * Triggered by phasespace_start.
  * Yields to phasespace_ether.
  * Throws phasespace_e_sys.
+ *
+ * 'transport' selects the TCP stream (PHSP_TRANSPORT_TCP) or sequenced
+ * UDP datagrams (PHSP_TRANSPORT_UDP), which avoid head-of-line blocking
+ * when a packet is lost. The connection is abandoned after 'timeout' ms
+ * (0 for PHSP_CONNECT_TIMEOUT), not counting the first resolution of the
+ * host name. The socket options of set_socket are applied on a best
+ * effort basis. Once connected, the connection is supervised and
+ * automatically re-established when it is lost.
  */
 genom_event
 phsp_connect_start(const char host[128], const char host_port[128],
+                   uint32_t transport, uint32_t timeout,
+                   const phasespace_sock_opts *sock_opts,
                    phasespace_server_s **server,
+                   phasespace_reconnect_s *reconnect,
                    const genom_context self)
 {
   /* disconnect any previous server */
-  if (*server) phsp_disconnect(server, self);
+  phsp_disconnect(server, reconnect, self);
 
   /* connect to designated host */
-  *server = owl_connect(host, host_port);
+  *server = owl_connect(host, host_port, transport, timeout);
   if (!*server) return phsp_e_sys_error("owl_connect", self);
+  owl_tune(*server, sock_opts);
+  owl_reconnect_supervise(reconnect, host, host_port, transport, timeout);
 
   return phasespace_ether;
 }
 
 
+/* --- Activity replay -------------------------------------------------- */
+
+/** Codel phsp_replay_start of activity replay.
+ *
+ * Triggered by phasespace_start.
+ * Yields to phasespace_ether.
+ * Throws phasespace_e_sys.
+ *
+ * Replaces the server connection by the replay of a capture file, at
+ * 'speed' times the original pace (0 for as fast as possible). The
+ * publish task decodes it like a live stream, and the end of the file
+ * looks like a server disconnection.
+ */
+genom_event
+phsp_replay_start(const char path[64], double speed,
+                  phasespace_server_s **server,
+                  phasespace_reconnect_s *reconnect,
+                  const genom_context self)
+{
+  /* disconnect any previous server */
+  phsp_disconnect(server, reconnect, self);
+
+  *server = owl_replay(path, speed);
+  if (!*server) return phsp_e_sys_error(path, self);
+
+  return phasespace_ether;
+}
+
 /* --- Activity disconnect ---------------------------------------------- */
 
 /** Codel phsp_disconnect of activity disconnect.
@@ -188,11 +326,15 @@ phsp_connect_start(const char host[128], const char host_port[128],
  * Triggered by phasespace_start.
  * Yields to phasespace_ether.
  * Throws phasespace_e_sys.
+ *
+ * Also stops the automatic reconnection.
  */
 genom_event
 phsp_disconnect(phasespace_server_s **server,
+                phasespace_reconnect_s *reconnect,
                 const genom_context self)
 {
+  owl_reconnect_cancel(reconnect);
   if (*server) {
     owl_disconnect(*server);  // free ctx and close fd
     *server = NULL;
@@ -13,105 +13,203 @@
  *      other materials provided with the distribution.
  */
 
-#ifndef H_PHASESPACE_C_TYPES
-#define H_PHASESPACE_C_TYPES
+#ifndef H_PHASESPACE_PHSP
+#define H_PHASESPACE_PHSP
 
-#include <aio.h>
-#include <errno.h>
-#include <inttypes.h>
-#include <stdbool.h>
-#include <stdio.h>
-#include <string.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include "phasespace_c_types.h"
+#include "phsp_wire.h"
 
 /* ---------------------------------------------------------------------- */
-/* Server connection wrapper                                              */
+/* OWL hardware access layer (phsp_ports.c)                               */
 /* ---------------------------------------------------------------------- */
-struct phasespace_server_s {
-  /* private data for OWL protocol (e.g. libowl2 socket/context) */
-  int fd; /* TCP socket or handle */
-  void *ctx; /* opaque OWL context pointer if needed */
-};
+int	owl_port_init(struct phasespace_server_s **server,
+                const char *host, const char *port);
+void	owl_port_shutdown(struct phasespace_server_s **server);
+
+ssize_t	owl_recv(struct phasespace_server_s *server);
+size_t	owl_frame_pending(struct phasespace_server_s *server);
+size_t	owl_frames_buffered(struct phasespace_server_s *server);
+int	owl_skip_frame(struct phasespace_server_s *server);
+int	owl_decode_frame(struct phasespace_server_s *server,
+                phasespace_bodies *bodies);
+int	owl_fetch_frame(struct phasespace_server_s *server,
+                phasespace_bodies *bodies);
+
+void	owl_log_frame(struct phasespace_log_s *log,
+                const phasespace_bodies *bodies);
 
 /* ---------------------------------------------------------------------- */
-/* Logging struct                                                         */
+/* Frame copies (phsp_frames.c)                                           */
 /* ---------------------------------------------------------------------- */
-struct phasespace_log_s {
-  struct aiocb req;
-  char path[1024];
-  char buffer[4096];
-  bool pending, skipped;
-  uint32_t decimation;
-  size_t missed, total;
-
-};
+void	phsp_bodies_copy(phasespace_bodies *dst, const phasespace_bodies *src);
 
-# define phsp_log_header \
-  "name ts  x y z  roll pitch yaw"
-# define phsp_log_line \
-  "%s %" PRIu64 ".%09d  %g %g %g  %g %g %g"
 /* ---------------------------------------------------------------------- */
-/* Marker and rigid body definitions                                      */
+/* Struct-of-arrays kernels (phsp_soa.c)                                  */
 /* ---------------------------------------------------------------------- */
-typedef struct {
-  int32_t id;
-  int32_t flags;
-  int64_t time;          /* system timestamp */
-  double x, y, z;        /* position */
-  double cond;           /* condition number (<=0 = invalid) */
-} phasespace_marker_s;
+void	phsp_soa_from_markers(phasespace_soa *s, const phasespace_marker_s *m,
+                size_t n);
+void	phsp_soa_from_rigids(phasespace_soa *s, const phasespace_rigid_s *r,
+                size_t n);
 
-typedef struct {
-  int32_t id;
-  int32_t flags;
-  int64_t time;          /* system timestamp */
-  double x, y, z;        /* position */
-  double qw, qx, qy, qz; /* orientation quaternion */
-  double cond;           /* condition number (<=0 = invalid) */
-} phasespace_rigid_s;
+void	phsp_soa_norms(const phasespace_soa *a, const phasespace_soa *b,
+                size_t n, double *d);
 
 /* ---------------------------------------------------------------------- */
-/* Bodies container (published to ports)                                  */
+/* Frame publication (phsp_frames.c)                                      */
 /* ---------------------------------------------------------------------- */
-#define PHASESPACE_MAX_MARKERS 128
-#define PHASESPACE_MAX_RIGIDS   64
+struct phasespace_frames_s *
+	phsp_frames_create(void);
+void	phsp_frames_destroy(struct phasespace_frames_s *frames);
+
+phasespace_bodies *
+	phsp_frames_back(struct phasespace_frames_s *frames);
+const phasespace_bodies *
+	phsp_frames_publish(struct phasespace_frames_s *frames, uint64_t *seq);
+const phasespace_bodies *
+	phsp_frames_stale(struct phasespace_frames_s *frames);
+const phasespace_bodies *
+	phsp_frames_read(struct phasespace_frames_s *frames, uint64_t *seq);
+
+/* socket readable time of the back slot, and of the last read frame */
+static inline void
+phsp_frames_stamp(struct phasespace_frames_s *frames, uint64_t t)
+{
+  frames->stamp[frames->back] = t;
+}
+
+static inline uint64_t
+phsp_frames_read_stamp(const struct phasespace_frames_s *frames)
+{
+  return frames->stamp[frames->front];
+}
+
+/* filtered states of the back slot, and of the last read frame */
+static inline phasespace_states *
+phsp_frames_back_states(struct phasespace_frames_s *frames)
+{
+  return &frames->states[frames->back];
+}
+
+static inline const phasespace_states *
+phsp_frames_read_states(const struct phasespace_frames_s *frames)
+{
+  return &frames->states[frames->front];
+}
 
-typedef struct {
-  size_t num_markers;
-  phasespace_marker_s markers[PHASESPACE_MAX_MARKERS];
-  size_t num_rigids;
-  phasespace_rigid_s rigids[PHASESPACE_MAX_RIGIDS];
-} phasespace_bodies;
+struct phasespace_shm_s;
+void	phsp_frames_export(struct phasespace_shm_s *shm,
+                const phasespace_bodies *bodies);
 
 /* ---------------------------------------------------------------------- */
-/* Error helper                                                           */
+/* Latency instrumentation (phsp_latency.c)                               */
 /* ---------------------------------------------------------------------- */
-static inline genom_event
-phsp_e_sys_error(const char *s, genom_context self)
+static inline uint64_t
+phsp_latency_now(void)
 {
-  phasespace_e_sys_detail d;
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+struct phasespace_latency_s *
+	phsp_latency_create(void);
+void	phsp_latency_destroy(struct phasespace_latency_s *lat);
 
-  d.code = errno;
-  snprintf(d.what, sizeof(d.what), "%s%s%s",
-           s ? s : "", s ? ": " : "", strerror(d.code));
-  return phasespace_e_sys(&d, self);
+void	phsp_hist_record(struct phsp_hist *h, uint64_t ns);
+uint64_t
+	phsp_hist_percentile(const struct phsp_hist *h, double p);
+
+/* record the latency of 'stage' at time t, relative to socket readable */
+static inline void
+phsp_latency_record(struct phasespace_latency_s *lat,
+                    enum phsp_latency_stage stage, uint64_t t)
+{
+  if (lat->ready && t >= lat->ready)
+    phsp_hist_record(&lat->hist[stage], t - lat->ready);
 }
 
+void	phsp_latency_stats(const struct phasespace_latency_s *lat,
+                phasespace_latency_stats *stats);
+
 /* ---------------------------------------------------------------------- */
-/* OWL protocol wrappers (to be implemented with libowl2 or bindings)     */
+/* Frame clock                                                            */
 /* ---------------------------------------------------------------------- */
-struct phasespace_server_s *
-owl_connect(const char *host, const char *port);
-
-int
-owl_poll(struct phasespace_server_s server, struct timeval *timeout);
+/*
+ * Clock of a frame received at t, ns: t, or the previous clock plus
+ * PHSP_CLOCK_FLOOR of the mean frame interval if that is later. Intervals
+ * longer than 'timeout' ns are not averaged, and the clock restarts from
+ * t if t goes back by more than that.
+ */
+static inline int64_t
+phsp_frame_clock(struct phsp_frame_clock *c, int64_t t, int64_t timeout)
+{
+  int64_t step;
+
+  if (c->last && t >= c->last && t - c->last <= timeout)
+    c->period = c->period > 0. ?
+      c->period + PHSP_CLOCK_GAIN * ((t - c->last) - c->period) :
+      t - c->last;
+  c->last = t;
+
+  step = PHSP_CLOCK_FLOOR * c->period;
+  if (!c->time || t >= c->time + step || c->time - t > timeout)
+    c->time = t;
+  else
+    c->time += step;
+  return c->time;
+}
 
-uint32_t
-owl_version(struct phasespace_server_s server);
+/* ---------------------------------------------------------------------- */
+/* Marker tracking (phsp_track.c)                                         */
+/* ---------------------------------------------------------------------- */
+struct phasespace_track_s *
+	phsp_track_create(void);
+void	phsp_track_destroy(struct phasespace_track_s *track);
+int	phsp_track_params(struct phasespace_track_s *track,
+                const phasespace_track_params *params);
+void	phsp_track_update(struct phasespace_track_s *track,
+                phasespace_bodies *bodies);
 
-void
-owl_disconnect(struct phasespace_server_s *server);
+/* ---------------------------------------------------------------------- */
+/* Quality gate (phsp_gate.c)                                             */
+/* ---------------------------------------------------------------------- */
+struct phasespace_gate_s *
+	phsp_gate_create(void);
+void	phsp_gate_destroy(struct phasespace_gate_s *gate);
+int	phsp_gate_params(struct phasespace_gate_s *gate,
+                const phasespace_gate_params *params);
+void	phsp_gate_update(struct phasespace_gate_s *gate,
+                phasespace_bodies *bodies);
 
-void
-owl_log(struct phasespace_log_s *log);
+/* ---------------------------------------------------------------------- */
+/* Rigid body solver (phsp_solver.c)                                      */
+/* ---------------------------------------------------------------------- */
+struct phasespace_solver_s *
+	phsp_solver_create(void);
+void	phsp_solver_destroy(struct phasespace_solver_s *solver);
+int	phsp_solver_set(struct phasespace_solver_s *solver,
+                const phasespace_template *t);
+void	phsp_solver_update(struct phasespace_solver_s *solver,
+                phasespace_bodies *bodies);
 
-#endif /* H_PHASESPACE_C_TYPES */
+/* ---------------------------------------------------------------------- */
+/* Rigid body filters (phsp_kf.c)                                         */
+/* ---------------------------------------------------------------------- */
+struct phasespace_kf_s *
+	phsp_kf_create(void);
+void	phsp_kf_destroy(struct phasespace_kf_s *kf);
+const struct phasespace_kf_s *
+	phsp_kf_shared(void);
+int	phsp_kf_params(struct phasespace_kf_s *kf,
+                const phasespace_kf_params *params);
+void	phsp_kf_update(struct phasespace_kf_s *kf,
+                const phasespace_bodies *bodies, phasespace_states *states);
+int	phsp_kf_predict(const struct phasespace_kf_s *kf, int32_t id,
+                int64_t time, uint32_t model, int64_t max_age,
+                phasespace_rigid_state *pose);
+
+#endif /* H_PHASESPACE_PHSP */
@@ -0,0 +1,653 @@
+/*
+ * Copyright (c) 2025 UCL
+ * All rights reserved.
+ *
+ * Redistribution and use  in source  and binary  forms,  with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *   1. Redistributions of  source  code must retain the  above copyright
+ *      notice and this list of conditions.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice and  this list of  conditions in the  documentation and/or
+ *      other materials provided with the distribution.
+ *
+ * phsp_bench.c — microbenchmarks of the decode, publish, gate, tracker,
+ * solver and log hot paths, and the tracker and gate together
+ *
+ * Usage: phsp-bench [-t seconds] [-b name] [-o output.json]
+ *
+ * Every stage is run at 8/32/128 markers times 1/16/64 rigids (the rigid
+ * solver only when there are at least 3 markers per rigid), plus an
+ * end-to-end run of owl_fetch_frame() -> publish -> log against a loopback
+ * TCP frame source. Results are written as JSON, with the time per frame,
+ * the frame rate and the number of heap allocations per frame made by the
+ * code under test (counted by wrapping malloc and friends at link time,
+ * see Makefile.am).
+ */
+#include "acphasespace.h"
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "phasespace_c_types.h"
+#include "phsp.h"
+#include "owl.h"
+#include "phsp_shm.h"
+
+static const unsigned int scene_markers[] = { 8, 32, 128 };
+static const unsigned int scene_rigids[] = { 1, 16, 64 };
+
+static double min_time = 0.5;	/* seconds per benchmark */
+static const char *only;	/* run only this benchmark */
+static FILE *out;
+static int nresults;
+
+
+/* --- allocation counting ---------------------------------------------- */
+
+static unsigned long allocs;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *p, size_t size);
+int __real_posix_memalign(void **p, size_t align, size_t size);
+
+void *
+__wrap_malloc(size_t size)
+{
+    __atomic_fetch_add(&allocs, 1, __ATOMIC_RELAXED);
+    return __real_malloc(size);
+}
+
+void *
+__wrap_calloc(size_t n, size_t size)
+{
+    __atomic_fetch_add(&allocs, 1, __ATOMIC_RELAXED);
+    return __real_calloc(n, size);
+}
+
+void *
+__wrap_realloc(void *p, size_t size)
+{
+    __atomic_fetch_add(&allocs, 1, __ATOMIC_RELAXED);
+    return __real_realloc(p, size);
+}
+
+int
+__wrap_posix_memalign(void **p, size_t align, size_t size)
+{
+    __atomic_fetch_add(&allocs, 1, __ATOMIC_RELAXED);
+    return __real_posix_memalign(p, align, size);
+}
+
+
+/* --- helpers ---------------------------------------------------------- */
+
+static inline uint64_t
+now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline void
+put_float(uint8_t **p, double v)
+{
+    float f = v;
+    memcpy(*p, &f, sizeof(f));
+    *p += sizeof(f);
+}
+
+/* encode a wire frame of nm markers and nr rigids, return its size */
+static size_t
+bench_encode(uint8_t *buf, unsigned int nm, unsigned int nr, unsigned int k)
+{
+    uint8_t *p = buf;
+    unsigned int i;
+
+    p[0] = nm >> 8; p[1] = nm; p[2] = nr >> 8; p[3] = nr;
+    memset(p + 4, 0, OWL_HEADER_SIZE - 4);
+    p += OWL_HEADER_SIZE;
+
+    for (i = 0; i < nm; i++) {
+        put_float(&p, i + 0.001 * k); put_float(&p, 2. * i);
+        put_float(&p, 1000.); put_float(&p, 1.);
+    }
+    for (i = 0; i < nr; i++) {
+        double a = 0.01 * (i + k);
+        put_float(&p, i); put_float(&p, k); put_float(&p, 1000.);
+        put_float(&p, cos(a)); put_float(&p, 0.);
+        put_float(&p, 0.); put_float(&p, sin(a));
+        put_float(&p, 1.);
+    }
+
+    return p - buf;
+}
+
+/* fill bodies with a synthetic frame */
+static void
+bench_bodies(phasespace_bodies *b, unsigned int nm, unsigned int nr)
+{
+    struct phasespace_server_s *s = calloc(1, sizeof(*s));
+
+    if (!s) { perror("calloc"); exit(1); }
+    s->w = bench_encode(s->rbuf, nm, nr, 0);
+    owl_decode_frame(s, b);
+    free(s);
+}
+
+static void
+bench_result(const char *name, unsigned int nm, unsigned int nr,
+             uint64_t frames, uint64_t ns, unsigned long nalloc)
+{
+    fprintf(out, "%s    {\"name\": \"%s\", \"markers\": %u, \"rigids\": %u, "
+            "\"frames\": %" PRIu64 ", \"ns_per_frame\": %.1f, "
+            "\"frames_per_s\": %.0f, \"allocs_per_frame\": %.3g}",
+            nresults++ ? ",\n" : "", name, nm, nr, frames,
+            (double)ns / frames, frames * 1e9 / ns, (double)nalloc / frames);
+    fflush(out);
+}
+
+static inline bool
+bench_enabled(const char *name)
+{
+    return !only || !strcmp(only, name);
+}
+
+/* run 'body' in batches of 'batch' frames until min_time elapsed */
+#define BENCH_LOOP(name, nm, nr, batch, body)				\
+    do {								\
+        uint64_t _n = 0, _t0, _t;					\
+        unsigned long _a0 = allocs;					\
+                                                                        \
+        _t0 = now_ns();							\
+        do {								\
+            for (unsigned int _i = 0; _i < (batch); _i++) { body; }	\
+            _n += (batch);						\
+            _t = now_ns() - _t0;					\
+        } while (_t < min_time * 1e9);					\
+        bench_result(name, nm, nr, _n, _t, allocs - _a0);		\
+    } while (0)
+
+
+/* --- stages ----------------------------------------------------------- */
+
+/* owl_decode_frame() from a receive buffer filled with whole frames */
+static void
+bench_decode(unsigned int nm, unsigned int nr)
+{
+    static phasespace_bodies b;
+    struct phasespace_server_s *s = calloc(1, sizeof(*s));
+    size_t len, nframes, w;
+
+    if (!s) { perror("calloc"); exit(1); }
+    len = bench_encode(s->rbuf, nm, nr, 0);
+    nframes = sizeof(s->rbuf) / len;
+    for (w = len; w + len <= sizeof(s->rbuf); w += len)
+        memcpy(s->rbuf + w, s->rbuf, len);
+
+    BENCH_LOOP("decode", nm, nr, nframes, {
+        if (_i == 0) { s->r = 0; s->w = w; }
+        owl_decode_frame(s, &b);
+    });
+
+    free(s);
+}
+
+/* fill the back slot, publish it and read it back, as phsp_publish_recv()
+ * and phsp_get_bodies() do */
+static void
+bench_publish(unsigned int nm, unsigned int nr, bool shm)
+{
+    static phasespace_bodies src, dst;
+    struct phasespace_frames_s *frames = phsp_frames_create();
+    struct phasespace_shm_s *export = NULL;
+    const phasespace_bodies *b;
+    char name[64];
+    uint64_t seq;
+
+    if (!frames) { perror("phsp_frames_create"); exit(1); }
+    if (shm) {
+        snprintf(name, sizeof(name), "/phsp-bench-%d", (int)getpid());
+        export = phsp_shm_create(name);
+        if (!export) { perror(name); exit(1); }
+    }
+    bench_bodies(&src, nm, nr);
+
+    BENCH_LOOP(shm ? "publish_shm" : "publish", nm, nr, 64, {
+        phsp_bodies_copy(phsp_frames_back(frames), &src);
+        b = phsp_frames_publish(frames, &seq);
+        if (export) phsp_frames_export(export, b);
+        phsp_bodies_copy(&dst, phsp_frames_read(frames, &seq));
+    });
+
+    if (export) phsp_shm_destroy(export);
+    phsp_frames_destroy(frames);
+}
+
+/* owl_log() to a temporary file, blocking when the disk lags behind */
+static void
+bench_log(unsigned int nm, unsigned int nr, uint32_t format)
+{
+    static phasespace_bodies src;
+    static struct phasespace_log_s log;
+    char path[] = "/tmp/phsp-bench-XXXXXX";
+    int fd;
+
+    fd = mkstemp(path);
+    if (fd < 0) { perror(path); exit(1); }
+    close(fd);
+    if (owl_log_init(&log, path, 1, format, PHSP_LOG_BLOCK)) {
+        perror(path);
+        exit(1);
+    }
+    bench_bodies(&src, nm, nr);
+
+    BENCH_LOOP(format == PHSP_LOG_BINARY ? "log_binary" : "log_text",
+               nm, nr, 64, {
+        owl_log(&log, &src);
+    });
+
+    owl_log_fini(&log);
+    unlink(path);
+}
+
+/* gate frame b, received along with the last one, with every entry
+ * moved dz: return the number of entries whose verdict is not 'reject' */
+static unsigned int
+gate_burst_frame(phasespace_bodies *b, struct phasespace_gate_s *gate,
+                 double dz, bool reject)
+{
+    unsigned int i, bad = 0;
+
+    for (i = 0; i < b->num_markers; i++) {
+        b->markers[i].z += dz;
+        b->markers[i].flags = 0;
+    }
+    for (i = 0; i < b->num_rigids; i++) {
+        b->rigids[i].z += dz;
+        b->rigids[i].flags = 0;
+    }
+    phsp_gate_update(gate, b);
+
+    for (i = 0; i < b->num_markers; i++)
+        bad += !(b->markers[i].flags & PHSP_FLAG_REJECTED) == reject;
+    for (i = 0; i < b->num_rigids; i++)
+        bad += !(b->rigids[i].flags & PHSP_FLAG_REJECTED) == reject;
+    return bad;
+}
+
+/* phsp_gate_update() with all checks enabled, on frames 1ms apart that
+ * all pass them but the first markers, held as new ids. Then two more
+ * frames at the time of the last one: everything jumped 30mm in the
+ * first, which must be rejected, and is back in place in the second */
+static void
+bench_gate(unsigned int nm, unsigned int nr)
+{
+    static phasespace_bodies b;
+    struct phasespace_gate_s *gate = phsp_gate_create();
+    phasespace_gate_params p = {
+        .enable = true,
+        .marker_cond = 10., .marker_vel = 1e4, .marker_acc = 1e7,
+        .rigid_cond = 10., .rigid_vel = 1e4, .rigid_acc = 1e7,
+        .rigid_rate = 50., .quat_norm = 1e-2, .timeout = 0.2,
+    };
+    unsigned int i;
+
+    if (!gate) { perror("phsp_gate_create"); exit(1); }
+    if (phsp_gate_params(gate, &p)) { perror("bench_gate"); exit(1); }
+    bench_bodies(&b, nm, nr);
+
+    BENCH_LOOP("gate", nm, nr, 64, {
+        for (i = 0; i < nm; i++) {
+            b.markers[i].time += 1000000;
+            b.markers[i].flags = 0;
+        }
+        for (i = 0; i < nr; i++) b.rigids[i].time += 1000000;
+        phsp_gate_update(gate, &b);
+    });
+
+    for (i = 0; i < nm; i++)
+        if (b.markers[i].flags & PHSP_FLAG_REJECTED) {
+            fprintf(stderr, "bench_gate: marker %u rejected\n", i);
+            exit(1);
+        }
+    for (i = 0; i < nr; i++)
+        if (b.rigids[i].flags & PHSP_FLAG_REJECTED) {
+            fprintf(stderr, "bench_gate: rigid %u rejected\n", i);
+            exit(1);
+        }
+
+    if (gate_burst_frame(&b, gate, 30., true) ||
+        gate_burst_frame(&b, gate, -30., false)) {
+        fprintf(stderr, "bench_gate: frame at the same time misjudged\n");
+        exit(1);
+    }
+    phsp_gate_destroy(gate);
+}
+
+/* phsp_track_update() on markers 40mm apart on a grid, moving 1mm per
+ * frame 1ms apart, which all keep their first id */
+static void
+bench_track(unsigned int nm, unsigned int nr)
+{
+    static phasespace_bodies b;
+    struct phasespace_track_s *tr = phsp_track_create();
+    phasespace_track_params p = {
+        .enable = true, .gate = 20., .timeout = 0.2,
+    };
+    unsigned int i;
+
+    if (!tr) { perror("phsp_track_create"); exit(1); }
+    if (phsp_track_params(tr, &p)) { perror("bench_track"); exit(1); }
+    bench_bodies(&b, nm, nr);
+    for (i = 0; i < nm; i++) {
+        b.markers[i].x = 40. * (i % 8);
+        b.markers[i].y = 40. * (i / 8 % 8);
+        b.markers[i].z = 1000. + 40. * (i / 64);
+    }
+
+    BENCH_LOOP("track", nm, nr, 64, {
+        for (i = 0; i < nm; i++) {
+            b.markers[i].x += 1.;
+            b.markers[i].time += 1000000;
+        }
+        phsp_track_update(tr, &b);
+    });
+
+    for (i = 0; i < nm; i++)
+        if (b.markers[i].id != (int32_t)i + 1) {
+            fprintf(stderr, "bench_track: marker %u lost its id\n", i);
+            exit(1);
+        }
+    phsp_track_destroy(tr);
+}
+
+/* frame k of bench_track_gate(), return true if marker j jumped */
+static bool
+track_gate_frame(phasespace_bodies *b, struct phasespace_track_s *tr,
+                 struct phasespace_gate_s *gate, unsigned int j,
+                 unsigned int k)
+{
+    double dz = k % 32 ? -30. : 30.;
+    bool jump = k % 16 == 0;
+    unsigned int i;
+
+    for (i = 0; i < b->num_markers; i++) {
+        b->markers[i].x += 1.;
+        b->markers[i].time += 1000000;
+        b->markers[i].flags = 0;
+    }
+    if (jump) b->markers[j].z += dz;
+    phsp_track_update(tr, b);
+    phsp_gate_update(gate, b);
+    if (jump) b->markers[j].z -= dz;
+
+    return jump;
+}
+
+/* phsp_track_update() then phsp_gate_update(), as in publish recv, on
+ * markers 80mm apart moving 1mm per frame 1ms apart. One frame in 16, a
+ * marker jumps 30mm up or down in turn, further than the tracker gate,
+ * and gets a new id: it must be rejected, and no other marker. Rigids
+ * are left out */
+static void
+bench_track_gate(unsigned int nm, unsigned int nr)
+{
+    static phasespace_bodies b;
+    struct phasespace_track_s *tr = phsp_track_create();
+    struct phasespace_gate_s *gate = phsp_gate_create();
+    phasespace_track_params tp = {
+        .enable = true, .gate = 20., .timeout = 0.2,
+    };
+    phasespace_gate_params gp = {
+        .enable = true,
+        .marker_cond = 10., .marker_vel = 1e4, .marker_acc = 1e7,
+        .timeout = 0.2,
+    };
+    unsigned int i, f, j = nm / 2, k = 0;
+    bool jump;
+
+    if (!tr || !gate) { perror("bench_track_gate"); exit(1); }
+    if (phsp_track_params(tr, &tp) || phsp_gate_params(gate, &gp)) {
+        perror("bench_track_gate");
+        exit(1);
+    }
+    bench_bodies(&b, nm, nr);
+    b.num_rigids = 0;
+    for (i = 0; i < nm; i++) {
+        b.markers[i].x = 80. * (i % 8);
+        b.markers[i].y = 80. * (i / 8 % 8);
+        b.markers[i].z = 1000. + 80. * (i / 64);
+    }
+
+    BENCH_LOOP("track_gate", nm, nr, 64, {
+        track_gate_frame(&b, tr, gate, j, ++k);
+    });
+
+    for (f = 0; f < 64; f++) {
+        jump = track_gate_frame(&b, tr, gate, j, ++k);
+        for (i = 0; i < nm; i++)
+            if (!(b.markers[i].flags & PHSP_FLAG_REJECTED) !=
+                !(jump && i == j)) {
+                fprintf(stderr, "bench_track_gate: marker %u %s\n", i,
+                        jump && i == j ? "jumped but accepted" : "rejected");
+                exit(1);
+            }
+    }
+
+    phsp_gate_destroy(gate);
+    phsp_track_destroy(tr);
+}
+
+/* phsp_solver_update() fitting every rigid on its nm/nr markers, spread
+ * on a 50mm circle as in phsp-sim, when the server tracks none of them */
+static void
+bench_solver(unsigned int nm, unsigned int nr)
+{
+    static phasespace_bodies b;
+    static phasespace_template t;
+    struct phasespace_solver_s *solver = phsp_solver_create();
+    unsigned int per = nm / nr, i, k;
+    double a, c, s;
+
+    if (!solver) { perror("phsp_solver_create"); exit(1); }
+    if (per < 3) { phsp_solver_destroy(solver); return; }
+    if (per > PHSP_TEMPLATE_MAX_POINTS) per = PHSP_TEMPLATE_MAX_POINTS;
+    bench_bodies(&b, nm, nr);
+
+    for (k = 0; k < nr; k++) {
+        t.id = b.rigids[k].id;
+        t.max_residual = 0.;
+        t.num_points = per;
+        c = cos(0.1 * k);
+        s = sin(0.1 * k);
+        for (i = 0; i < per; i++) {
+            phasespace_marker_s *m = &b.markers[i * nr + k];
+
+            a = 2 * M_PI * i / per;
+            t.points[i].id = m->id;
+            t.points[i].x = 50. * cos(a);
+            t.points[i].y = 50. * sin(a);
+            t.points[i].z = 10. * (i & 1);
+            m->x = 100. * k + c * t.points[i].x - s * t.points[i].y;
+            m->y = s * t.points[i].x + c * t.points[i].y;
+            m->z = 1000. + t.points[i].z;
+        }
+        if (phsp_solver_set(solver, &t)) { perror("bench_solver"); exit(1); }
+    }
+
+    BENCH_LOOP("solver", nm, nr, 64, {
+        for (k = 0; k < nr; k++) b.rigids[k].cond = -1.;
+        phsp_solver_update(solver, &b);
+    });
+
+    for (k = 0; k < nr; k++)
+        if (!(b.rigids[k].cond > 0.)) {
+            fprintf(stderr, "bench_solver: rigid %u not fitted\n", k);
+            exit(1);
+        }
+    phsp_solver_destroy(solver);
+}
+
+
+/* --- end-to-end ------------------------------------------------------- */
+
+struct source {
+    int lfd;
+    unsigned int nm, nr;
+};
+
+/* loopback frame source: write pre-encoded frames as fast as possible */
+static void *
+bench_source(void *arg)
+{
+    struct source *src = arg;
+    static uint8_t buf[64 * 1024];
+    size_t len, w, off;
+    ssize_t n;
+    int fd;
+
+    fd = accept(src->lfd, NULL, NULL);
+    if (fd < 0) return NULL;
+
+    len = OWL_FRAME_SIZE(src->nm, src->nr);
+    for (w = 0; w + len <= sizeof(buf); w += len)
+        bench_encode(buf + w, src->nm, src->nr, w / len);
+
+    while (1) {
+        for (off = 0; off < w; off += n) {
+            n = send(fd, buf + off, w - off, MSG_NOSIGNAL);
+            if (n < 0) {
+                if (errno == EINTR) { n = 0; continue; }
+                goto done;
+            }
+        }
+    }
+
+done:
+    close(fd);
+    return NULL;
+}
+
+static void
+bench_e2e(unsigned int nm, unsigned int nr)
+{
+    static struct phasespace_log_s log;
+    struct sockaddr_in sin = { .sin_family = AF_INET };
+    socklen_t slen = sizeof(sin);
+    struct phasespace_server_s *server;
+    struct phasespace_frames_s *frames;
+    struct source src = { .nm = nm, .nr = nr };
+    char path[] = "/tmp/phsp-bench-XXXXXX";
+    char port[16];
+    pthread_t th;
+    uint64_t seq;
+    int fd, s;
+
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    src.lfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (src.lfd < 0 ||
+        bind(src.lfd, (struct sockaddr *)&sin, sizeof(sin)) ||
+        listen(src.lfd, 1) ||
+        getsockname(src.lfd, (struct sockaddr *)&sin, &slen)) {
+        perror("loopback source");
+        exit(1);
+    }
+    if (pthread_create(&th, NULL, bench_source, &src)) {
+        perror("pthread_create");
+        exit(1);
+    }
+    snprintf(port, sizeof(port), "%u", ntohs(sin.sin_port));
+
+    server = owl_connect("127.0.0.1", port, PHSP_TRANSPORT_TCP, 0);
+    frames = phsp_frames_create();
+    fd = mkstemp(path);
+    if (!server || !frames || fd < 0) { perror("e2e"); exit(1); }
+    close(fd);
+    if (owl_log_init(&log, path, 1, PHSP_LOG_BINARY, PHSP_LOG_BLOCK)) {
+        perror(path);
+        exit(1);
+    }
+
+    BENCH_LOOP("e2e", nm, nr, 1, {
+        if (!owl_decode_frame(server, phsp_frames_back(frames))) {
+            s = owl_wait(server, 0, -1);
+            if (s < 0) { perror("e2e"); exit(1); }
+            owl_decode_frame(server, phsp_frames_back(frames));
+        }
+        owl_log(&log, phsp_frames_publish(frames, &seq));
+    });
+
+    owl_disconnect(server);
+    pthread_join(th, NULL);
+    close(src.lfd);
+    owl_log_fini(&log);
+    unlink(path);
+    phsp_frames_destroy(frames);
+}
+
+
+/* --- main ------------------------------------------------------------- */
+
+int
+main(int argc, char *argv[])
+{
+    const char *output = NULL;
+    unsigned int i, j, nm, nr;
+    int c;
+
+    while ((c = getopt(argc, argv, "t:b:o:")) != -1) {
+        switch (c) {
+            case 't': min_time = strtod(optarg, NULL); break;
+            case 'b': only = optarg; break;
+            case 'o': output = optarg; break;
+            default:
+                fprintf(stderr,
+                        "usage: %s [-t seconds] [-b name] [-o output.json]\n",
+                        argv[0]);
+                return 2;
+        }
+    }
+
+    out = stdout;
+    if (output) {
+        out = fopen(output, "w");
+        if (!out) { perror(output); return 1; }
+    }
+
+    fprintf(out, "{\n  \"min_time\": %g,\n  \"benchmarks\": [\n", min_time);
+    for (i = 0; i < sizeof(scene_markers)/sizeof(*scene_markers); i++)
+        for (j = 0; j < sizeof(scene_rigids)/sizeof(*scene_rigids); j++) {
+            nm = scene_markers[i];
+            nr = scene_rigids[j];
+
+            if (bench_enabled("decode")) bench_decode(nm, nr);
+            if (bench_enabled("publish")) bench_publish(nm, nr, false);
+            if (bench_enabled("publish_shm")) bench_publish(nm, nr, true);
+            if (bench_enabled("log_text")) bench_log(nm, nr, PHSP_LOG_TEXT);
+            if (bench_enabled("log_binary"))
+                bench_log(nm, nr, PHSP_LOG_BINARY);
+            if (bench_enabled("gate")) bench_gate(nm, nr);
+            if (bench_enabled("track")) bench_track(nm, nr);
+            if (bench_enabled("track_gate")) bench_track_gate(nm, nr);
+            if (bench_enabled("solver")) bench_solver(nm, nr);
+            if (bench_enabled("e2e")) bench_e2e(nm, nr);
+        }
+    fprintf(out, "\n  ]\n}\n");
+
+    if (out != stdout && fclose(out)) { perror(output); return 1; }
+    return 0;
+}
@@ -0,0 +1,236 @@
+/*
+ * Copyright (c) 2025 UCL
+ * All rights reserved.
+ *
+ * Redistribution and use  in source  and binary  forms,  with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *   1. Redistributions of  source  code must retain the  above copyright
+ *      notice and this list of conditions.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice and  this list of  conditions in the  documentation and/or
+ *      other materials provided with the distribution.
+ *
+ * phsp_euler.c — batched quaternion to Euler angles conversion
+ */
+
+#include <math.h>
+
+#include "phsp_euler.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+# include <immintrin.h>
+# define PHSP_EULER_X86
+#endif
+
+/* atan(a) ~ a P(a^2) on [0, 1]: Chebyshev fit of degree 8 in a^2, maximum
+ * error 1e-8 */
+#define A0	 0.99999998178865579
+#define A1	-0.33333036709292851
+#define A2	 0.1999187202926431
+#define A3	-0.1419779779540799
+#define A4	 0.10618370642479312
+#define A5	-0.074568548385217232
+#define A6	 0.042137623745702513
+#define A7	-0.015731249223588546
+#define A8	 0.0027662835283182277
+
+
+/* --- scalar ----------------------------------------------------------- */
+
+static inline double
+atan2_approx(double y, double x)
+{
+    double ax = fabs(x), ay = fabs(y);
+    double mx = ax > ay ? ax : ay;
+    double mn = ax > ay ? ay : ax;
+    double a, s, p;
+
+    if (mx == 0.) return 0.;
+
+    a = mn / mx;
+    s = a * a;
+    p = A8;
+    p = p * s + A7;
+    p = p * s + A6;
+    p = p * s + A5;
+    p = p * s + A4;
+    p = p * s + A3;
+    p = p * s + A2;
+    p = p * s + A1;
+    p = p * s + A0;
+    p *= a;
+
+    if (ay > ax) p = M_PI_2 - p;
+    if (x < 0.) p = M_PI - p;
+    return copysign(p, y);
+}
+
+static void
+euler_scalar(size_t i, size_t n,
+             const double *qw, const double *qx, const double *qy,
+             const double *qz, double *roll, double *pitch, double *yaw)
+{
+    for (; i < n; i++) {
+        double w = qw[i], x = qx[i], y = qy[i], z = qz[i];
+        double s = 2*(w*y - z*x);
+
+        s = fmax(fmin(s, 1.0), -1.0);
+        roll[i] = atan2_approx(2*(w*x + y*z), 1 - 2*(x*x + y*y));
+        pitch[i] = atan2_approx(s, sqrt(1 - s*s));
+        yaw[i] = atan2_approx(2*(w*z + x*y), 1 - 2*(y*y + z*z));
+    }
+}
+
+
+#ifdef PHSP_EULER_X86
+
+/* --- AVX2 ------------------------------------------------------------- */
+
+__attribute__((target("avx2,fma"))) static inline __m256d
+atan2_avx2(__m256d y, __m256d x)
+{
+    const __m256d sign = _mm256_set1_pd(-0.);
+    const __m256d zero = _mm256_setzero_pd();
+    __m256d ax = _mm256_andnot_pd(sign, x);
+    __m256d ay = _mm256_andnot_pd(sign, y);
+    __m256d mx = _mm256_max_pd(ax, ay);
+    __m256d mn = _mm256_min_pd(ax, ay);
+    __m256d nz = _mm256_cmp_pd(mx, zero, _CMP_NEQ_OQ);
+    __m256d a, s, p;
+
+    /* 0/0 lanes are masked out below */
+    a = _mm256_and_pd(nz, _mm256_div_pd(mn, mx));
+    s = _mm256_mul_pd(a, a);
+    p = _mm256_set1_pd(A8);
+    p = _mm256_fmadd_pd(p, s, _mm256_set1_pd(A7));
+    p = _mm256_fmadd_pd(p, s, _mm256_set1_pd(A6));
+    p = _mm256_fmadd_pd(p, s, _mm256_set1_pd(A5));
+    p = _mm256_fmadd_pd(p, s, _mm256_set1_pd(A4));
+    p = _mm256_fmadd_pd(p, s, _mm256_set1_pd(A3));
+    p = _mm256_fmadd_pd(p, s, _mm256_set1_pd(A2));
+    p = _mm256_fmadd_pd(p, s, _mm256_set1_pd(A1));
+    p = _mm256_fmadd_pd(p, s, _mm256_set1_pd(A0));
+    p = _mm256_mul_pd(p, a);
+
+    p = _mm256_blendv_pd(p, _mm256_sub_pd(_mm256_set1_pd(M_PI_2), p),
+                         _mm256_cmp_pd(ay, ax, _CMP_GT_OQ));
+    p = _mm256_blendv_pd(p, _mm256_sub_pd(_mm256_set1_pd(M_PI), p),
+                         _mm256_cmp_pd(x, zero, _CMP_LT_OQ));
+    p = _mm256_and_pd(nz, p);
+    return _mm256_or_pd(p, _mm256_and_pd(sign, y));
+}
+
+/* 4 conversions, from qw[0..3] ... into roll[0..3] ... */
+__attribute__((target("avx2,fma"))) static inline void
+euler4_avx2(const double *qw, const double *qx, const double *qy,
+            const double *qz, double *roll, double *pitch, double *yaw)
+{
+    const __m256d one = _mm256_set1_pd(1.);
+    const __m256d mone = _mm256_set1_pd(-1.);
+    const __m256d two = _mm256_set1_pd(2.);
+    __m256d w = _mm256_loadu_pd(qw), x = _mm256_loadu_pd(qx);
+    __m256d y = _mm256_loadu_pd(qy), z = _mm256_loadu_pd(qz);
+    __m256d s, t;
+
+    /* roll */
+    s = _mm256_mul_pd(two, _mm256_fmadd_pd(w, x, _mm256_mul_pd(y, z)));
+    t = _mm256_fnmadd_pd(two, _mm256_fmadd_pd(x, x, _mm256_mul_pd(y, y)),
+                         one);
+    _mm256_storeu_pd(roll, atan2_avx2(s, t));
+
+    /* pitch, as atan2(s, sqrt(1 - s^2)) */
+    s = _mm256_mul_pd(two, _mm256_fmsub_pd(w, y, _mm256_mul_pd(z, x)));
+    s = _mm256_max_pd(_mm256_min_pd(s, one), mone);
+    t = _mm256_sqrt_pd(_mm256_fnmadd_pd(s, s, one));
+    _mm256_storeu_pd(pitch, atan2_avx2(s, t));
+
+    /* yaw */
+    s = _mm256_mul_pd(two, _mm256_fmadd_pd(w, z, _mm256_mul_pd(x, y)));
+    t = _mm256_fnmadd_pd(two, _mm256_fmadd_pd(y, y, _mm256_mul_pd(z, z)),
+                         one);
+    _mm256_storeu_pd(yaw, atan2_avx2(s, t));
+}
+
+/* the tail goes through the same vector code, padded with the identity, so
+ * that a result does not depend on n or on its position in the batch */
+__attribute__((target("avx2,fma"))) static void
+euler_avx2(size_t n,
+           const double *qw, const double *qx, const double *qy,
+           const double *qz, double *roll, double *pitch, double *yaw)
+{
+    double w[4] = { 1., 1., 1., 1. }, x[4] = { 0. }, y[4] = { 0. };
+    double z[4] = { 0. }, r[4], p[4], a[4];
+    size_t i = 0, j;
+
+    for (; i + 4 <= n; i += 4)
+        euler4_avx2(qw + i, qx + i, qy + i, qz + i,
+                    roll + i, pitch + i, yaw + i);
+    if (i == n) return;
+
+    for (j = 0; i + j < n; j++) {
+        w[j] = qw[i + j];
+        x[j] = qx[i + j];
+        y[j] = qy[i + j];
+        z[j] = qz[i + j];
+    }
+    euler4_avx2(w, x, y, z, r, p, a);
+    for (j = 0; i + j < n; j++) {
+        roll[i + j] = r[j];
+        pitch[i + j] = p[j];
+        yaw[i + j] = a[j];
+    }
+}
+
+#endif /* PHSP_EULER_X86 */
+
+
+/* --- precise ---------------------------------------------------------- */
+
+static void
+euler_libm(size_t n,
+           const double *qw, const double *qx, const double *qy,
+           const double *qz, double *roll, double *pitch, double *yaw)
+{
+    for (size_t i = 0; i < n; i++) {
+        double w = qw[i], x = qx[i], y = qy[i], z = qz[i];
+
+        roll[i] = atan2(2*(w*x + y*z), 1 - 2*(x*x + y*y));
+        pitch[i] = asin(fmax(fmin(2*(w*y - z*x), 1.0), -1.0));
+        yaw[i] = atan2(2*(w*z + x*y), 1 - 2*(y*y + z*z));
+    }
+}
+
+
+/* ---------------------------------------------------------------------- */
+/* Conversion                                                             */
+/* ---------------------------------------------------------------------- */
+void
+phsp_quat2euler(size_t n,
+                const double *qw, const double *qx, const double *qy,
+                const double *qz,
+                double *roll, double *pitch, double *yaw, bool precise)
+{
+    static int avx2 = -1;
+
+    if (precise) {
+        euler_libm(n, qw, qx, qy, qz, roll, pitch, yaw);
+        return;
+    }
+
+#ifdef PHSP_EULER_X86
+    if (avx2 < 0) {
+        __builtin_cpu_init();
+        avx2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+    }
+    if (avx2) {
+        euler_avx2(n, qw, qx, qy, qz, roll, pitch, yaw);
+        return;
+    }
+#else
+    (void)avx2;
+#endif
+
+    euler_scalar(0, n, qw, qx, qy, qz, roll, pitch, yaw);
+}
@@ -0,0 +1,43 @@
+/*
+ * Copyright (c) 2025 UCL
+ * All rights reserved.
+ *
+ * Redistribution and use  in source  and binary  forms,  with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *   1. Redistributions of  source  code must retain the  above copyright
+ *      notice and this list of conditions.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice and  this list of  conditions in the  documentation and/or
+ *      other materials provided with the distribution.
+ */
+
+#ifndef H_PHASESPACE_EULER
+#define H_PHASESPACE_EULER
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Batch conversion of unit quaternions to roll, pitch, yaw (rad), with the
+ * same conventions as the text log:
+ *   roll  = atan2(2(qw qx + qy qz), 1 - 2(qx^2 + qy^2))
+ *   pitch = asin(2(qw qy - qz qx)), argument clamped to [-1, 1]
+ *   yaw   = atan2(2(qw qz + qx qy), 1 - 2(qy^2 + qz^2))
+ *
+ * With precise false, atan2 and asin are replaced by a degree 17 odd
+ * polynomial approximation of atan evaluated 4 lanes at a time when AVX2
+ * is available. Its absolute error is below PHSP_EULER_MAX_ERROR on every
+ * angle. Each result depends only on its own quaternion, not on n: single
+ * conversions match batched ones bit for bit. With precise true, libm is
+ * used.
+ */
+#define PHSP_EULER_MAX_ERROR	2e-8	/* rad */
+
+void	phsp_quat2euler(size_t n,
+                const double *qw, const double *qx, const double *qy,
+                const double *qz,
+                double *roll, double *pitch, double *yaw, bool precise);
+
+#endif /* H_PHASESPACE_EULER */
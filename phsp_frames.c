@@ -0,0 +1,211 @@
+/*
+ * Copyright (c) 2025 UCL
+ * All rights reserved.
+ *
+ * Redistribution and use  in source  and binary  forms,  with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *   1. Redistributions of  source  code must retain the  above copyright
+ *      notice and this list of conditions.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice and  this list of  conditions in the  documentation and/or
+ *      other materials provided with the distribution.
+ *
+ * phsp_frames.c — lock-free publication of decoded frames
+ */
+
+#include "acphasespace.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "phasespace_c_types.h"
+#include "phsp.h"
+#include "phsp_shm.h"
+
+_Static_assert(PHSP_SHM_MAX_MARKERS >= PHASESPACE_MAX_MARKERS &&
+               PHSP_SHM_MAX_RIGIDS >= PHASESPACE_MAX_RIGIDS,
+               "shared memory frames too small");
+
+/* ---------------------------------------------------------------------- */
+/* Frame copies                                                           */
+/* ---------------------------------------------------------------------- */
+
+/* copy only the populated records, instead of the whole struct */
+void
+phsp_bodies_copy(phasespace_bodies *dst, const phasespace_bodies *src)
+{
+    dst->num_markers = src->num_markers;
+    dst->num_rigids = src->num_rigids;
+    memcpy(dst->markers, src->markers,
+           src->num_markers * sizeof(*src->markers));
+    memcpy(dst->rigids, src->rigids,
+           src->num_rigids * sizeof(*src->rigids));
+}
+
+/* ---------------------------------------------------------------------- */
+/* Allocate an empty triple buffer                                        */
+/* ---------------------------------------------------------------------- */
+struct phasespace_frames_s *
+phsp_frames_create(void)
+{
+    struct phasespace_frames_s *frames;
+
+    frames = calloc(1, sizeof(*frames));
+    if (!frames) return NULL;
+
+    frames->back = 0;
+    frames->middle = 1;
+    frames->front = 2;
+    frames->last = 0;
+    return frames;
+}
+
+void
+phsp_frames_destroy(struct phasespace_frames_s *frames)
+{
+    free(frames);
+}
+
+/* ---------------------------------------------------------------------- */
+/* Writer side                                                            */
+/* ---------------------------------------------------------------------- */
+
+/* slot private to the publish task, to be filled with the next frame */
+phasespace_bodies *
+phsp_frames_back(struct phasespace_frames_s *frames)
+{
+    return &frames->slot[frames->back];
+}
+
+/*
+ * Make the back slot visible to the reader and recycle the previous middle
+ * slot. Returns the published frame, which stays valid for reading by the
+ * publish task until the next call.
+ */
+const phasespace_bodies *
+phsp_frames_publish(struct phasespace_frames_s *frames, uint64_t *seq)
+{
+    uint32_t published = frames->back;
+    uint32_t old;
+
+    frames->seq[published] = ++frames->last;
+    frames->latest = published;
+    frames->stale = false;
+    old = __atomic_exchange_n(&frames->middle, published | PHSP_FRAMES_NEW,
+                              __ATOMIC_ACQ_REL);
+    frames->back = old & ~PHSP_FRAMES_NEW;
+
+    if (seq) *seq = frames->seq[published];
+    return &frames->slot[published];
+}
+
+/*
+ * Publish again the last published frame with all its markers, rigids and
+ * filtered states flagged PHSP_FLAG_STALE, e.g. when the connection is
+ * lost, so that readers keep the last known state but know it is not
+ * updated. The latest slot is only read, and the reader never writes
+ * slots. Does nothing before the first frame or if it is already stale.
+ */
+const phasespace_bodies *
+phsp_frames_stale(struct phasespace_frames_s *frames)
+{
+    const phasespace_bodies *latest = &frames->slot[frames->latest];
+    phasespace_bodies *back = phsp_frames_back(frames);
+    phasespace_states *states;
+    size_t i;
+
+    if (!frames->last || frames->stale) return NULL;
+
+    phsp_bodies_copy(back, latest);
+    for (i = 0; i < back->num_markers; i++)
+        back->markers[i].flags |= PHSP_FLAG_STALE;
+    for (i = 0; i < back->num_rigids; i++)
+        back->rigids[i].flags |= PHSP_FLAG_STALE;
+
+    states = phsp_frames_back_states(frames);
+    states->num_rigids = frames->states[frames->latest].num_rigids;
+    memcpy(states->rigids, frames->states[frames->latest].rigids,
+           states->num_rigids * sizeof(*states->rigids));
+    for (i = 0; i < states->num_rigids; i++)
+        states->rigids[i].flags |= PHSP_FLAG_STALE;
+
+    /* no socket time, so that it is not accounted as a read latency */
+    frames->stamp[frames->back] = 0;
+    latest = phsp_frames_publish(frames, NULL);
+    frames->stale = true;
+    return latest;
+}
+
+/* ---------------------------------------------------------------------- */
+/* Reader side                                                            */
+/* ---------------------------------------------------------------------- */
+
+/*
+ * Latest published frame, consistent and never partially written. The
+ * returned frame stays valid until the next call. seq is 0 until the first
+ * frame is published.
+ */
+const phasespace_bodies *
+phsp_frames_read(struct phasespace_frames_s *frames, uint64_t *seq)
+{
+    uint32_t middle;
+
+    middle = __atomic_load_n(&frames->middle, __ATOMIC_ACQUIRE);
+    if (middle & PHSP_FRAMES_NEW) {
+        middle = __atomic_exchange_n(&frames->middle, frames->front,
+                                     __ATOMIC_ACQ_REL);
+        frames->front = middle & ~PHSP_FRAMES_NEW;
+    }
+
+    if (seq) *seq = frames->seq[frames->front];
+    return &frames->slot[frames->front];
+}
+
+/* ---------------------------------------------------------------------- */
+/* Shared memory export                                                   */
+/* ---------------------------------------------------------------------- */
+
+/* copy a published frame to the next shared memory slot */
+void
+phsp_frames_export(struct phasespace_shm_s *shm,
+                   const phasespace_bodies *bodies)
+{
+    struct phsp_shm_frame *f;
+    size_t i;
+
+    f = phsp_shm_begin(shm);
+
+    f->num_markers = bodies->num_markers;
+    for (i = 0; i < bodies->num_markers; i++) {
+        const phasespace_marker_s *m = &bodies->markers[i];
+
+        f->markers[i].id = m->id;
+        f->markers[i].flags = m->flags;
+        f->markers[i].time = m->time;
+        f->markers[i].x = m->x;
+        f->markers[i].y = m->y;
+        f->markers[i].z = m->z;
+        f->markers[i].cond = m->cond;
+    }
+
+    f->num_rigids = bodies->num_rigids;
+    for (i = 0; i < bodies->num_rigids; i++) {
+        const phasespace_rigid_s *r = &bodies->rigids[i];
+
+        f->rigids[i].id = r->id;
+        f->rigids[i].flags = r->flags;
+        f->rigids[i].time = r->time;
+        f->rigids[i].x = r->x;
+        f->rigids[i].y = r->y;
+        f->rigids[i].z = r->z;
+        f->rigids[i].qw = r->qw;
+        f->rigids[i].qx = r->qx;
+        f->rigids[i].qy = r->qy;
+        f->rigids[i].qz = r->qz;
+        f->rigids[i].cond = r->cond;
+    }
+
+    phsp_shm_commit(shm);
+}
@@ -0,0 +1,570 @@
+/*
+ * Copyright (c) 2025 UCL
+ * All rights reserved.
+ *
+ * Redistribution and use  in source  and binary  forms,  with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *   1. Redistributions of  source  code must retain the  above copyright
+ *      notice and this list of conditions.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice and  this list of  conditions in the  documentation and/or
+ *      other materials provided with the distribution.
+ *
+ * phsp_gate.c — quality gate on decoded frames
+ *
+ * Reflections and ghost markers show up as single-frame jumps. Each
+ * visible marker and rigid of a frame is compared with the last accepted
+ * sample of its id: the velocity since that sample and the change of
+ * velocity since the one before are bounded, as are cond and, for
+ * rigids, the norm of the quaternion and the angular velocity. Entries
+ * failing a check are flagged PHSP_FLAG_REJECTED and do not move their
+ * reference, so the next good sample is compared with the last good one.
+ * References not updated for the timeout are dropped.
+ *
+ * A rigid id without a reference is accepted as a new one. A marker id
+ * without one is not: tracked marker ids are new whenever a ghost shows
+ * up or a marker jumps further than the tracker gate, and the first
+ * sample of an id cannot be checked. It is held as a reference and
+ * rejected, and the next sample of the id is accepted only if it passes
+ * the checks against it; otherwise it is held in turn.
+ *
+ * Frames are timed with the frame clock, and frames received in a burst
+ * would look like fast motion: intervals are never taken shorter than the
+ * mean interval between frames. A sample at the time of its reference,
+ * before that interval is known, cannot be checked and fails.
+ *
+ * The references are gathered next to the frame in struct-of-arrays
+ * form, and the checks run on all entries at once, with a scalar and an
+ * AVX2 version selected on first use.
+ */
+#include "acphasespace.h"
+
+#include <errno.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "phasespace_c_types.h"
+#include "phsp.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+# include <immintrin.h>
+# define PHSP_GATE_X86
+#endif
+
+static const phasespace_gate_params phsp_gate_default = {
+    .enable = false,
+    .marker_cond = 0.,
+    .marker_vel = 1e4,
+    .marker_acc = 1e7,
+    .rigid_cond = 0.,
+    .rigid_vel = 1e4,
+    .rigid_acc = 1e7,
+    .rigid_rate = 50.,
+    .quat_norm = 1e-2,
+    .timeout = 0.2,
+};
+
+/* frame-wide bounds, squared for velocities; disabled ones are infinite */
+struct phsp_gate_limits {
+    double cond;
+    double vel;			/* mm^2/s^2 */
+    double acc;			/* mm^2/s^4 */
+    double rate;		/* rad^2/s^2 */
+    double qlo, qhi;		/* |q|^2 */
+    double period;		/* shortest interval, s */
+};
+
+struct phsp_gate_ops {
+    void (*markers)(const struct phsp_gate_frame *, size_t,
+                    const struct phsp_gate_limits *, uint64_t *);
+    void (*rigids)(const struct phsp_gate_frame *, size_t,
+                   const struct phsp_gate_limits *, uint64_t *);
+};
+
+
+/* --- scalar ----------------------------------------------------------- */
+
+/* cond, velocity and acceleration of entry i; NaN fails */
+static inline bool
+gate_motion(const struct phsp_gate_frame *f, size_t i,
+            const struct phsp_gate_limits *l)
+{
+    double vx = (f->x[i] - f->px[i]) * f->idt[i];
+    double vy = (f->y[i] - f->py[i]) * f->idt[i];
+    double vz = (f->z[i] - f->pz[i]) * f->idt[i];
+    double ax = (vx - f->vx[i]) * f->idt[i];
+    double ay = (vy - f->vy[i]) * f->idt[i];
+    double az = (vz - f->vz[i]) * f->idt[i];
+
+    return f->cond[i] <= l->cond &&
+        vx*vx + vy*vy + vz*vz <= l->vel &&
+        ax*ax + ay*ay + az*az <= f->alim[i];
+}
+
+/*
+ * Norm and angular velocity of rigid i. For unit quaternions at an angle
+ * a, the chord c between them (or the opposite one) is 2 sin(a/4), and 2c
+ * is the rotation angle within 11%.
+ */
+static inline bool
+gate_attitude(const struct phsp_gate_frame *f, size_t i,
+              const struct phsp_gate_limits *l)
+{
+    double n2 = (f->qw[i]*f->qw[i] + f->qx[i]*f->qx[i]) +
+        (f->qy[i]*f->qy[i] + f->qz[i]*f->qz[i]);
+    double d = fabs((f->qw[i]*f->rw[i] + f->qx[i]*f->rx[i]) +
+                    (f->qy[i]*f->ry[i] + f->qz[i]*f->rz[i]));
+    double c2 = 2. - 2. * d / sqrt(n2);
+
+    return n2 >= l->qlo && n2 <= l->qhi &&
+        4. * c2 * f->idt[i] * f->idt[i] <= l->rate;
+}
+
+static void
+markers_scalar(const struct phsp_gate_frame *f, size_t n,
+               const struct phsp_gate_limits *l, uint64_t *ok)
+{
+    memset(ok, 0, PHSP_SOA_MASK_WORDS * sizeof(*ok));
+    for (size_t i = 0; i < n; i++)
+        if (gate_motion(f, i, l)) ok[i / 64] |= 1ULL << (i % 64);
+}
+
+static void
+rigids_scalar(const struct phsp_gate_frame *f, size_t n,
+              const struct phsp_gate_limits *l, uint64_t *ok)
+{
+    memset(ok, 0, PHSP_SOA_MASK_WORDS * sizeof(*ok));
+    for (size_t i = 0; i < n; i++)
+        if (gate_motion(f, i, l) && gate_attitude(f, i, l))
+            ok[i / 64] |= 1ULL << (i % 64);
+}
+
+static const struct phsp_gate_ops ops_scalar = {
+    markers_scalar, rigids_scalar
+};
+
+
+#ifdef PHSP_GATE_X86
+
+/* --- AVX2 ------------------------------------------------------------- */
+
+__attribute__((target("avx2"))) static inline __m256d
+motion_avx2(const struct phsp_gate_frame *f, size_t i,
+            const struct phsp_gate_limits *l)
+{
+    __m256d idt = _mm256_load_pd(f->idt + i);
+    __m256d vx = _mm256_mul_pd(_mm256_sub_pd(_mm256_load_pd(f->x + i),
+                                             _mm256_load_pd(f->px + i)), idt);
+    __m256d vy = _mm256_mul_pd(_mm256_sub_pd(_mm256_load_pd(f->y + i),
+                                             _mm256_load_pd(f->py + i)), idt);
+    __m256d vz = _mm256_mul_pd(_mm256_sub_pd(_mm256_load_pd(f->z + i),
+                                             _mm256_load_pd(f->pz + i)), idt);
+    __m256d ax = _mm256_mul_pd(_mm256_sub_pd(vx, _mm256_load_pd(f->vx + i)),
+                               idt);
+    __m256d ay = _mm256_mul_pd(_mm256_sub_pd(vy, _mm256_load_pd(f->vy + i)),
+                               idt);
+    __m256d az = _mm256_mul_pd(_mm256_sub_pd(vz, _mm256_load_pd(f->vz + i)),
+                               idt);
+    __m256d v2 = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(vx, vx),
+                                             _mm256_mul_pd(vy, vy)),
+                               _mm256_mul_pd(vz, vz));
+    __m256d a2 = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(ax, ax),
+                                             _mm256_mul_pd(ay, ay)),
+                               _mm256_mul_pd(az, az));
+
+    /* ordered compares: NaN fails */
+    return _mm256_and_pd(
+        _mm256_and_pd(
+            _mm256_cmp_pd(_mm256_load_pd(f->cond + i),
+                          _mm256_set1_pd(l->cond), _CMP_LE_OQ),
+            _mm256_cmp_pd(v2, _mm256_set1_pd(l->vel), _CMP_LE_OQ)),
+        _mm256_cmp_pd(a2, _mm256_load_pd(f->alim + i), _CMP_LE_OQ));
+}
+
+__attribute__((target("avx2"))) static inline __m256d
+attitude_avx2(const struct phsp_gate_frame *f, size_t i,
+              const struct phsp_gate_limits *l)
+{
+    const __m256d sign = _mm256_set1_pd(-0.);
+    __m256d qw = _mm256_load_pd(f->qw + i), qx = _mm256_load_pd(f->qx + i);
+    __m256d qy = _mm256_load_pd(f->qy + i), qz = _mm256_load_pd(f->qz + i);
+    __m256d idt = _mm256_load_pd(f->idt + i);
+    __m256d n2 = _mm256_add_pd(
+        _mm256_add_pd(_mm256_mul_pd(qw, qw), _mm256_mul_pd(qx, qx)),
+        _mm256_add_pd(_mm256_mul_pd(qy, qy), _mm256_mul_pd(qz, qz)));
+    __m256d d = _mm256_add_pd(
+        _mm256_add_pd(_mm256_mul_pd(qw, _mm256_load_pd(f->rw + i)),
+                      _mm256_mul_pd(qx, _mm256_load_pd(f->rx + i))),
+        _mm256_add_pd(_mm256_mul_pd(qy, _mm256_load_pd(f->ry + i)),
+                      _mm256_mul_pd(qz, _mm256_load_pd(f->rz + i))));
+    __m256d c2, r2;
+
+    d = _mm256_andnot_pd(sign, d);
+    c2 = _mm256_sub_pd(_mm256_set1_pd(2.),
+                       _mm256_div_pd(_mm256_mul_pd(_mm256_set1_pd(2.), d),
+                                     _mm256_sqrt_pd(n2)));
+    r2 = _mm256_mul_pd(_mm256_mul_pd(_mm256_mul_pd(_mm256_set1_pd(4.), c2),
+                                     idt), idt);
+
+    return _mm256_and_pd(
+        _mm256_and_pd(
+            _mm256_cmp_pd(n2, _mm256_set1_pd(l->qlo), _CMP_GE_OQ),
+            _mm256_cmp_pd(n2, _mm256_set1_pd(l->qhi), _CMP_LE_OQ)),
+        _mm256_cmp_pd(r2, _mm256_set1_pd(l->rate), _CMP_LE_OQ));
+}
+
+__attribute__((target("avx2"))) static void
+markers_avx2(const struct phsp_gate_frame *f, size_t n,
+             const struct phsp_gate_limits *l, uint64_t *ok)
+{
+    size_t i = 0;
+
+    memset(ok, 0, PHSP_SOA_MASK_WORDS * sizeof(*ok));
+    for (; i + 4 <= n; i += 4)
+        ok[i / 64] |=
+            (uint64_t)_mm256_movemask_pd(motion_avx2(f, i, l)) << (i % 64);
+    for (; i < n; i++)
+        if (gate_motion(f, i, l)) ok[i / 64] |= 1ULL << (i % 64);
+}
+
+__attribute__((target("avx2"))) static void
+rigids_avx2(const struct phsp_gate_frame *f, size_t n,
+            const struct phsp_gate_limits *l, uint64_t *ok)
+{
+    size_t i = 0;
+
+    memset(ok, 0, PHSP_SOA_MASK_WORDS * sizeof(*ok));
+    for (; i + 4 <= n; i += 4)
+        ok[i / 64] |= (uint64_t)_mm256_movemask_pd(
+            _mm256_and_pd(motion_avx2(f, i, l), attitude_avx2(f, i, l)))
+            << (i % 64);
+    for (; i < n; i++)
+        if (gate_motion(f, i, l) && gate_attitude(f, i, l))
+            ok[i / 64] |= 1ULL << (i % 64);
+}
+
+static const struct phsp_gate_ops ops_avx2 = {
+    markers_avx2, rigids_avx2
+};
+
+#endif /* PHSP_GATE_X86 */
+
+
+/* --- dispatch --------------------------------------------------------- */
+
+static const struct phsp_gate_ops *
+phsp_gate_ops(void)
+{
+    static const struct phsp_gate_ops *ops;
+    const struct phsp_gate_ops *o;
+
+    o = __atomic_load_n(&ops, __ATOMIC_RELAXED);
+    if (o) return o;
+
+    o = &ops_scalar;
+#ifdef PHSP_GATE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        o = &ops_avx2;
+#endif
+
+    __atomic_store_n(&ops, o, __ATOMIC_RELAXED);
+    return o;
+}
+
+
+/* --- references ------------------------------------------------------- */
+
+/* drop the references older than timeout, or from the future of t */
+static void
+gate_retire(struct phsp_gate_refs *r, int64_t t, int64_t timeout)
+{
+    struct phsp_gate_ref *k;
+    uint32_t i;
+
+    for (i = 0; i < r->num;) {
+        k = &r->ref[i];
+        if (t - k->time > timeout || k->time > t)
+            *k = r->ref[--r->num];
+        else
+            i++;
+    }
+    r->hashed = false;
+}
+
+static void
+gate_hash(struct phsp_gate_refs *r)
+{
+    uint32_t i, h;
+
+    for (h = 0; h < PHSP_GATE_SLOTS; h++) r->slot[h] = -1;
+    for (i = 0; i < r->num; i++) {
+        h = (uint32_t)r->ref[i].id % PHSP_GATE_SLOTS;
+        while (r->slot[h] >= 0) h = (h + 1) % PHSP_GATE_SLOTS;
+        r->slot[h] = i;
+    }
+    r->hashed = true;
+}
+
+/* reference of id, entry i of the frame: the server usually lists ids in
+ * the same order, so the hash is only built on a miss */
+static int32_t
+gate_find(struct phsp_gate_refs *r, size_t i, int32_t id)
+{
+    int32_t j = r->last[i];
+    uint32_t h;
+
+    if (!id) return -1;
+    if (j >= 0 && (uint32_t)j < r->num && r->ref[j].id == id) return j;
+
+    if (!r->hashed) gate_hash(r);
+    for (h = (uint32_t)id % PHSP_GATE_SLOTS; r->slot[h] >= 0;
+         h = (h + 1) % PHSP_GATE_SLOTS)
+        if (r->ref[r->slot[h]].id == id) return r->slot[h];
+    return -1;
+}
+
+/* reference of entry i, whose position, cond and orientation are set */
+static void
+gate_gather(struct phsp_gate_frame *f, struct phsp_gate_refs *r,
+            size_t i, int32_t id, int64_t time,
+            const struct phsp_gate_limits *l, bool rigid)
+{
+    const struct phsp_gate_ref *k;
+    int32_t j = gate_find(r, i, id);
+    double dt;
+
+    f->ref[i] = r->last[i] = j;
+    if (j < 0) {
+        f->px[i] = f->x[i]; f->py[i] = f->y[i]; f->pz[i] = f->z[i];
+        f->vx[i] = f->vy[i] = f->vz[i] = 0.;
+        f->idt[i] = 0.;
+        f->alim[i] = INFINITY;
+        if (rigid) { f->rw[i] = 1.; f->rx[i] = f->ry[i] = f->rz[i] = 0.; }
+        return;
+    }
+
+    k = &r->ref[j];
+    dt = (time - k->time) * 1e-9;
+    if (dt < l->period) dt = l->period;
+
+    f->px[i] = k->x; f->py[i] = k->y; f->pz[i] = k->z;
+    f->vx[i] = k->vx; f->vy[i] = k->vy; f->vz[i] = k->vz;
+    f->idt[i] = dt > 0. ? 1. / dt : NAN;
+    f->alim[i] = k->hits > 1 ? l->acc : INFINITY;
+    if (rigid) {
+        f->rw[i] = k->qw; f->rx[i] = k->qx;
+        f->ry[i] = k->qy; f->rz[i] = k->qz;
+    }
+}
+
+/* make accepted entry i of the frame the reference of its id, return it
+ * or NULL if there is none */
+static struct phsp_gate_ref *
+gate_accept(struct phsp_gate_refs *r, const struct phsp_gate_frame *f,
+            size_t i, int32_t id, int64_t time, bool rigid)
+{
+    struct phsp_gate_ref *k;
+    double n;
+
+    if (f->ref[i] >= 0)
+        k = &r->ref[f->ref[i]];
+    else if (id && r->num < PHSP_GATE_MAX) {
+        r->last[i] = r->num;
+        k = &r->ref[r->num++];
+        k->id = id;
+        k->hits = 0;
+    } else
+        return NULL;
+
+    if (k->hits && f->idt[i] > 0.) {
+        k->vx = (f->x[i] - k->x) * f->idt[i];
+        k->vy = (f->y[i] - k->y) * f->idt[i];
+        k->vz = (f->z[i] - k->z) * f->idt[i];
+        k->hits = 2;
+    } else {
+        k->vx = k->vy = k->vz = 0.;
+        k->hits = 1;
+    }
+    k->time = time;
+    k->x = f->x[i]; k->y = f->y[i]; k->z = f->z[i];
+    if (!rigid) return k;
+
+    n = sqrt(f->qw[i]*f->qw[i] + f->qx[i]*f->qx[i] +
+             f->qy[i]*f->qy[i] + f->qz[i]*f->qz[i]);
+    if (n > 0.) {
+        n = 1. / n;
+        k->qw = f->qw[i] * n; k->qx = f->qx[i] * n;
+        k->qy = f->qy[i] * n; k->qz = f->qz[i] * n;
+    } else {
+        k->qw = 1.; k->qx = k->qy = k->qz = 0.;
+    }
+    return k;
+}
+
+/* hold marker i of the frame, with no confirmed reference, as the
+ * reference of its id until the next sample */
+static void
+gate_hold(struct phsp_gate_refs *r, const struct phsp_gate_frame *f,
+          size_t i, int32_t id, int64_t time)
+{
+    struct phsp_gate_ref *k = gate_accept(r, f, i, id, time, false);
+
+    if (k) k->hits = 0;
+}
+
+static inline double
+gate_limit(double l)
+{
+    return l > 0. ? l : INFINITY;
+}
+
+static inline double
+gate_limit2(double l)
+{
+    return l > 0. ? l * l : INFINITY;
+}
+
+
+/* ---------------------------------------------------------------------- */
+/* Gate                                                                   */
+/* ---------------------------------------------------------------------- */
+
+struct phasespace_gate_s *
+phsp_gate_create(void)
+{
+    struct phasespace_gate_s *gate;
+
+    /* the frame is loaded with aligned AVX2 loads */
+    if (posix_memalign((void **)&gate, 64, sizeof(*gate))) return NULL;
+    memset(gate, 0, sizeof(*gate));
+    gate->params = phsp_gate_default;
+    return gate;
+}
+
+void
+phsp_gate_destroy(struct phasespace_gate_s *gate)
+{
+    free(gate);
+}
+
+/* set the limits, none negative, and the timeout, strictly positive;
+ * enabling or disabling the gate drops all references */
+int
+phsp_gate_params(struct phasespace_gate_s *gate,
+                 const phasespace_gate_params *p)
+{
+    if (!gate ||
+        !(p->marker_cond >= 0.) || !(p->marker_vel >= 0.) ||
+        !(p->marker_acc >= 0.) || !(p->rigid_cond >= 0.) ||
+        !(p->rigid_vel >= 0.) || !(p->rigid_acc >= 0.) ||
+        !(p->rigid_rate >= 0.) || !(p->quat_norm >= 0.) ||
+        !(p->timeout > 0.)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (p->enable != gate->params.enable) {
+        gate->markers.num = gate->rigids.num = 0;
+        memset(&gate->clock, 0, sizeof(gate->clock));
+    }
+    gate->params = *p;
+    return 0;
+}
+
+/*
+ * Check the visible markers and rigids of a decoded frame, if the gate is
+ * enabled, and flag those that fail PHSP_FLAG_REJECTED. Markers with a
+ * new id are flagged as well, until their next sample passes the checks
+ * against this one. Markers with id 0 have no reference and only get the
+ * cond check. Entries that are not visible (cond <= 0) are left alone.
+ */
+void
+phsp_gate_update(struct phasespace_gate_s *gate, phasespace_bodies *bodies)
+{
+    const phasespace_gate_params *p;
+    const struct phsp_gate_ops *ops;
+    struct phsp_gate_frame *f;
+    struct phsp_gate_limits l;
+    int64_t timeout, t;
+    size_t i;
+
+    if (!gate || !gate->params.enable) return;
+    if (bodies->num_markers) t = bodies->markers[0].time;
+    else if (bodies->num_rigids) t = bodies->rigids[0].time;
+    else return;
+
+    ops = phsp_gate_ops();
+    p = &gate->params;
+    f = &gate->frame;
+    timeout = p->timeout * 1e9;
+
+    t = phsp_frame_clock(&gate->clock, t, timeout);
+    l.period = gate->clock.period * 1e-9;
+
+    if (bodies->num_markers) {
+        l.cond = gate_limit(p->marker_cond);
+        l.vel = gate_limit2(p->marker_vel);
+        l.acc = gate_limit2(p->marker_acc);
+
+        gate_retire(&gate->markers, t, timeout);
+        for (i = 0; i < bodies->num_markers; i++) {
+            const phasespace_marker_s *m = &bodies->markers[i];
+
+            f->x[i] = m->x; f->y[i] = m->y; f->z[i] = m->z;
+            f->cond[i] = m->cond;
+            gate_gather(f, &gate->markers, i, m->id, t, &l, false);
+        }
+        ops->markers(f, bodies->num_markers, &l, gate->ok);
+
+        for (i = 0; i < bodies->num_markers; i++) {
+            phasespace_marker_s *m = &bodies->markers[i];
+            bool ok = (gate->ok[i / 64] >> (i % 64)) & 1;
+            bool held = f->ref[i] < 0 || !gate->markers.ref[f->ref[i]].hits;
+
+            if (!(m->cond > 0.)) continue;
+            if (ok && (f->ref[i] >= 0 || !m->id))
+                gate_accept(&gate->markers, f, i, m->id, t, false);
+            else {
+                if (held) gate_hold(&gate->markers, f, i, m->id, t);
+                m->flags |= PHSP_FLAG_REJECTED;
+            }
+        }
+    }
+
+    if (bodies->num_rigids) {
+        l.cond = gate_limit(p->rigid_cond);
+        l.vel = gate_limit2(p->rigid_vel);
+        l.acc = gate_limit2(p->rigid_acc);
+        l.rate = gate_limit2(p->rigid_rate);
+        l.qlo = p->quat_norm > 0. && p->quat_norm < 1. ?
+            (1. - p->quat_norm) * (1. - p->quat_norm) : 0.;
+        l.qhi = p->quat_norm > 0. ?
+            (1. + p->quat_norm) * (1. + p->quat_norm) : INFINITY;
+
+        gate_retire(&gate->rigids, t, timeout);
+        for (i = 0; i < bodies->num_rigids; i++) {
+            const phasespace_rigid_s *r = &bodies->rigids[i];
+
+            f->x[i] = r->x; f->y[i] = r->y; f->z[i] = r->z;
+            f->cond[i] = r->cond;
+            f->qw[i] = r->qw; f->qx[i] = r->qx;
+            f->qy[i] = r->qy; f->qz[i] = r->qz;
+            gate_gather(f, &gate->rigids, i, r->id, t, &l, true);
+        }
+        ops->rigids(f, bodies->num_rigids, &l, gate->ok);
+
+        for (i = 0; i < bodies->num_rigids; i++) {
+            phasespace_rigid_s *r = &bodies->rigids[i];
+
+            if (!(r->cond > 0.)) continue;
+            if ((gate->ok[i / 64] >> (i % 64)) & 1)
+                gate_accept(&gate->rigids, f, i, r->id, t, true);
+            else
+                r->flags |= PHSP_FLAG_REJECTED;
+        }
+    }
+}
@@ -0,0 +1,548 @@
+/*
+ * Copyright (c) 2025 UCL
+ * All rights reserved.
+ *
+ * Redistribution and use  in source  and binary  forms,  with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *   1. Redistributions of  source  code must retain the  above copyright
+ *      notice and this list of conditions.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice and  this list of  conditions in the  documentation and/or
+ *      other materials provided with the distribution.
+ *
+ * phsp_kf.c — per-rigid constant acceleration Kalman filters
+ *
+ * Each tracked rigid id has a filter on its position, velocity and
+ * acceleration, driven by white jerk noise, and an error-state filter of
+ * the same form on its orientation, angular velocity and angular
+ * acceleration (errors are rotation vectors in the world frame, applied
+ * on the left). Measurement and process noises are isotropic, so the
+ * three axes share one 3x3 covariance for translation and one for
+ * rotation, and each update is a scalar Kalman update. Rigids with
+ * cond <= 0 or rejected by the quality gate are only predicted.
+ *
+ * The states of the last frame are also shared under a seqlock, so that
+ * controllers running faster than the mocap can extrapolate them to their
+ * own time with phsp_kf_predict(), from any thread.
+ */
+#include "acphasespace.h"
+
+#include <errno.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "phasespace_c_types.h"
+#include "phsp.h"
+
+/* initial uncertainty of the derivatives */
+#define PHSP_KF_VEL0	1e3	/* mm/s */
+#define PHSP_KF_ACC0	1e4	/* mm/s^2 */
+#define PHSP_KF_RATE0	10.	/* rad/s */
+#define PHSP_KF_DRATE0	100.	/* rad/s^2 */
+
+static const phasespace_kf_params phsp_kf_default = {
+    .pos_noise = 0.5,
+    .jerk = 1e8,
+    .att_noise = 2e-3,
+    .ang_jerk = 1e2,
+    .timeout = 0.5,
+    .latency = 0.,
+};
+
+/* filter bank of the component, see phsp_kf_shared() */
+static struct phasespace_kf_s *phsp_kf_instance;
+
+
+/* --- quaternions ------------------------------------------------------ */
+
+/* r = a * b, r may alias a or b */
+static inline void
+quat_mul(const double a[4], const double b[4], double r[4])
+{
+    double w = a[0]*b[0] - a[1]*b[1] - a[2]*b[2] - a[3]*b[3];
+    double x = a[0]*b[1] + a[1]*b[0] + a[2]*b[3] - a[3]*b[2];
+    double y = a[0]*b[2] - a[1]*b[3] + a[2]*b[0] + a[3]*b[1];
+    double z = a[0]*b[3] + a[1]*b[2] - a[2]*b[1] + a[3]*b[0];
+
+    r[0] = w; r[1] = x; r[2] = y; r[3] = z;
+}
+
+/* unit quaternion of rotation vector v */
+static inline void
+quat_exp(const double v[3], double q[4])
+{
+    double t = sqrt(v[0]*v[0] + v[1]*v[1] + v[2]*v[2]);
+    double s = t < 1e-6 ? 0.5 - t*t / 48. : sin(t / 2) / t;
+
+    q[0] = cos(t / 2);
+    q[1] = s * v[0]; q[2] = s * v[1]; q[3] = s * v[2];
+}
+
+/* rotation vector of unit quaternion q, of angle at most pi */
+static inline void
+quat_log(const double q[4], double v[3])
+{
+    double sign = q[0] < 0. ? -1. : 1.;
+    double n = sqrt(q[1]*q[1] + q[2]*q[2] + q[3]*q[3]);
+    double s = n < 1e-9 ? 2. : 2. * atan2(n, sign * q[0]) / n;
+
+    v[0] = sign * s * q[1]; v[1] = sign * s * q[2]; v[2] = sign * s * q[3];
+}
+
+static inline void
+quat_normalize(double q[4])
+{
+    double n = 1. / sqrt(q[0]*q[0] + q[1]*q[1] + q[2]*q[2] + q[3]*q[3]);
+
+    q[0] *= n; q[1] *= n; q[2] *= n; q[3] *= n;
+}
+
+
+/* --- one axis model --------------------------------------------------- */
+
+/* P = F P F' + Q for the constant acceleration model with jerk density q */
+static void
+kf_predict_cov(double P[6], double dt, double q)
+{
+    double h = dt * dt / 2., dt2 = dt * dt, dt3 = dt2 * dt;
+    double r00 = P[0] + dt * P[1] + h * P[2];
+    double r01 = P[1] + dt * P[3] + h * P[4];
+    double r02 = P[2] + dt * P[4] + h * P[5];
+    double r11 = P[3] + dt * P[4];
+    double r12 = P[4] + dt * P[5];
+
+    P[0] = r00 + dt * r01 + h * r02 + q * dt3 * dt2 / 20.;
+    P[1] = r01 + dt * r02 + q * dt2 * dt2 / 8.;
+    P[2] = r02 + q * dt3 / 6.;
+    P[3] = r11 + dt * r12 + q * dt3 / 3.;
+    P[4] = r12 + q * dt2 / 2.;
+    P[5] += q * dt;
+}
+
+/* scalar update of the first state with variance r, gains in K */
+static void
+kf_update_cov(double P[6], double r, double K[3])
+{
+    double p00 = P[0], p01 = P[1], p02 = P[2];
+    double s = 1. / (p00 + r);
+
+    K[0] = p00 * s; K[1] = p01 * s; K[2] = p02 * s;
+
+    P[0] -= K[0] * p00;
+    P[1] -= K[0] * p01;
+    P[2] -= K[0] * p02;
+    P[3] -= K[1] * p01;
+    P[4] -= K[1] * p02;
+    P[5] -= K[2] * p02;
+}
+
+
+/* --- filters ---------------------------------------------------------- */
+
+static void
+kf_init(const phasespace_kf_params *params, struct phsp_kf *f,
+        const phasespace_rigid_s *r, int64_t t)
+{
+    double r2 = params->att_noise * params->att_noise;
+
+    f->valid = true;
+    f->time = f->seen = t;
+    f->p[0] = r->x; f->p[1] = r->y; f->p[2] = r->z;
+    f->q[0] = r->qw; f->q[1] = r->qx; f->q[2] = r->qy; f->q[3] = r->qz;
+    quat_normalize(f->q);
+    memset(f->v, 0, sizeof(f->v));
+    memset(f->a, 0, sizeof(f->a));
+    memset(f->w, 0, sizeof(f->w));
+    memset(f->dw, 0, sizeof(f->dw));
+
+    memset(f->pt, 0, sizeof(f->pt));
+    f->pt[0] = params->pos_noise * params->pos_noise;
+    f->pt[3] = PHSP_KF_VEL0 * PHSP_KF_VEL0;
+    f->pt[5] = PHSP_KF_ACC0 * PHSP_KF_ACC0;
+
+    memset(f->pr, 0, sizeof(f->pr));
+    f->pr[0] = r2;
+    f->pr[3] = PHSP_KF_RATE0 * PHSP_KF_RATE0;
+    f->pr[5] = PHSP_KF_DRATE0 * PHSP_KF_DRATE0;
+}
+
+static void
+kf_predict(const phasespace_kf_params *params, struct phsp_kf *f, double dt)
+{
+    double h = dt * dt / 2., d[3], dq[4];
+    int i;
+
+    for (i = 0; i < 3; i++) {
+        f->p[i] += dt * f->v[i] + h * f->a[i];
+        f->v[i] += dt * f->a[i];
+
+        d[i] = dt * f->w[i] + h * f->dw[i];
+        f->w[i] += dt * f->dw[i];
+    }
+    quat_exp(d, dq);
+    quat_mul(dq, f->q, f->q);
+    quat_normalize(f->q);
+
+    kf_predict_cov(f->pt, dt, params->jerk);
+    kf_predict_cov(f->pr, dt, params->ang_jerk);
+}
+
+static void
+kf_update(const phasespace_kf_params *params, struct phsp_kf *f,
+          const phasespace_rigid_s *r, int64_t t)
+{
+    double K[3], e[3], z[4], qi[4], dq[4];
+    int i;
+
+    /* position */
+    kf_update_cov(f->pt, params->pos_noise * params->pos_noise, K);
+    e[0] = r->x - f->p[0];
+    e[1] = r->y - f->p[1];
+    e[2] = r->z - f->p[2];
+    for (i = 0; i < 3; i++) {
+        f->p[i] += K[0] * e[i];
+        f->v[i] += K[1] * e[i];
+        f->a[i] += K[2] * e[i];
+    }
+
+    /* orientation: innovation is log(z * q^-1) */
+    z[0] = r->qw; z[1] = r->qx; z[2] = r->qy; z[3] = r->qz;
+    quat_normalize(z);
+    qi[0] = f->q[0]; qi[1] = -f->q[1]; qi[2] = -f->q[2]; qi[3] = -f->q[3];
+    quat_mul(z, qi, dq);
+    quat_log(dq, e);
+
+    kf_update_cov(f->pr, params->att_noise * params->att_noise, K);
+    for (i = 0; i < 3; i++) {
+        f->w[i] += K[1] * e[i];
+        f->dw[i] += K[2] * e[i];
+        e[i] *= K[0];
+    }
+    quat_exp(e, dq);
+    quat_mul(dq, f->q, f->q);
+    quat_normalize(f->q);
+
+    f->seen = t;
+}
+
+static void
+kf_state(const struct phsp_kf *f, phasespace_rigid_state *s)
+{
+    s->time = f->time;
+    s->x = f->p[0]; s->y = f->p[1]; s->z = f->p[2];
+    s->qw = f->q[0]; s->qx = f->q[1]; s->qy = f->q[2]; s->qz = f->q[3];
+    s->vx = f->v[0]; s->vy = f->v[1]; s->vz = f->v[2];
+    s->ax = f->a[0]; s->ay = f->a[1]; s->az = f->a[2];
+    s->wx = f->w[0]; s->wy = f->w[1]; s->wz = f->w[2];
+    s->dwx = f->dw[0]; s->dwy = f->dw[1]; s->dwz = f->dw[2];
+    s->pos_var = f->pt[0];
+    s->vel_var = f->pt[3];
+    s->acc_var = f->pt[5];
+    s->att_var = f->pr[0];
+    s->rate_var = f->pr[3];
+}
+
+/* filter of rigid id, allocated on first use in the first free or
+ * released slot of its probe sequence, NULL if the bank is full */
+static struct phsp_kf *
+kf_lookup(struct phasespace_kf_s *kf, int32_t id)
+{
+    uint32_t h = (uint32_t)id % PHASESPACE_MAX_RIGIDS, i;
+    struct phsp_kf *f, *tomb = NULL;
+
+    for (i = 0; i < PHASESPACE_MAX_RIGIDS; i++) {
+        f = &kf->filter[(h + i) % PHASESPACE_MAX_RIGIDS];
+        if (f->id == id) return f;
+        if (f->id == PHSP_KF_TOMB) {
+            if (!tomb) tomb = f;
+            continue;
+        }
+        if (!f->id) break;
+    }
+
+    if (tomb) f = tomb;
+    else if (i == PHASESPACE_MAX_RIGIDS) return NULL;
+    f->id = id;
+    f->valid = false;
+    f->seen = 0;
+    return f;
+}
+
+/* release the filters of rigids not measured for the timeout, so that
+ * their slots can be reused by new ids */
+static void
+kf_release(struct phasespace_kf_s *kf, int64_t t, int64_t timeout)
+{
+    struct phsp_kf *f;
+    size_t i;
+
+    for (i = 0; i < PHASESPACE_MAX_RIGIDS; i++) {
+        f = &kf->filter[i];
+        if (!f->id || f->id == PHSP_KF_TOMB || t - f->seen <= timeout)
+            continue;
+        f->id = PHSP_KF_TOMB;
+        f->valid = false;
+    }
+
+    /* a released slot followed by a free one ends no probe sequence */
+    for (i = PHASESPACE_MAX_RIGIDS; i-- > 0;) {
+        if (kf->filter[i].id != PHSP_KF_TOMB ||
+            kf->filter[(i + 1) % PHASESPACE_MAX_RIGIDS].id)
+            continue;
+        kf->filter[i].id = 0;
+    }
+}
+
+/* publish the filtered states of a frame, skipping rigids without a filter */
+static void
+kf_share(struct phsp_kf_poses *poses, const phasespace_states *states,
+         int64_t latency)
+{
+    uint32_t n = 0;
+    size_t i;
+
+    __atomic_store_n(&poses->seq, poses->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    poses->latency = latency;
+
+    for (i = 0; i < states->num_rigids; i++)
+        if (isfinite(states->rigids[i].pos_var))
+            poses->rigids[n++] = states->rigids[i];
+    poses->num_rigids = n;
+
+    __atomic_store_n(&poses->seq, poses->seq + 1, __ATOMIC_RELEASE);
+}
+
+/* consistent copy of the shared state of rigid id and of the latency,
+ * false if none */
+static bool
+kf_lookup_pose(const struct phsp_kf_poses *poses, int32_t id,
+               phasespace_rigid_state *pose, int64_t *latency)
+{
+    uint64_t seq;
+    uint32_t i, n;
+    bool found;
+
+    do {
+        while ((seq = __atomic_load_n(&poses->seq, __ATOMIC_ACQUIRE)) & 1);
+
+        found = false;
+        *latency = poses->latency;
+        n = poses->num_rigids;
+        for (i = 0; i < n && i < PHASESPACE_MAX_RIGIDS; i++)
+            if (poses->rigids[i].id == id) {
+                *pose = poses->rigids[i];
+                found = true;
+                break;
+            }
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while (__atomic_load_n(&poses->seq, __ATOMIC_RELAXED) != seq);
+
+    return found;
+}
+
+
+/* ---------------------------------------------------------------------- */
+/* Filter bank                                                            */
+/* ---------------------------------------------------------------------- */
+
+struct phasespace_kf_s *
+phsp_kf_create(void)
+{
+    struct phasespace_kf_s *kf = calloc(1, sizeof(*kf));
+
+    if (!kf) return NULL;
+    kf->params = phsp_kf_default;
+    __atomic_store_n(&phsp_kf_instance, kf, __ATOMIC_RELEASE);
+    return kf;
+}
+
+void
+phsp_kf_destroy(struct phasespace_kf_s *kf)
+{
+    struct phasespace_kf_s *k = kf;
+
+    __atomic_compare_exchange_n(&phsp_kf_instance, &k, NULL, false,
+                                __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+    free(kf);
+}
+
+/* last created filter bank, for readers that do not own it (the predict
+ * function runs in the control task, and only reads the shared states) */
+const struct phasespace_kf_s *
+phsp_kf_shared(void)
+{
+    return __atomic_load_n(&phsp_kf_instance, __ATOMIC_ACQUIRE);
+}
+
+/* set the tuning, all strictly positive but the latency, not negative;
+ * filters restart on next frame */
+int
+phsp_kf_params(struct phasespace_kf_s *kf, const phasespace_kf_params *p)
+{
+    size_t i;
+
+    if (!kf || !(p->pos_noise > 0.) || !(p->jerk > 0.) ||
+        !(p->att_noise > 0.) || !(p->ang_jerk > 0.) || !(p->timeout > 0.) ||
+        !(p->latency >= 0.)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    kf->params = *p;
+    for (i = 0; i < PHASESPACE_MAX_RIGIDS; i++) kf->filter[i].valid = false;
+    return 0;
+}
+
+/*
+ * Filter the rigids of a decoded frame into states, in the same order.
+ * Rigids that are not measured (cond <= 0, or flagged PHSP_FLAG_REJECTED)
+ * are predicted to the frame time and flagged PHSP_FLAG_PREDICTED. The
+ * filter of a rigid not measured for params.timeout is released, and a
+ * new one starts from its next measurement, as when time goes back.
+ * Filters are timed with the frame clock, so that frames received
+ * together do not make zero time steps.
+ * The filtered states are then made available to phsp_kf_predict().
+ */
+void
+phsp_kf_update(struct phasespace_kf_s *kf, const phasespace_bodies *bodies,
+               phasespace_states *states)
+{
+    const phasespace_kf_params *params = &kf->params;
+    int64_t timeout = params->timeout * 1e9;
+    const phasespace_rigid_s *r;
+    phasespace_rigid_state *s;
+    struct phsp_kf *f;
+    bool measured;
+    int64_t t = 0;
+    size_t i;
+
+    if (bodies->num_rigids) {
+        t = phsp_frame_clock(&kf->clock, bodies->rigids[0].time, timeout);
+        kf_release(kf, t, timeout);
+    }
+
+    states->num_rigids = bodies->num_rigids;
+    for (i = 0; i < bodies->num_rigids; i++) {
+        r = &bodies->rigids[i];
+        s = &states->rigids[i];
+        s->id = r->id;
+        measured = r->cond > 0. && !(r->flags & PHSP_FLAG_REJECTED);
+
+        f = kf_lookup(kf, r->id);
+        if (f && measured && (!f->valid || t < f->time))
+            kf_init(params, f, r, t);
+        else if (f && f->valid) {
+            if (t > f->time) {
+                kf_predict(params, f, (t - f->time) * 1e-9);
+                f->time = t;
+            }
+            if (measured) kf_update(params, f, r, t);
+        }
+
+        if (!f || !f->valid) {
+            /* nothing to predict from */
+            memset(s, 0, sizeof(*s));
+            s->id = r->id;
+            s->time = t;
+            s->qw = 1.;
+            s->pos_var = s->vel_var = s->acc_var = INFINITY;
+            s->att_var = s->rate_var = INFINITY;
+            s->flags = PHSP_FLAG_PREDICTED;
+            continue;
+        }
+
+        kf_state(f, s);
+        s->flags = measured ? 0 : PHSP_FLAG_PREDICTED;
+    }
+
+    kf_share(&kf->poses, states, params->latency * 1e9);
+}
+
+
+/* ---------------------------------------------------------------------- */
+/* Prediction                                                             */
+/* ---------------------------------------------------------------------- */
+
+/*
+ * Extrapolate the last filtered state of rigid id to 'time' (ns since the
+ * epoch, 0 for now) with the given model, into pose. States are
+ * stamped with their receive time, so the horizon also includes
+ * params.latency, the delay from capture to reception. Lock-free and
+ * callable from any thread at any rate: readers never block the publish
+ * task, and only retry if they overlap the copy of a new frame. The
+ * variances in pose are those of the filtered state.
+ *
+ * Returns 0, or -1 with errno set to ENOENT if id has no filtered state,
+ * EINVAL for an unknown model, or ESTALE if time is more than max_age ns
+ * (if not 0) after the filtered state, which happens when frames stop
+ * coming. pose is still extrapolated in the latter case, and flagged
+ * PHSP_FLAG_STALE.
+ */
+int
+phsp_kf_predict(const struct phasespace_kf_s *kf, int32_t id, int64_t time,
+                uint32_t model, int64_t max_age,
+                phasespace_rigid_state *pose)
+{
+    double dt, v[3], r[4], q[4];
+    struct timespec ts;
+    int64_t age, latency;
+
+    if (model != PHSP_PREDICT_VELOCITY && model != PHSP_PREDICT_ACCELERATION) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (!kf || !kf_lookup_pose(&kf->poses, id, pose, &latency)) {
+        errno = ENOENT;
+        return -1;
+    }
+    if (!time) {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        time = ts.tv_sec * 1000000000LL + ts.tv_nsec;
+    }
+
+    age = time - pose->time;
+    dt = (age + latency) * 1e-9;
+    v[0] = pose->wx * dt; v[1] = pose->wy * dt; v[2] = pose->wz * dt;
+    pose->x += pose->vx * dt;
+    pose->y += pose->vy * dt;
+    pose->z += pose->vz * dt;
+    if (model == PHSP_PREDICT_ACCELERATION) {
+        pose->x += pose->ax * dt*dt / 2.;
+        pose->y += pose->ay * dt*dt / 2.;
+        pose->z += pose->az * dt*dt / 2.;
+        pose->vx += pose->ax * dt;
+        pose->vy += pose->ay * dt;
+        pose->vz += pose->az * dt;
+
+        v[0] += pose->dwx * dt*dt / 2.;
+        v[1] += pose->dwy * dt*dt / 2.;
+        v[2] += pose->dwz * dt*dt / 2.;
+        pose->wx += pose->dwx * dt;
+        pose->wy += pose->dwy * dt;
+        pose->wz += pose->dwz * dt;
+    }
+
+    /* world frame rotation increment, applied on the left */
+    quat_exp(v, r);
+    q[0] = pose->qw; q[1] = pose->qx; q[2] = pose->qy; q[3] = pose->qz;
+    quat_mul(r, q, q);
+    quat_normalize(q);
+    pose->qw = q[0]; pose->qx = q[1]; pose->qy = q[2]; pose->qz = q[3];
+
+    if (dt != 0.) pose->flags |= PHSP_FLAG_PREDICTED;
+    pose->time = time;
+
+    if (max_age > 0 && age > max_age) {
+        pose->flags |= PHSP_FLAG_STALE;
+        errno = ESTALE;
+        return -1;
+    }
+    return 0;
+}
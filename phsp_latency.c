@@ -0,0 +1,144 @@
+/*
+ * Copyright (c) 2025 UCL
+ * All rights reserved.
+ *
+ * Redistribution and use  in source  and binary  forms,  with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *   1. Redistributions of  source  code must retain the  above copyright
+ *      notice and this list of conditions.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice and  this list of  conditions in the  documentation and/or
+ *      other materials provided with the distribution.
+ *
+ * phsp_latency.c — per-stage latency histograms
+ *
+ * Each histogram is only written by one task (the publish task for the
+ * decode, publish and log stages, the get_bodies caller for the read
+ * stage) with relaxed atomic updates, so that it can be summarized at any
+ * time without locking. A summary may mix counts of two consecutive
+ * frames, which is irrelevant for percentiles.
+ */
+#include "acphasespace.h"
+
+#include <stdlib.h>
+
+#include "phasespace_c_types.h"
+#include "phsp.h"
+
+#define SUB	(1U << PHSP_HIST_SUB_BITS)
+
+/* ---------------------------------------------------------------------- */
+/* Histograms                                                             */
+/* ---------------------------------------------------------------------- */
+
+static inline uint32_t
+phsp_hist_bucket(uint64_t v)
+{
+    uint32_t shift;
+
+    if (v < SUB) return v;
+    if (v >> PHSP_HIST_MAX_BITS) return PHSP_HIST_BUCKETS - 1;
+
+    shift = 63 - __builtin_clzll(v) - PHSP_HIST_SUB_BITS;
+    return ((shift + 1) << PHSP_HIST_SUB_BITS) + ((v >> shift) & (SUB - 1));
+}
+
+/* highest value that falls in bucket i */
+static inline uint64_t
+phsp_hist_value(uint32_t i)
+{
+    uint32_t g = i >> PHSP_HIST_SUB_BITS, s = i & (SUB - 1);
+
+    if (!g) return s;
+    return (((uint64_t)(SUB + s + 1)) << (g - 1)) - 1;
+}
+
+/* single writer: plain atomic stores, no locked read-modify-write */
+static inline void
+phsp_hist_add(uint64_t *c, uint64_t v)
+{
+    __atomic_store_n(c, __atomic_load_n(c, __ATOMIC_RELAXED) + v,
+                     __ATOMIC_RELAXED);
+}
+
+void
+phsp_hist_record(struct phsp_hist *h, uint64_t ns)
+{
+    phsp_hist_add(&h->count[phsp_hist_bucket(ns)], 1);
+    phsp_hist_add(&h->sum, ns);
+    if (ns > h->max) __atomic_store_n(&h->max, ns, __ATOMIC_RELAXED);
+    phsp_hist_add(&h->n, 1);
+}
+
+/*
+ * Value below which a fraction p of the samples are, rounded up to the
+ * end of its bucket and capped by the maximum. 0 if there is no sample.
+ */
+uint64_t
+phsp_hist_percentile(const struct phsp_hist *h, double p)
+{
+    uint64_t n = 0, total = 0, rank, max;
+    uint32_t i;
+
+    for (i = 0; i < PHSP_HIST_BUCKETS; i++)
+        total += __atomic_load_n(&h->count[i], __ATOMIC_RELAXED);
+    if (!total) return 0;
+
+    rank = p * total;
+    if (rank >= total) rank = total - 1;
+
+    max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+    for (i = 0; i < PHSP_HIST_BUCKETS; i++) {
+        n += __atomic_load_n(&h->count[i], __ATOMIC_RELAXED);
+        if (n > rank) break;
+    }
+    if (i == PHSP_HIST_BUCKETS) return max;
+
+    return phsp_hist_value(i) < max ? phsp_hist_value(i) : max;
+}
+
+
+/* ---------------------------------------------------------------------- */
+/* Stages                                                                 */
+/* ---------------------------------------------------------------------- */
+
+struct phasespace_latency_s *
+phsp_latency_create(void)
+{
+    return calloc(1, sizeof(struct phasespace_latency_s));
+}
+
+void
+phsp_latency_destroy(struct phasespace_latency_s *lat)
+{
+    free(lat);
+}
+
+static void
+phsp_latency_stage(const struct phsp_hist *h, phasespace_latency_stage *s)
+{
+    s->count = __atomic_load_n(&h->n, __ATOMIC_RELAXED);
+    s->p50 = phsp_hist_percentile(h, 0.5) * 1e-3;
+    s->p99 = phsp_hist_percentile(h, 0.99) * 1e-3;
+    s->p999 = phsp_hist_percentile(h, 0.999) * 1e-3;
+    s->max = __atomic_load_n(&h->max, __ATOMIC_RELAXED) * 1e-3;
+    s->mean = s->count ?
+        __atomic_load_n(&h->sum, __ATOMIC_RELAXED) * 1e-3 / s->count : 0.;
+}
+
+void
+phsp_latency_stats(const struct phasespace_latency_s *lat,
+                   phasespace_latency_stats *stats)
+{
+    if (!lat) {
+        memset(stats, 0, sizeof(*stats));
+        return;
+    }
+
+    phsp_latency_stage(&lat->hist[PHSP_LAT_DECODE], &stats->decode);
+    phsp_latency_stage(&lat->hist[PHSP_LAT_PUBLISH], &stats->publish);
+    phsp_latency_stage(&lat->hist[PHSP_LAT_LOG], &stats->log);
+    phsp_latency_stage(&lat->hist[PHSP_LAT_READ], &stats->read);
+}
@@ -0,0 +1,230 @@
+/*
+ * Copyright (c) 2025 UCL
+ * All rights reserved.
+ *
+ * Redistribution and use  in source  and binary  forms,  with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *   1. Redistributions of  source  code must retain the  above copyright
+ *      notice and this list of conditions.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice and  this list of  conditions in the  documentation and/or
+ *      other materials provided with the distribution.
+ *
+ * phsp_log2txt.c — convert a binary phasespace log to the text format
+ *
+ * Usage: phsp-log2txt [binary-log [text-log]]
+ *
+ * Output columns are the ones written by owl_log() in text mode, including
+ * the Euler angles and the frame-to-frame noise that the binary logger does
+ * not compute on-line.
+ */
+
+#include <endian.h>
+#include <err.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "phsp_euler.h"
+#include "phsp_logfmt.h"
+
+/* upper bound on records per frame (16-bit counts on the wire) */
+#define MAX_RECORDS	65536
+
+struct pos { int32_t id; double x, y, z; };
+
+static inline double
+letohd(double v)
+{
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+  uint64_t u;
+
+  memcpy(&u, &v, sizeof(u));
+  u = le64toh(u);
+  memcpy(&v, &u, sizeof(v));
+#endif
+  return v;
+}
+
+/* read one record of on-disk size 'size' into a struct of size 'len' */
+static int
+read_rec(FILE *in, void *rec, size_t len, size_t size)
+{
+  char skip[256];
+
+  memset(rec, 0, len);
+  if (fread(rec, size < len ? size : len, 1, in) != 1) return -1;
+  for (size -= size < len ? size : len; size > 0; ) {
+    size_t n = size < sizeof(skip) ? size : sizeof(skip);
+    if (fread(skip, n, 1, in) != 1) return -1;
+    size -= n;
+  }
+  return 0;
+}
+
+static inline double
+dist(const struct pos *a, const struct pos *b)
+{
+  double dx = a->x - b->x;
+  double dy = a->y - b->y;
+  double dz = a->z - b->z;
+
+  return sqrt(dx*dx + dy*dy + dz*dz);
+}
+
+/*
+ * Frame-to-frame displacement d[i] of cur[i] from the entry of prev with
+ * the same id, matched like owl_log_noise() does for the text log: by
+ * index while both frames list the same ids in the same order, through a
+ * hash of the previous ids otherwise, and 0 for ids not in prev (or 0,
+ * unknown). slot[] has room for 2 * MAX_RECORDS entries.
+ */
+static void
+noise(const struct pos *cur, size_t n, const struct pos *prev, size_t nprev,
+      int32_t *slot, double *d)
+{
+  size_t i, size = 2 * nprev;
+  uint32_t h;
+  int32_t j;
+
+  for (i = 0; i < n && i < nprev && cur[i].id == prev[i].id; i++);
+  if (i == n) {
+    for (i = 0; i < n; i++) d[i] = dist(&cur[i], &prev[i]);
+    return;
+  }
+
+  for (h = 0; h < size; h++) slot[h] = -1;
+  for (i = 0; i < nprev; i++) {
+    if (!prev[i].id) continue;
+    h = (uint32_t)prev[i].id % size;
+    while (slot[h] >= 0) h = (h + 1) % size;
+    slot[h] = i;
+  }
+
+  for (i = 0; i < n; i++) {
+    j = -1;
+    if (cur[i].id && size)
+      for (h = (uint32_t)cur[i].id % size; slot[h] >= 0; h = (h + 1) % size)
+        if (prev[slot[h]].id == cur[i].id) { j = slot[h]; break; }
+
+    /* unmatched entries have no displacement */
+    d[i] = j < 0 ? 0. : dist(&cur[i], &prev[j]);
+  }
+}
+
+int
+main(int argc, char *argv[])
+{
+  struct phsp_log_file_hdr h;
+  struct phsp_log_frame_rec f;
+  struct phsp_log_marker_rec *m;
+  struct phsp_log_rigid_rec *r;
+  struct pos *pm, *pr, *cm, *cr, *t;
+  int32_t *slot;
+  double *d;
+  size_t npm = 0, npr = 0, nm, nr, i;
+  size_t msize, rsize, fsize;
+  FILE *in = stdin, *out = stdout;
+
+  if (argc > 3) {
+    fprintf(stderr, "usage: %s [binary-log [text-log]]\n", argv[0]);
+    return 2;
+  }
+  if (argc > 1 && strcmp(argv[1], "-")) {
+    in = fopen(argv[1], "rb");
+    if (!in) err(1, "%s", argv[1]);
+  }
+  if (argc > 2 && strcmp(argv[2], "-")) {
+    out = fopen(argv[2], "w");
+    if (!out) err(1, "%s", argv[2]);
+  }
+
+  if (fread(&h, sizeof(h), 1, in) != 1) errx(1, "short file header");
+  if (memcmp(h.magic, PHSP_LOG_MAGIC, sizeof(PHSP_LOG_MAGIC)))
+    errx(1, "not a binary phasespace log");
+  if (le16toh(h.version) > PHSP_LOG_VERSION)
+    errx(1, "unsupported log version %u", le16toh(h.version));
+  if (le16toh(h.hdr_size) < sizeof(h)) errx(1, "bad header size");
+  if (fseek(in, le16toh(h.hdr_size) - sizeof(h), SEEK_CUR))
+    err(1, "seek");
+
+  fsize = le16toh(h.frame_size);
+  msize = le16toh(h.marker_size);
+  rsize = le16toh(h.rigid_size);
+  if (!fsize || !msize || !rsize) errx(1, "bad record sizes");
+
+  pm = calloc(MAX_RECORDS, sizeof(*pm));
+  pr = calloc(MAX_RECORDS, sizeof(*pr));
+  cm = calloc(MAX_RECORDS, sizeof(*cm));
+  cr = calloc(MAX_RECORDS, sizeof(*cr));
+  m = calloc(MAX_RECORDS, sizeof(*m));
+  r = calloc(MAX_RECORDS, sizeof(*r));
+  slot = calloc(2 * MAX_RECORDS, sizeof(*slot));
+  d = calloc(MAX_RECORDS, sizeof(*d));
+  if (!pm || !pr || !cm || !cr || !m || !r || !slot || !d)
+    err(1, "calloc");
+
+  fprintf(out, "%s\n", phsp_log_header);
+
+  while (!read_rec(in, &f, sizeof(f), fsize)) {
+    nm = le32toh(f.num_markers);
+    nr = le32toh(f.num_rigids);
+    if (nm > MAX_RECORDS || nr > MAX_RECORDS) errx(1, "corrupted frame");
+
+    /* the whole frame is read first: noise matches entries by id */
+    for (i = 0; i < nm; i++) {
+      if (read_rec(in, &m[i], sizeof(m[i]), msize))
+        errx(1, "truncated frame");
+      cm[i].id = (int32_t)le32toh(m[i].id);
+      cm[i].x = letohd(m[i].x);
+      cm[i].y = letohd(m[i].y);
+      cm[i].z = letohd(m[i].z);
+    }
+    for (i = 0; i < nr; i++) {
+      if (read_rec(in, &r[i], sizeof(r[i]), rsize))
+        errx(1, "truncated frame");
+      cr[i].id = (int32_t)le32toh(r[i].id);
+      cr[i].x = letohd(r[i].x);
+      cr[i].y = letohd(r[i].y);
+      cr[i].z = letohd(r[i].z);
+    }
+
+    noise(cm, nm, pm, npm, slot, d);
+    for (i = 0; i < nm; i++)
+      fprintf(out, phsp_log_marker_line,
+              phsp_log_ts(le64toh(m[i].time)),
+              cm[i].x, cm[i].y, cm[i].z,
+              letohd(m[i].cond), d[i]);
+
+    noise(cr, nr, pr, npr, slot, d);
+    for (i = 0; i < nr; i++) {
+      double qw, qx, qy, qz, roll, pitch, yaw;
+
+      qw = letohd(r[i].qw);
+      qx = letohd(r[i].qx);
+      qy = letohd(r[i].qy);
+      qz = letohd(r[i].qz);
+      /* same approximation as the text log, so both outputs match */
+      phsp_quat2euler(1, &qw, &qx, &qy, &qz, &roll, &pitch, &yaw, false);
+      fprintf(out, phsp_log_rigid_line,
+              phsp_log_ts(le64toh(r[i].time)),
+              cr[i].x, cr[i].y, cr[i].z,
+              roll, pitch, yaw,
+              letohd(r[i].cond), d[i]);
+    }
+
+    t = pm; pm = cm; cm = t; npm = nm;
+    t = pr; pr = cr; cr = t; npr = nr;
+  }
+  if (ferror(in)) err(1, "read");
+
+  free(pm); free(pr); free(cm); free(cr);
+  free(m); free(r); free(slot); free(d);
+  if (out != stdout && fclose(out)) err(1, "write");
+  return 0;
+}
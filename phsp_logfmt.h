@@ -0,0 +1,97 @@
+/*
+ * Copyright (c) 2025 UCL
+ * All rights reserved.
+ *
+ * Redistribution and use  in source  and binary  forms,  with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *   1. Redistributions of  source  code must retain the  above copyright
+ *      notice and this list of conditions.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice and  this list of  conditions in the  documentation and/or
+ *      other materials provided with the distribution.
+ */
+
+#ifndef H_PHASESPACE_LOGFMT
+#define H_PHASESPACE_LOGFMT
+
+#include <inttypes.h>
+
+/* ---------------------------------------------------------------------- */
+/* Text log format                                                        */
+/* ---------------------------------------------------------------------- */
+# define phsp_log_header \
+  "name ts  x y z  roll pitch yaw"
+# define phsp_log_line \
+  "%s %" PRIu64 ".%09d  %g %g %g  %g %g %g"
+
+/* one line per marker and rigid: name ts x y z roll pitch yaw cond noise */
+# define phsp_log_marker_line \
+  "marker %" PRIu64 ".%09d %g %g %g 0 0 0 %g %g\n"
+# define phsp_log_rigid_line \
+  "rigid %" PRIu64 ".%09d %g %g %g %g %g %g %g %g\n"
+
+/* ts arguments of the lines above, from a receive time in ns */
+# define phsp_log_ts(t) \
+  (uint64_t)(t) / 1000000000U, (int)((uint64_t)(t) % 1000000000U)
+
+/* ---------------------------------------------------------------------- */
+/* Binary log format                                                      */
+/* ---------------------------------------------------------------------- */
+/*
+ * A binary log is a phsp_log_file_hdr followed by one phsp_log_frame_rec
+ * per logged frame, each immediately followed by num_markers
+ * phsp_log_marker_rec and num_rigids phsp_log_rigid_rec. All integers and
+ * doubles are little-endian. Records have no padding and their size is
+ * repeated in the file header, so readers can skip fields appended by
+ * later versions.
+ */
+enum phsp_log_format {
+  PHSP_LOG_TEXT = 0,
+  PHSP_LOG_BINARY = 1,
+};
+
+#define PHSP_LOG_MAGIC		"PHSPLOG"
+#define PHSP_LOG_VERSION	1
+
+struct phsp_log_file_hdr {
+  char magic[8];		/* PHSP_LOG_MAGIC, NUL terminated */
+  uint16_t version;		/* PHSP_LOG_VERSION */
+  uint16_t hdr_size;		/* sizeof(struct phsp_log_file_hdr) */
+  uint16_t frame_size;		/* sizeof(struct phsp_log_frame_rec) */
+  uint16_t marker_size;		/* sizeof(struct phsp_log_marker_rec) */
+  uint16_t rigid_size;		/* sizeof(struct phsp_log_rigid_rec) */
+  uint16_t reserved;
+  uint32_t decimation;
+};
+
+struct phsp_log_frame_rec {
+  uint64_t seq;			/* frame number */
+  uint32_t num_markers;
+  uint32_t num_rigids;
+};
+
+struct phsp_log_marker_rec {
+  int32_t id;
+  int32_t flags;
+  int64_t time;			/* receive time, ns since the epoch */
+  double x, y, z;
+  double cond;
+};
+
+struct phsp_log_rigid_rec {
+  int32_t id;
+  int32_t flags;
+  int64_t time;			/* receive time, ns since the epoch */
+  double x, y, z;
+  double qw, qx, qy, qz;
+  double cond;
+};
+
+_Static_assert(sizeof(struct phsp_log_file_hdr) == 24, "padding in header");
+_Static_assert(sizeof(struct phsp_log_frame_rec) == 16, "padding in frame");
+_Static_assert(sizeof(struct phsp_log_marker_rec) == 48, "padding in marker");
+_Static_assert(sizeof(struct phsp_log_rigid_rec) == 80, "padding in rigid");
+
+#endif /* H_PHASESPACE_LOGFMT */
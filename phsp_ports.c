@@ -18,10 +18,12 @@
  * and optionally log them asynchronously.
  */
 
+#define _GNU_SOURCE	/* recvmmsg */
 #include "acphasespace.h"
 #include "phasespace_c_types.h"
 #include "owl.h"
 #include "phsp.h"
+#include <sys/socket.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -29,9 +31,7 @@
 #include <arpa/inet.h>
 #include <errno.h>
 #include <math.h>
-
-#define OWL_MAX_MARKERS 128
-#define OWL_MAX_RIGIDS  64
+#include <time.h>
 
 /* ---------------------------------------------------------------------- */
 /* Initialize hardware connection (calls OWL connect internally)          */
@@ -41,7 +41,7 @@ int owl_port_init(struct phasespace_server_s **server,
 {
     if (!server || !host || !port) return -1;
 
-    *server = owl_connect(host, port);
+    *server = owl_connect(host, port, PHSP_TRANSPORT_TCP, 0);
     if (!*server) return -1;
 
     return 0;
@@ -59,51 +59,454 @@ void owl_port_shutdown(struct phasespace_server_s **server)
 }
 
 /* ---------------------------------------------------------------------- */
-/* Fetch latest frame from OWL hardware                                    */
+/* Receive times                                                          */
 /* ---------------------------------------------------------------------- */
 
-void owl_fetch_frame(struct phasespace_server_s *server, phasespace_bodies *bodies)
+/* SO_TIMESTAMPING control message, as in linux/errqueue.h */
+struct owl_scm_timestamping {
+    struct timespec ts[3];
+};
+
+union owl_cmsg {
+    struct cmsghdr h;
+    char buf[CMSG_SPACE(sizeof(struct owl_scm_timestamping))];
+};
+
+/* kernel software receive time in msg, or the current time, ns */
+static int64_t owl_rx_time(struct msghdr *msg)
 {
-    if (!server || server->fd < 0 || !bodies) return;
+    struct owl_scm_timestamping tss;
+    struct cmsghdr *c;
+    struct timespec ts;
 
-    memset(bodies, 0, sizeof(*bodies));
+    for (c = msg ? CMSG_FIRSTHDR(msg) : NULL; c; c = CMSG_NXTHDR(msg, c)) {
+        if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_TIMESTAMPING)
+            continue;
+        memcpy(&tss, CMSG_DATA(c), sizeof(tss));
+        if (tss.ts[0].tv_sec || tss.ts[0].tv_nsec)
+            return tss.ts[0].tv_sec * 1000000000LL + tss.ts[0].tv_nsec;
+    }
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
 
-    /* OWL TCP frame header is typically 8 bytes: numMarkers(2), numRigid(2), etc. */
-    uint8_t header[8];
-    ssize_t n = recv(server->fd, header, sizeof(header), MSG_WAITALL);
-    if (n != sizeof(header)) {
-        fprintf(stderr, "Failed to read OWL header\n");
-        return;
+/* the stream up to the write offset was received at t */
+static inline void owl_rx_stamp(struct phasespace_server_s *server, int64_t t)
+{
+    uint32_t i;
+
+    if (server->rx_count) {
+        /* same time as the previous chunk: extend it */
+        i = (server->rx_head + server->rx_count - 1) % PHSP_RX_STAMPS;
+        if (server->rx_stamp[i].t == t) {
+            server->rx_stamp[i].end = server->rx_bytes;
+            return;
+        }
     }
 
-    uint16_t num_markers = ntohs(*(uint16_t*)&header[0]);
-    uint16_t num_rigids = ntohs(*(uint16_t*)&header[2]);
+    if (server->rx_count == PHSP_RX_STAMPS) {
+        /* not read for a while: lose the oldest times */
+        server->rx_head = (server->rx_head + 1) % PHSP_RX_STAMPS;
+        server->rx_count--;
+    }
 
-    if (num_markers > OWL_MAX_MARKERS) num_markers = OWL_MAX_MARKERS;
-    if (num_rigids > OWL_MAX_RIGIDS) num_rigids = OWL_MAX_RIGIDS;
+    i = (server->rx_head + server->rx_count++) % PHSP_RX_STAMPS;
+    server->rx_stamp[i].end = server->rx_bytes;
+    server->rx_stamp[i].t = t;
+}
 
-    bodies->num_markers = num_markers;
-    bodies->num_rigids = num_rigids;
+/* receive time of the last byte of the len bytes frame at the read offset */
+static int64_t owl_frame_time(struct phasespace_server_s *server, size_t len)
+{
+    uint64_t end = server->rx_bytes - (server->w - server->r - len);
+
+    for (; server->rx_count; server->rx_count--) {
+        if (server->rx_stamp[server->rx_head].end >= end)
+            return server->rx_stamp[server->rx_head].t;
+        server->rx_head = (server->rx_head + 1) % PHSP_RX_STAMPS;
+    }
+    return 0;
+}
+
+/* ---------------------------------------------------------------------- */
+/* UDP datagrams                                                          */
+/* ---------------------------------------------------------------------- */
 
-    /* Each marker: x,y,z float32 + cond float32 (16 bytes per marker) */
-    for (int i = 0; i < num_markers; i++) {
-        float xyz[3], cond;
-        if (recv(server->fd, xyz, sizeof(xyz), MSG_WAITALL) != sizeof(xyz)) return;
-        if (recv(server->fd, &cond, sizeof(cond), MSG_WAITALL) != sizeof(cond)) return;
+/* sequence numbers further back are from a restarted server */
+#define OWL_UDP_RESTART	1024
+
+static inline uint32_t
+owl_udp_seq(const uint8_t *d)
+{
+    return ((uint32_t)d[0] << 24) | (d[1] << 16) | (d[2] << 8) | d[3];
+}
+
+static inline uint64_t
+owl_mono_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Read batches of datagrams with recvmmsg() and append their frames to the
+ * receive buffer in sequence order, so that the stream decoder sees the
+ * same byte stream as with TCP. Within a batch, datagrams are sorted by
+ * sequence number; a datagram not newer than the last one appended is
+ * dropped as reordered or duplicate (the newer frame was already handed
+ * over), unless it is so far behind that the server must have restarted.
+ * The batch is sized for the frames of the previous batch; a datagram that
+ * does not fit in the receive buffer any more is dropped and accounted for
+ * as lost.
+ *
+ * Nothing reports a server that stopped sending: the subscription is
+ * renewed every PHSP_UDP_RESUBSCRIBE ms, and PHSP_UDP_TIMEOUT ms without
+ * a valid datagram fail with ETIMEDOUT, like a TCP disconnection.
+ */
+static ssize_t owl_recv_udp(struct phasespace_server_s *server)
+{
+    struct mmsghdr msg[PHSP_UDP_BATCH];
+    struct iovec iov[PHSP_UDP_BATCH];
+    union owl_cmsg ctrl[PHSP_UDP_BATCH];
+    unsigned int order[PHSP_UDP_BATCH];
+    unsigned int vlen, nvalid, i, j, k;
+    ssize_t total = 0;
+    const uint8_t *d;
+    size_t len, size;
+    uint64_t now;
+    int32_t gap;
+    int n;
+
+    if (server->r == server->w)
+        server->r = server->w = 0;
+
+    for (i = 0; i < PHSP_UDP_BATCH; i++) {
+        iov[i].iov_base = server->dgram + i * PHSP_UDP_DGRAM_SIZE;
+        iov[i].iov_len = PHSP_UDP_DGRAM_SIZE;
+        memset(&msg[i].msg_hdr, 0, sizeof(msg[i].msg_hdr));
+        msg[i].msg_hdr.msg_iov = &iov[i];
+        msg[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    while (1) {
+        /* make room for as many frames as datagrams requested */
+        if (server->r > 0) {
+            memmove(server->rbuf, server->rbuf + server->r,
+                    server->w - server->r);
+            server->w -= server->r;
+            server->r = 0;
+        }
+        vlen = (sizeof(server->rbuf) - server->w) /
+               (server->dgram_size - OWL_UDP_HEADER_SIZE);
+        if (vlen > PHSP_UDP_BATCH) vlen = PHSP_UDP_BATCH;
+        if (vlen == 0) {
+            /* frames are waiting to be decoded, the server is alive */
+            server->alive = owl_mono_ns();
+            return total;
+        }
+
+        if (server->timestamps) {
+            for (i = 0; i < vlen; i++) {
+                msg[i].msg_hdr.msg_control = ctrl[i].buf;
+                msg[i].msg_hdr.msg_controllen = sizeof(ctrl[i].buf);
+            }
+        }
+
+        n = recvmmsg(server->fd, msg, vlen, MSG_DONTWAIT, NULL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            return -1;
+        }
+
+        /* validate, then sort by sequence number (insertion, n is small) */
+        size = 0;
+        for (i = nvalid = 0; i < (unsigned)n; i++) {
+            d = iov[i].iov_base;
+            len = msg[i].msg_len;
+            if ((msg[i].msg_hdr.msg_flags & MSG_TRUNC) ||
+                len < OWL_UDP_HEADER_SIZE + OWL_HEADER_SIZE ||
+                len - OWL_UDP_HEADER_SIZE != (size_t)OWL_FRAME_SIZE(
+                    (d[8] << 8) | d[9], (d[10] << 8) | d[11])) {
+                server->invalid++;
+                continue;
+            }
+            if (len > size) size = len;
+
+            for (j = nvalid++; j > 0; j--) {
+                k = order[j - 1];
+                if ((int32_t)(owl_udp_seq(iov[k].iov_base) -
+                              owl_udp_seq(d)) <= 0) break;
+                order[j] = k;
+            }
+            order[j] = i;
+        }
+
+        for (j = 0; j < nvalid; j++) {
+            i = order[j];
+            d = iov[i].iov_base;
+            len = msg[i].msg_len - OWL_UDP_HEADER_SIZE;
+
+            gap = 0;
+            if (server->seq_valid) {
+                gap = owl_udp_seq(d) - server->seq;
+                if (gap < -OWL_UDP_RESTART) gap = 0; /* server restarted */
+                if (gap < 0) {
+                    server->reordered++;
+                    continue;
+                }
+            }
+            server->seq = owl_udp_seq(d) + 1;
+            server->seq_valid = true;
+            if (server->w + len > sizeof(server->rbuf)) {
+                /* no room left: lost along with the gap before it */
+                server->lost += gap + 1;
+                continue;
+            }
+            server->lost += gap;
+
+            memcpy(server->rbuf + server->w, d + OWL_UDP_HEADER_SIZE, len);
+            if (server->capture)
+                owl_capture(server, server->rbuf + server->w, len);
+            server->w += len;
+            server->rx_bytes += len;
+            owl_rx_stamp(server, owl_rx_time(
+                             server->timestamps ? &msg[i].msg_hdr : NULL));
+            total += len;
+        }
+
+        if (size) server->dgram_size = size;
+        if ((unsigned)n < vlen) break;
+    }
+
+    now = owl_mono_ns();
+    if (total > 0)
+        server->alive = now;
+    else if (now - server->alive > PHSP_UDP_TIMEOUT * 1000000ULL) {
+        errno = ETIMEDOUT;
+        return -1;
+    }
+    if (now - server->subscribed >= PHSP_UDP_RESUBSCRIBE * 1000000ULL) {
+        if (send(server->fd, OWL_UDP_SUBSCRIBE, sizeof(OWL_UDP_SUBSCRIBE),
+                 MSG_DONTWAIT) < 0 && errno != EAGAIN && errno != EINTR)
+            return -1;
+        server->subscribed = now;
+    }
+
+    return total;
+}
+
+/* ---------------------------------------------------------------------- */
+/* Fill the receive buffer with whatever the socket has available         */
+/* ---------------------------------------------------------------------- */
+/*
+ * Returns the number of bytes read (0 if nothing was pending), or -1 on
+ * error or when the server closed the connection.
+ */
+ssize_t owl_recv(struct phasespace_server_s *server)
+{
+    union owl_cmsg ctrl;
+    struct msghdr msg;
+    struct iovec iov;
+    ssize_t n, total = 0;
+    uint64_t end;
+    int64_t t;
+    size_t len;
+    bool recorded;
+
+    if (!server || server->fd < 0) { errno = EBADF; return -1; }
+    if (server->transport == PHSP_TRANSPORT_UDP)
+        return owl_recv_udp(server);
+
+    /* reclaim consumed space, once less than half of the buffer is free */
+    if (server->r == server->w)
+        server->r = server->w = 0;
+    else if (server->r > 0 &&
+             server->w > sizeof(server->rbuf) / 2) {
+        memmove(server->rbuf, server->rbuf + server->r,
+                server->w - server->r);
+        server->w -= server->r;
+        server->r = 0;
+    }
+
+    while (server->w < sizeof(server->rbuf)) {
+        len = sizeof(server->rbuf) - server->w;
+
+        /* a replay is read one recorded chunk at a time, and left in the
+         * socket rather than losing the time of unread chunks */
+        recorded = server->replay &&
+            owl_replay_chunk(server, server->rx_bytes, &end, &t);
+        if (recorded) {
+            if (server->rx_count == PHSP_RX_STAMPS && total > 0) break;
+            if (len > end - server->rx_bytes) len = end - server->rx_bytes;
+        }
+
+        if (server->timestamps) {
+            iov.iov_base = server->rbuf + server->w;
+            iov.iov_len = len;
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = &iov;
+            msg.msg_iovlen = 1;
+            msg.msg_control = ctrl.buf;
+            msg.msg_controllen = sizeof(ctrl.buf);
+            n = recvmsg(server->fd, &msg, MSG_DONTWAIT);
+        } else
+            n = recv(server->fd, server->rbuf + server->w, len,
+                     MSG_DONTWAIT);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            return -1;
+        }
+        if (n == 0) {
+            /* report the end of stream once buffered bytes are consumed */
+            if (total > 0) break;
+            errno = ECONNRESET;
+            return -1;
+        }
+
+        if (server->capture)
+            owl_capture(server, server->rbuf + server->w, n);
+        server->w += n;
+        server->rx_bytes += n;
+        if (!recorded)
+            t = owl_rx_time(server->timestamps ? &msg : NULL);
+        owl_rx_stamp(server, t);
+        total += n;
+    }
+
+    return total;
+}
+
+/* ---------------------------------------------------------------------- */
+/* Check for a complete frame in the receive buffer                       */
+/* ---------------------------------------------------------------------- */
+/*
+ * Returns the size of the complete frame at the read offset, or 0 if there
+ * is none yet. Oversized frames are skipped on the way.
+ */
+size_t owl_frame_pending(struct phasespace_server_s *server)
+{
+    const uint8_t *p;
+    size_t avail, len;
+
+    while (1) {
+        avail = server->w - server->r;
+
+        /* drop the remainder of a frame that does not fit in rbuf */
+        if (server->discard) {
+            len = avail < server->discard ? avail : server->discard;
+            server->r += len;
+            server->discard -= len;
+            if (server->discard) return 0;
+            continue;
+        }
+
+        if (avail < OWL_HEADER_SIZE) return 0;
+
+        p = server->rbuf + server->r;
+        len = OWL_FRAME_SIZE((p[0] << 8) | p[1], (p[2] << 8) | p[3]);
+
+        if (len > sizeof(server->rbuf)) {
+            server->discard = len;
+            server->oversized++;
+            continue;
+        }
+        return avail < len ? 0 : len;
+    }
+}
+
+/* ---------------------------------------------------------------------- */
+/* Count and skip buffered frames without decoding them                   */
+/* ---------------------------------------------------------------------- */
+/*
+ * Number of complete frames in the receive buffer, from their headers
+ * only. A trailing oversized frame is not counted.
+ */
+size_t owl_frames_buffered(struct phasespace_server_s *server)
+{
+    const uint8_t *p;
+    size_t r, len, n = 0;
+
+    if (!owl_frame_pending(server)) return 0;
+
+    for (r = server->r; server->w - r >= OWL_HEADER_SIZE; r += len) {
+        p = server->rbuf + r;
+        len = OWL_FRAME_SIZE((p[0] << 8) | p[1], (p[2] << 8) | p[3]);
+        if (server->w - r < len) break;
+        n++;
+    }
+
+    return n;
+}
+
+/* drop the complete frame at the read offset, return 1 if there was one */
+int owl_skip_frame(struct phasespace_server_s *server)
+{
+    size_t len = owl_frame_pending(server);
+
+    if (!len) return 0;
+    server->r += len;
+    server->coalesced++;
+    return 1;
+}
+
+/* ---------------------------------------------------------------------- */
+/* Decode one complete frame from the receive buffer                      */
+/* ---------------------------------------------------------------------- */
+/*
+ * Returns 1 if a frame was decoded into bodies, 0 if no complete frame is
+ * buffered yet. bodies is left untouched unless a whole frame is available.
+ */
+int owl_decode_frame(struct phasespace_server_s *server,
+                     phasespace_bodies *bodies)
+{
+    const uint8_t *p;
+    size_t len, i;
+    uint16_t num_markers, num_rigids;
+    float data[8];
+    int64_t t;
+
+    if (!server || !bodies) return 0;
+
+    len = owl_frame_pending(server);
+    if (!len) return 0;
+    t = owl_frame_time(server, len);
+
+    /* whole frame is buffered: decode in place */
+    p = server->rbuf + server->r;
+    num_markers = (p[0] << 8) | p[1];
+    num_rigids = (p[2] << 8) | p[3];
+    p += OWL_HEADER_SIZE;
+
+    bodies->num_markers = num_markers;
+    if (bodies->num_markers > PHASESPACE_MAX_MARKERS)
+        bodies->num_markers = PHASESPACE_MAX_MARKERS;
+    for (i = 0; i < bodies->num_markers; i++) {
+        memcpy(data, p + i * OWL_MARKER_SIZE, OWL_MARKER_SIZE);
 
         bodies->markers[i].id = i+1;
-        bodies->markers[i].x = xyz[0];
-        bodies->markers[i].y = xyz[1];
-        bodies->markers[i].z = xyz[2];
-        bodies->markers[i].cond = cond;
+        bodies->markers[i].flags = 0;
+        bodies->markers[i].time = t;
+        bodies->markers[i].x = data[0];
+        bodies->markers[i].y = data[1];
+        bodies->markers[i].z = data[2];
+        bodies->markers[i].cond = data[3];
     }
+    p += num_markers * OWL_MARKER_SIZE;
 
-    /* Each rigid body: x,y,z + qw,qx,qy,qz + cond (float32 each, 32 bytes per rigid) */
-    for (int i = 0; i < num_rigids; i++) {
-        float data[8];
-        if (recv(server->fd, data, sizeof(data), MSG_WAITALL) != sizeof(data)) return;
+    bodies->num_rigids = num_rigids;
+    if (bodies->num_rigids > PHASESPACE_MAX_RIGIDS)
+        bodies->num_rigids = PHASESPACE_MAX_RIGIDS;
+    for (i = 0; i < bodies->num_rigids; i++) {
+        memcpy(data, p + i * OWL_RIGID_SIZE, OWL_RIGID_SIZE);
 
         bodies->rigids[i].id = i+1;
+        bodies->rigids[i].flags = 0;
+        bodies->rigids[i].time = t;
         bodies->rigids[i].x  = data[0];
         bodies->rigids[i].y  = data[1];
         bodies->rigids[i].z  = data[2];
@@ -113,13 +516,35 @@ void owl_fetch_frame(struct phasespace_server_s *server, phasespace_bodies *bodi
         bodies->rigids[i].qz = data[6];
         bodies->rigids[i].cond = data[7];
     }
+
+    server->r += len;
+    server->frames++;
+    return 1;
+}
+
+/* ---------------------------------------------------------------------- */
+/* Fetch latest frame from OWL hardware                                    */
+/* ---------------------------------------------------------------------- */
+/*
+ * Decodes the next buffered frame, reading from the socket only when the
+ * buffer does not already hold a complete one. Returns 1 if bodies was
+ * updated, 0 if no complete frame is available yet, -1 on connection error.
+ */
+int owl_fetch_frame(struct phasespace_server_s *server,
+                    phasespace_bodies *bodies)
+{
+    if (!server || server->fd < 0 || !bodies) return -1;
+
+    if (owl_decode_frame(server, bodies)) return 1;
+    if (owl_recv(server) < 0) return -1;
+    return owl_decode_frame(server, bodies);
 }
 
 /* ---------------------------------------------------------------------- */
 /* Optional: log a frame to file using the async logger                   */
 /* ---------------------------------------------------------------------- */
 void owl_log_frame(struct phasespace_log_s *log,
-                   const struct phasespace_bodies *bodies)
+                   const phasespace_bodies *bodies)
 {
     if (!log || !bodies) return;
     owl_log(log, bodies);
@@ -0,0 +1,262 @@
+/*
+ * Copyright (c) 2025 UCL
+ * All rights reserved.
+ *
+ * Redistribution and use  in source  and binary  forms,  with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *   1. Redistributions of  source  code must retain the  above copyright
+ *      notice and this list of conditions.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice and  this list of  conditions in the  documentation and/or
+ *      other materials provided with the distribution.
+ *
+ * phsp_shm.c — shared-memory frame ring, writer and reader sides
+ */
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include <linux/futex.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "phsp_shm.h"
+
+struct phasespace_shm_s {
+  char name[NAME_MAX];
+  struct phsp_shm_header *hdr;
+  size_t size;
+  struct phsp_shm_frame *current;	/* slot between begin and commit */
+};
+
+struct phsp_shm_reader {
+  const struct phsp_shm_header *hdr;
+  size_t size;
+};
+
+static inline size_t
+phsp_shm_size(uint32_t nslots)
+{
+  return sizeof(struct phsp_shm_header) +
+    nslots * sizeof(struct phsp_shm_frame);
+}
+
+
+/* --- writer ----------------------------------------------------------- */
+
+struct phasespace_shm_s *
+phsp_shm_create(const char *name)
+{
+  struct phasespace_shm_s *shm;
+  int fd, e;
+
+  shm = calloc(1, sizeof(*shm));
+  if (!shm) return NULL;
+  if (strlen(name) >= sizeof(shm->name)) {
+    free(shm);
+    errno = ENAMETOOLONG;
+    return NULL;
+  }
+  strcpy(shm->name, name);
+
+  /* start from a fresh object, readers of a previous one keep it mapped */
+  shm_unlink(name);
+  fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644);
+  if (fd < 0) goto err;
+
+  shm->size = phsp_shm_size(PHSP_SHM_SLOTS);
+  if (ftruncate(fd, shm->size)) goto err_fd;
+
+  shm->hdr = mmap(NULL, shm->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (shm->hdr == MAP_FAILED) goto err_fd;
+  close(fd);
+
+  shm->hdr->version = PHSP_SHM_VERSION;
+  shm->hdr->nslots = PHSP_SHM_SLOTS;
+  shm->hdr->frame_size = sizeof(struct phsp_shm_frame);
+  shm->hdr->futex = 0;
+  shm->hdr->latest = 0;
+  __atomic_store_n(&shm->hdr->magic, PHSP_SHM_MAGIC, __ATOMIC_RELEASE);
+  return shm;
+
+err_fd:
+  e = errno;
+  close(fd);
+  shm_unlink(name);
+  errno = e;
+err:
+  free(shm);
+  return NULL;
+}
+
+void
+phsp_shm_destroy(struct phasespace_shm_s *shm)
+{
+  if (!shm) return;
+
+  munmap(shm->hdr, shm->size);
+  shm_unlink(shm->name);
+  free(shm);
+}
+
+/* slot to fill with the next frame, marked as being written */
+struct phsp_shm_frame *
+phsp_shm_begin(struct phasespace_shm_s *shm)
+{
+  struct phsp_shm_frame *f;
+
+  f = &shm->hdr->slot[(shm->hdr->latest + 1) % shm->hdr->nslots];
+  __atomic_store_n(&f->seq, f->seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+
+  shm->current = f;
+  return f;
+}
+
+/* publish the slot returned by phsp_shm_begin() and wake up readers */
+void
+phsp_shm_commit(struct phasespace_shm_s *shm)
+{
+  struct phsp_shm_frame *f = shm->current;
+  uint64_t frame = shm->hdr->latest + 1;
+
+  if (!f) return;
+  shm->current = NULL;
+
+  f->frame = frame;
+  __atomic_store_n(&f->seq, f->seq + 1, __ATOMIC_RELEASE);
+  __atomic_store_n(&shm->hdr->latest, frame, __ATOMIC_RELEASE);
+
+  __atomic_add_fetch(&shm->hdr->futex, 1, __ATOMIC_RELEASE);
+  syscall(SYS_futex, &shm->hdr->futex, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+
+/* --- reader ----------------------------------------------------------- */
+
+struct phsp_shm_reader *
+phsp_shm_open(const char *name)
+{
+  struct phsp_shm_reader *r;
+  struct stat st;
+  int fd, e;
+
+  r = calloc(1, sizeof(*r));
+  if (!r) return NULL;
+
+  fd = shm_open(name, O_RDONLY, 0);
+  if (fd < 0) goto err;
+  if (fstat(fd, &st)) goto err_fd;
+  if ((size_t)st.st_size < sizeof(struct phsp_shm_header)) {
+    errno = EPROTO;
+    goto err_fd;
+  }
+
+  r->size = st.st_size;
+  r->hdr = mmap(NULL, r->size, PROT_READ, MAP_SHARED, fd, 0);
+  if (r->hdr == MAP_FAILED) goto err_fd;
+  close(fd);
+
+  if (__atomic_load_n(&r->hdr->magic, __ATOMIC_ACQUIRE) != PHSP_SHM_MAGIC ||
+      r->hdr->version != PHSP_SHM_VERSION ||
+      r->hdr->frame_size != sizeof(struct phsp_shm_frame) ||
+      r->size < phsp_shm_size(r->hdr->nslots)) {
+    munmap((void *)r->hdr, r->size);
+    free(r);
+    errno = EPROTO;
+    return NULL;
+  }
+
+  return r;
+
+err_fd:
+  e = errno;
+  close(fd);
+  errno = e;
+err:
+  free(r);
+  return NULL;
+}
+
+void
+phsp_shm_close(struct phsp_shm_reader *r)
+{
+  if (!r) return;
+
+  munmap((void *)r->hdr, r->size);
+  free(r);
+}
+
+/*
+ * Latest complete frame, read in place. The frame must be checked with
+ * phsp_shm_valid(f, *seq) after use: the writer reuses a slot every
+ * PHSP_SHM_SLOTS frames. Returns NULL before the first frame.
+ */
+const struct phsp_shm_frame *
+phsp_shm_latest(struct phsp_shm_reader *r, uint64_t *seq)
+{
+  const struct phsp_shm_frame *f;
+  uint64_t latest;
+
+  do {
+    latest = __atomic_load_n(&r->hdr->latest, __ATOMIC_ACQUIRE);
+    if (!latest) return NULL;
+
+    f = &r->hdr->slot[latest % r->hdr->nslots];
+    *seq = __atomic_load_n(&f->seq, __ATOMIC_ACQUIRE);
+  } while (*seq & 1);
+
+  return f;
+}
+
+/* true if f was not overwritten since phsp_shm_latest() returned seq */
+bool
+phsp_shm_valid(const struct phsp_shm_frame *f, uint64_t seq)
+{
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  return __atomic_load_n(&f->seq, __ATOMIC_RELAXED) == seq;
+}
+
+/*
+ * Wait until a frame newer than 'frame' is available, or timeout (NULL for
+ * no timeout). Returns 0 on new frame, -1 with errno set to ETIMEDOUT or
+ * EINTR otherwise.
+ */
+int
+phsp_shm_wait(struct phsp_shm_reader *r, uint64_t frame,
+              const struct timespec *timeout)
+{
+  struct timespec deadline, *d = NULL;
+  uint32_t v;
+
+  /* FUTEX_WAIT_BITSET takes an absolute CLOCK_MONOTONIC deadline, so that
+   * spurious wakeups do not restart the full timeout */
+  if (timeout) {
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout->tv_sec;
+    deadline.tv_nsec += timeout->tv_nsec;
+    if (deadline.tv_nsec >= 1000000000) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000;
+    }
+    d = &deadline;
+  }
+
+  while (1) {
+    v = __atomic_load_n(&r->hdr->futex, __ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&r->hdr->latest, __ATOMIC_ACQUIRE) > frame) return 0;
+
+    if (syscall(SYS_futex, &r->hdr->futex, FUTEX_WAIT_BITSET, v, d,
+                NULL, FUTEX_BITSET_MATCH_ANY) && errno != EAGAIN)
+      return -1;
+  }
+}
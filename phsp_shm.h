@@ -0,0 +1,105 @@
+/*
+ * Copyright (c) 2025 UCL
+ * All rights reserved.
+ *
+ * Redistribution and use  in source  and binary  forms,  with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *   1. Redistributions of  source  code must retain the  above copyright
+ *      notice and this list of conditions.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice and  this list of  conditions in the  documentation and/or
+ *      other materials provided with the distribution.
+ */
+
+#ifndef H_PHASESPACE_SHM
+#define H_PHASESPACE_SHM
+
+/*
+ * Shared-memory export of mocap frames for local consumers.
+ *
+ * The publish task writes each frame into the next slot of a ring in a
+ * POSIX shared memory object. Readers map the object read-only and access
+ * frames in place: a slot is valid as long as its seq did not change, see
+ * phsp_shm_latest() and phsp_shm_valid(). New frames are signalled on a
+ * futex, see phsp_shm_wait().
+ *
+ * This header and phsp_shm.c do not depend on the component and can be
+ * built into any consumer.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#define PHSP_SHM_MAGIC		0x50485350	/* "PHSP" */
+#define PHSP_SHM_VERSION	1
+#define PHSP_SHM_SLOTS		8
+#ifndef PHSP_SHM_MAX_MARKERS
+# define PHSP_SHM_MAX_MARKERS	128
+#endif
+#ifndef PHSP_SHM_MAX_RIGIDS
+# define PHSP_SHM_MAX_RIGIDS	64
+#endif
+
+struct phsp_shm_marker {
+  int32_t id;
+  int32_t flags;
+  int64_t time;			/* receive time, ns since the epoch */
+  double x, y, z;
+  double cond;
+};
+
+struct phsp_shm_rigid {
+  int32_t id;
+  int32_t flags;
+  int64_t time;			/* receive time, ns since the epoch */
+  double x, y, z;
+  double qw, qx, qy, qz;
+  double cond;
+};
+
+struct phsp_shm_frame {
+  uint64_t seq;			/* odd while the slot is being written */
+  uint64_t frame;		/* frame number, starting at 1 */
+  uint32_t num_markers;
+  uint32_t num_rigids;
+  struct phsp_shm_marker markers[PHSP_SHM_MAX_MARKERS];
+  struct phsp_shm_rigid rigids[PHSP_SHM_MAX_RIGIDS];
+} __attribute__((aligned(64)));
+
+struct phsp_shm_header {
+  uint32_t magic;		/* PHSP_SHM_MAGIC */
+  uint32_t version;		/* PHSP_SHM_VERSION */
+  uint32_t nslots;		/* PHSP_SHM_SLOTS */
+  uint32_t frame_size;		/* sizeof(struct phsp_shm_frame) */
+  uint32_t futex;		/* incremented after each frame */
+  uint32_t pad;
+  uint64_t latest;		/* number of the last complete frame */
+  struct phsp_shm_frame slot[];
+} __attribute__((aligned(64)));
+
+/* writer, used by the component */
+struct phasespace_shm_s;
+
+struct phasespace_shm_s *
+	phsp_shm_create(const char *name);
+void	phsp_shm_destroy(struct phasespace_shm_s *shm);
+struct phsp_shm_frame *
+	phsp_shm_begin(struct phasespace_shm_s *shm);
+void	phsp_shm_commit(struct phasespace_shm_s *shm);
+
+/* reader, for consumers */
+struct phsp_shm_reader;
+
+struct phsp_shm_reader *
+	phsp_shm_open(const char *name);
+void	phsp_shm_close(struct phsp_shm_reader *r);
+const struct phsp_shm_frame *
+	phsp_shm_latest(struct phsp_shm_reader *r, uint64_t *seq);
+bool	phsp_shm_valid(const struct phsp_shm_frame *f, uint64_t seq);
+int	phsp_shm_wait(struct phsp_shm_reader *r, uint64_t frame,
+                const struct timespec *timeout);
+
+#endif /* H_PHASESPACE_SHM */
@@ -0,0 +1,436 @@
+/*
+ * Copyright (c) 2025 UCL
+ * All rights reserved.
+ *
+ * Redistribution and use  in source  and binary  forms,  with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *   1. Redistributions of  source  code must retain the  above copyright
+ *      notice and this list of conditions.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice and  this list of  conditions in the  documentation and/or
+ *      other materials provided with the distribution.
+ *
+ * phsp_sim.c — local OWL server simulator
+ *
+ * Usage: phsp-sim [-b addr] [-p port] [-m markers] [-r rigids] [-f rate]
+ *                 [-n frames] [-d dropout] [-o occlusion] [-j jitter]
+ *                 [-s seed] [-u [-R reorder]]
+ *
+ * Serves frames in the TCP format decoded by owl_fetch_frame() to one
+ * client at a time, or with -u as UDP datagrams to the last subscriber
+ * (see phsp_wire.h), where datagrams can also be reordered. Each rigid
+ * body follows a Lissajous path while slowly rotating, and its markers are
+ * rigidly attached to it with gaussian measurement noise. Markers are
+ * free-floating when there are no rigids. Frames are sent at a fixed rate
+ * (0 for as fast as the client reads), and whole frames can be dropped,
+ * markers occluded (cond -1) and send times jittered to load test the
+ * receive/publish/log chain.
+ */
+
+#include <arpa/inet.h>
+#include <err.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <math.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "phsp_wire.h"
+
+struct sim {
+  unsigned int nmarkers, nrigids;
+  double rate;		/* Hz, 0 for unthrottled */
+  uint64_t frames;	/* 0 for unlimited */
+  double dropout;	/* probability of a missing frame */
+  double occlusion;	/* probability of an occluded marker */
+  double jitter;	/* max send delay, s */
+  double noise;		/* marker noise standard deviation, mm */
+  double reorder;	/* probability of a datagram sent after the next */
+  int udp;
+  uint64_t rng;
+};
+
+struct stats {
+  uint64_t sent, dropped, late, reordered;
+};
+
+
+/* --- random numbers --------------------------------------------------- */
+
+static inline uint64_t
+sim_rand(struct sim *s)
+{
+  /* xorshift64* */
+  s->rng ^= s->rng >> 12;
+  s->rng ^= s->rng << 25;
+  s->rng ^= s->rng >> 27;
+  return s->rng * 0x2545f4914f6cdd1dULL;
+}
+
+/* uniform in [0, 1) */
+static inline double
+sim_uniform(struct sim *s)
+{
+  return (sim_rand(s) >> 11) * 0x1p-53;
+}
+
+static inline double
+sim_gauss(struct sim *s)
+{
+  double u = 1. - sim_uniform(s), v = sim_uniform(s);
+  return sqrt(-2. * log(u)) * cos(2 * M_PI * v);
+}
+
+
+/* --- motion ----------------------------------------------------------- */
+
+static inline void
+put_float(uint8_t **p, double v)
+{
+  float f = v;
+  memcpy(*p, &f, sizeof(f));
+  *p += sizeof(f);
+}
+
+/* pose of rigid k at time t, mm */
+static void
+sim_rigid(unsigned int k, double t, double p[3], double q[4])
+{
+  double ph = 2 * M_PI * k / 7.;
+  double roll = 0.1 * sin(0.7 * t + ph);
+  double pitch = 0.2 * sin(0.5 * t + ph);
+  double yaw = 0.3 * t + ph;
+  double cr = cos(roll/2), sr = sin(roll/2);
+  double cp = cos(pitch/2), sp = sin(pitch/2);
+  double cy = cos(yaw/2), sy = sin(yaw/2);
+
+  p[0] = 1000. * cos(0.4 * t + ph);
+  p[1] = 1000. * sin(0.6 * t + ph);
+  p[2] = 1000. + 200. * sin(0.3 * t + ph);
+
+  q[0] = cr*cp*cy + sr*sp*sy;
+  q[1] = sr*cp*cy - cr*sp*sy;
+  q[2] = cr*sp*cy + sr*cp*sy;
+  q[3] = cr*cp*sy - sr*sp*cy;
+}
+
+/* rotate v by unit quaternion q */
+static void
+sim_rotate(const double q[4], const double v[3], double r[3])
+{
+  double w = q[0], x = q[1], y = q[2], z = q[3];
+
+  r[0] = (1 - 2*(y*y + z*z))*v[0] + 2*(x*y - w*z)*v[1] + 2*(x*z + w*y)*v[2];
+  r[1] = 2*(x*y + w*z)*v[0] + (1 - 2*(x*x + z*z))*v[1] + 2*(y*z - w*x)*v[2];
+  r[2] = 2*(x*z - w*y)*v[0] + 2*(y*z + w*x)*v[1] + (1 - 2*(x*x + y*y))*v[2];
+}
+
+/* encode the frame at time t into buf, return its size */
+static size_t
+sim_frame(struct sim *s, double t, uint8_t *buf)
+{
+  uint8_t *p = buf;
+  double pos[3], q[4], off[3], m[3];
+  unsigned int i, k;
+
+  p[0] = s->nmarkers >> 8; p[1] = s->nmarkers;
+  p[2] = s->nrigids >> 8; p[3] = s->nrigids;
+  memset(p + 4, 0, OWL_HEADER_SIZE - 4);
+  p += OWL_HEADER_SIZE;
+
+  for (i = 0; i < s->nmarkers; i++) {
+    if (s->occlusion > 0. && sim_uniform(s) < s->occlusion) {
+      put_float(&p, 0.); put_float(&p, 0.); put_float(&p, 0.);
+      put_float(&p, -1.);
+      continue;
+    }
+
+    if (s->nrigids) {
+      /* markers spread on a 50mm circle around their rigid */
+      unsigned int per = (s->nmarkers + s->nrigids - 1) / s->nrigids;
+      double a;
+
+      k = i % s->nrigids;
+      a = 2 * M_PI * (i / s->nrigids) / per;
+      sim_rigid(k, t, pos, q);
+      off[0] = 50. * cos(a);
+      off[1] = 50. * sin(a);
+      off[2] = 10. * ((i / s->nrigids) & 1);
+      sim_rotate(q, off, m);
+      m[0] += pos[0]; m[1] += pos[1]; m[2] += pos[2];
+    } else {
+      sim_rigid(i, 0.5 * t, m, q);
+    }
+
+    put_float(&p, m[0] + s->noise * sim_gauss(s));
+    put_float(&p, m[1] + s->noise * sim_gauss(s));
+    put_float(&p, m[2] + s->noise * sim_gauss(s));
+    put_float(&p, 1. + 0.1 * sim_uniform(s));
+  }
+
+  for (k = 0; k < s->nrigids; k++) {
+    sim_rigid(k, t, pos, q);
+    put_float(&p, pos[0]); put_float(&p, pos[1]); put_float(&p, pos[2]);
+    put_float(&p, q[0]); put_float(&p, q[1]);
+    put_float(&p, q[2]); put_float(&p, q[3]);
+    put_float(&p, 1.);
+  }
+
+  return p - buf;
+}
+
+
+/* --- server ----------------------------------------------------------- */
+
+static int
+sim_listen(const char *addr, const char *port, int type)
+{
+  struct addrinfo hints, *res, *res0;
+  int fd = -1, on = 1, e;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = type;
+  hints.ai_flags = AI_PASSIVE;
+
+  e = getaddrinfo(addr, port, &hints, &res0);
+  if (e) errx(1, "%s:%s: %s", addr ? addr : "*", port, gai_strerror(e));
+
+  for (res = res0; res; res = res->ai_next) {
+    fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    if (fd < 0) continue;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if (!bind(fd, res->ai_addr, res->ai_addrlen) &&
+        (type != SOCK_STREAM || !listen(fd, 1))) break;
+    close(fd);
+    fd = -1;
+  }
+  freeaddrinfo(res0);
+  if (fd < 0) err(1, "%s:%s", addr ? addr : "*", port);
+
+  return fd;
+}
+
+static int
+sim_send(int fd, const uint8_t *buf, size_t len)
+{
+  ssize_t n;
+
+  while (len > 0) {
+    n = send(fd, buf, len, MSG_NOSIGNAL);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    buf += n;
+    len -= n;
+  }
+  return 0;
+}
+
+static inline void
+ts_add(struct timespec *ts, double d)
+{
+  long ns = ts->tv_nsec + (long)(d * 1e9);
+
+  ts->tv_sec += ns / 1000000000L;
+  ts->tv_nsec = ns % 1000000000L;
+}
+
+static inline double
+ts_diff(const struct timespec *a, const struct timespec *b)
+{
+  return (a->tv_sec - b->tv_sec) + (a->tv_nsec - b->tv_nsec) * 1e-9;
+}
+
+/* wait for a UDP subscription and connect the socket to its sender */
+static int
+sim_subscribe(int fd)
+{
+  struct sockaddr_storage from;
+  socklen_t len;
+  struct sockaddr unspec = { .sa_family = AF_UNSPEC };
+  char msg[sizeof(OWL_UDP_SUBSCRIBE)];
+  ssize_t n;
+
+  /* dissolve the association with the previous subscriber */
+  connect(fd, &unspec, sizeof(unspec));
+
+  do {
+    len = sizeof(from);
+    n = recvfrom(fd, msg, sizeof(msg), 0, (struct sockaddr *)&from, &len);
+    if (n < 0 && errno != EINTR) return -1;
+  } while (n != sizeof(msg) || memcmp(msg, OWL_UDP_SUBSCRIBE, sizeof(msg)));
+
+  return connect(fd, (struct sockaddr *)&from, len);
+}
+
+/* serve frames to one client until it disconnects or s->frames are sent */
+static void
+sim_serve(struct sim *s, int fd, struct stats *st)
+{
+  static uint8_t buf[OWL_FRAME_SIZE(65535, 65535)];
+  static uint8_t held[OWL_UDP_HEADER_SIZE + OWL_FRAME_SIZE(65535, 65535)];
+  size_t hdr = s->udp ? OWL_UDP_HEADER_SIZE : 0, hlen = 0;
+  struct timespec start, next, now;
+  uint64_t i;
+  double t;
+  size_t len;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  next = start;
+
+  for (i = 0; !s->frames || i < s->frames; i++) {
+    if (s->rate > 0.) {
+      struct timespec at = next;
+
+      t = i / s->rate;
+      if (s->jitter > 0.) ts_add(&at, s->jitter * sim_uniform(s));
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      if (ts_diff(&now, &at) > 1. / s->rate) st->late++;
+      while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &at, NULL)
+             == EINTR);
+      ts_add(&next, 1. / s->rate);
+    } else {
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      t = ts_diff(&now, &start);
+    }
+
+    if (s->dropout > 0. && sim_uniform(s) < s->dropout) {
+      st->dropped++;
+      continue;
+    }
+
+    len = hdr + sim_frame(s, t, buf + hdr);
+    if (s->udp) {
+      /* the frame index is the sequence number, so that drops are gaps */
+      buf[0] = i >> 24; buf[1] = i >> 16; buf[2] = i >> 8; buf[3] = i;
+      memset(buf + 4, 0, OWL_UDP_HEADER_SIZE - 4);
+
+      if (!hlen && s->reorder > 0. && sim_uniform(s) < s->reorder) {
+        memcpy(held, buf, len);
+        hlen = len;
+        continue;
+      }
+    }
+
+    if (sim_send(fd, buf, len) ||
+        (hlen && sim_send(fd, held, hlen))) {
+      if (errno != EPIPE && errno != ECONNRESET && errno != ECONNREFUSED)
+        warn("send");
+      return;
+    }
+    st->sent++;
+    if (hlen) { st->sent++; st->reordered++; hlen = 0; }
+  }
+
+  if (hlen && !sim_send(fd, held, hlen)) { st->sent++; st->reordered++; }
+}
+
+static void
+usage(const char *argv0)
+{
+  fprintf(stderr,
+          "usage: %s [-b addr] [-p port] [-m markers] [-r rigids] [-f rate]\n"
+          "       [-n frames] [-d dropout] [-o occlusion] [-j jitter]"
+          " [-s seed]\n"
+          "       [-u [-R reorder]]\n"
+          "  -b addr       listen address (default any)\n"
+          "  -p port       listen port (default 23)\n"
+          "  -m markers    markers per frame (default 32)\n"
+          "  -r rigids     rigid bodies per frame (default 4)\n"
+          "  -f rate       frame rate in Hz, 0 for unthrottled (default 960)\n"
+          "  -n frames     frames per connection, 0 for unlimited\n"
+          "  -d dropout    probability of a dropped frame (default 0)\n"
+          "  -o occlusion  probability of an occluded marker (default 0)\n"
+          "  -j jitter     max random send delay in us (default 0)\n"
+          "  -s seed       random seed\n"
+          "  -u            serve UDP datagrams instead of a TCP stream\n"
+          "  -R reorder    probability of a reordered datagram (default 0)\n",
+          argv0);
+  exit(2);
+}
+
+int
+main(int argc, char *argv[])
+{
+  struct sim s = {
+    .nmarkers = 32, .nrigids = 4, .rate = 960., .noise = 0.1, .rng = 1
+  };
+  const char *addr = NULL, *port = "23";
+  struct timespec t0, t1;
+  struct stats st;
+  unsigned long v;
+  int c, lfd, fd;
+
+  while ((c = getopt(argc, argv, "b:p:m:r:f:n:d:o:j:s:uR:")) != -1) {
+    switch (c) {
+      case 'b': addr = optarg; break;
+      case 'p': port = optarg; break;
+
+      case 'm': case 'r':
+        v = strtoul(optarg, NULL, 0);
+        if (v > 65535) errx(2, "-%c: at most 65535", c);
+        if (c == 'm') s.nmarkers = v; else s.nrigids = v;
+        break;
+
+      case 'f': s.rate = strtod(optarg, NULL); break;
+      case 'n': s.frames = strtoull(optarg, NULL, 0); break;
+      case 'd': s.dropout = strtod(optarg, NULL); break;
+      case 'o': s.occlusion = strtod(optarg, NULL); break;
+      case 'j': s.jitter = strtod(optarg, NULL) * 1e-6; break;
+      case 's': s.rng = strtoull(optarg, NULL, 0) | 1; break;
+      case 'u': s.udp = 1; break;
+      case 'R': s.reorder = strtod(optarg, NULL); break;
+      default: usage(argv[0]);
+    }
+  }
+  if (optind != argc || s.rate < 0.) usage(argv[0]);
+  if (s.udp && OWL_UDP_HEADER_SIZE + OWL_FRAME_SIZE(s.nmarkers, s.nrigids)
+      > 65507)
+    errx(2, "frames too large for UDP datagrams");
+
+  signal(SIGPIPE, SIG_IGN);
+  lfd = sim_listen(addr, port, s.udp ? SOCK_DGRAM : SOCK_STREAM);
+  fprintf(stderr, "%s: serving %u markers, %u rigids at %g Hz on %s port %s\n",
+          argv[0], s.nmarkers, s.nrigids, s.rate, s.udp ? "UDP" : "TCP",
+          port);
+
+  while (1) {
+    if (s.udp) {
+      if (sim_subscribe(lfd)) err(1, "subscribe");
+      fd = lfd;
+    } else {
+      fd = accept(lfd, NULL, NULL);
+      if (fd < 0) {
+        if (errno == EINTR || errno == ECONNABORTED) continue;
+        err(1, "accept");
+      }
+      c = 1;
+      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &c, sizeof(c));
+    }
+
+    memset(&st, 0, sizeof(st));
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    sim_serve(&s, fd, &st);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    if (!s.udp) close(fd);
+
+    fprintf(stderr, "%s: sent %" PRIu64 " frames in %.3fs (%.0f Hz), "
+            "dropped %" PRIu64 ", late %" PRIu64 ", reordered %" PRIu64 "\n",
+            argv[0], st.sent, ts_diff(&t1, &t0), st.sent / ts_diff(&t1, &t0),
+            st.dropped, st.late, st.reordered);
+  }
+
+  return 0;
+}
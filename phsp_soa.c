@@ -0,0 +1,190 @@
+/*
+ * Copyright (c) 2025 UCL
+ * All rights reserved.
+ *
+ * Redistribution and use  in source  and binary  forms,  with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *   1. Redistributions of  source  code must retain the  above copyright
+ *      notice and this list of conditions.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice and  this list of  conditions in the  documentation and/or
+ *      other materials provided with the distribution.
+ *
+ * phsp_soa.c — struct-of-arrays marker storage and per-frame kernels
+ *
+ * The distance kernel has a scalar version and, on x86, SSE2 and AVX2
+ * versions. The best one supported by the CPU is selected on first use.
+ */
+
+#include "acphasespace.h"
+
+#include <math.h>
+
+#include "phasespace_c_types.h"
+#include "phsp.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+# include <immintrin.h>
+# define PHSP_SOA_X86
+#endif
+
+struct phsp_soa_ops {
+    void (*norms)(const phasespace_soa *, const phasespace_soa *, size_t,
+                  double *);
+};
+
+/* --- scalar ----------------------------------------------------------- */
+
+static void
+norms_scalar(const phasespace_soa *a, const phasespace_soa *b, size_t n,
+             double *d)
+{
+    for (size_t i = 0; i < n; i++) {
+        double dx = a->x[i] - b->x[i];
+        double dy = a->y[i] - b->y[i];
+        double dz = a->z[i] - b->z[i];
+        d[i] = sqrt(dx*dx + dy*dy + dz*dz);
+    }
+}
+
+static const struct phsp_soa_ops ops_scalar = {
+    norms_scalar
+};
+
+
+#ifdef PHSP_SOA_X86
+
+/* --- SSE2 ------------------------------------------------------------- */
+
+__attribute__((target("sse2"))) static void
+norms_sse2(const phasespace_soa *a, const phasespace_soa *b, size_t n,
+           double *d)
+{
+    size_t i = 0;
+
+    for (; i + 2 <= n; i += 2) {
+        __m128d dx = _mm_sub_pd(_mm_load_pd(a->x + i), _mm_load_pd(b->x + i));
+        __m128d dy = _mm_sub_pd(_mm_load_pd(a->y + i), _mm_load_pd(b->y + i));
+        __m128d dz = _mm_sub_pd(_mm_load_pd(a->z + i), _mm_load_pd(b->z + i));
+        __m128d s = _mm_add_pd(_mm_add_pd(_mm_mul_pd(dx, dx),
+                                          _mm_mul_pd(dy, dy)),
+                               _mm_mul_pd(dz, dz));
+        _mm_storeu_pd(d + i, _mm_sqrt_pd(s));
+    }
+    for (; i < n; i++) {
+        double dx = a->x[i] - b->x[i];
+        double dy = a->y[i] - b->y[i];
+        double dz = a->z[i] - b->z[i];
+        d[i] = sqrt(dx*dx + dy*dy + dz*dz);
+    }
+}
+
+static const struct phsp_soa_ops ops_sse2 = {
+    norms_sse2
+};
+
+
+/* --- AVX2 ------------------------------------------------------------- */
+
+__attribute__((target("avx2"))) static void
+norms_avx2(const phasespace_soa *a, const phasespace_soa *b, size_t n,
+           double *d)
+{
+    size_t i = 0;
+
+    for (; i + 4 <= n; i += 4) {
+        __m256d dx = _mm256_sub_pd(_mm256_load_pd(a->x + i),
+                                   _mm256_load_pd(b->x + i));
+        __m256d dy = _mm256_sub_pd(_mm256_load_pd(a->y + i),
+                                   _mm256_load_pd(b->y + i));
+        __m256d dz = _mm256_sub_pd(_mm256_load_pd(a->z + i),
+                                   _mm256_load_pd(b->z + i));
+        __m256d s = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(dx, dx),
+                                                _mm256_mul_pd(dy, dy)),
+                                  _mm256_mul_pd(dz, dz));
+        _mm256_storeu_pd(d + i, _mm256_sqrt_pd(s));
+    }
+    for (; i < n; i++) {
+        double dx = a->x[i] - b->x[i];
+        double dy = a->y[i] - b->y[i];
+        double dz = a->z[i] - b->z[i];
+        d[i] = sqrt(dx*dx + dy*dy + dz*dz);
+    }
+}
+
+static const struct phsp_soa_ops ops_avx2 = {
+    norms_avx2
+};
+
+#endif /* PHSP_SOA_X86 */
+
+
+/* --- dispatch --------------------------------------------------------- */
+
+static const struct phsp_soa_ops *
+phsp_soa_ops(void)
+{
+    static const struct phsp_soa_ops *ops;
+    const struct phsp_soa_ops *o;
+
+    o = __atomic_load_n(&ops, __ATOMIC_RELAXED);
+    if (o) return o;
+
+    o = &ops_scalar;
+#ifdef PHSP_SOA_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        o = &ops_avx2;
+    else if (__builtin_cpu_supports("sse2"))
+        o = &ops_sse2;
+#endif
+
+    __atomic_store_n(&ops, o, __ATOMIC_RELAXED);
+    return o;
+}
+
+/* ---------------------------------------------------------------------- */
+/* Conversions                                                            */
+/* ---------------------------------------------------------------------- */
+
+void
+phsp_soa_from_markers(phasespace_soa *s, const phasespace_marker_s *m,
+                      size_t n)
+{
+    s->n = n;
+    for (size_t i = 0; i < n; i++) {
+        s->id[i] = m[i].id;
+        s->x[i] = m[i].x;
+        s->y[i] = m[i].y;
+        s->z[i] = m[i].z;
+        s->cond[i] = m[i].cond;
+    }
+}
+
+void
+phsp_soa_from_rigids(phasespace_soa *s, const phasespace_rigid_s *r,
+                     size_t n)
+{
+    s->n = n;
+    for (size_t i = 0; i < n; i++) {
+        s->id[i] = r[i].id;
+        s->x[i] = r[i].x;
+        s->y[i] = r[i].y;
+        s->z[i] = r[i].z;
+        s->cond[i] = r[i].cond;
+    }
+}
+
+/* ---------------------------------------------------------------------- */
+/* Kernels                                                                */
+/* ---------------------------------------------------------------------- */
+
+/* d[i] = |a[i] - b[i]| for i < n */
+void
+phsp_soa_norms(const phasespace_soa *a, const phasespace_soa *b, size_t n,
+               double *d)
+{
+    phsp_soa_ops()->norms(a, b, n, d);
+}
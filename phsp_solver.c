@@ -0,0 +1,559 @@
+/*
+ * Copyright (c) 2025 UCL
+ * All rights reserved.
+ *
+ * Redistribution and use  in source  and binary  forms,  with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *   1. Redistributions of  source  code must retain the  above copyright
+ *      notice and this list of conditions.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice and  this list of  conditions in the  documentation and/or
+ *      other materials provided with the distribution.
+ *
+ * phsp_solver.c — rigid bodies fitted on raw markers
+ *
+ * Each registered template is fitted to the visible markers of a frame
+ * with Horn's quaternion method, weighting markers by 1/cond: the
+ * weighted cross-covariance of template and measured points gives a 4x4
+ * symmetric matrix whose dominant eigenvector is the rotation. The
+ * per-point moment sums and residuals have a scalar and an AVX2 version,
+ * selected on first use; the 4x4 eigenproblem is solved with Jacobi
+ * rotations. If the rms residual exceeds the template tolerance, the
+ * worst marker is dropped and the fit done once again.
+ */
+#include "acphasespace.h"
+
+#include <errno.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "phasespace_c_types.h"
+#include "phsp.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+# include <immintrin.h>
+# define PHSP_SOLVER_X86
+#endif
+
+#define PHSP_SOLVER_MAX_RESIDUAL 5.	/* default tolerance, mm */
+#define PHSP_SOLVER_COND_MIN	1e-3	/* cond of an exact fit */
+#define PHSP_SOLVER_MIN_GAP	1e-4	/* relative eigengap, else collinear */
+
+_Static_assert(PHSP_TEMPLATE_MAX_POINTS % 4 == 0,
+               "templates are processed 4 points at a time");
+
+/* moment sums: weight, weighted template and measured points, and the
+ * weighted products l p' in row-major order */
+enum {
+    M_W, M_LX, M_LY, M_LZ, M_PX, M_PY, M_PZ,
+    M_XX, M_XY, M_XZ, M_YX, M_YY, M_YZ, M_ZX, M_ZY, M_ZZ, M_SIZE
+};
+
+/* measured points of one body, in the same order as the template */
+struct phsp_solver_points {
+    double x[PHSP_TEMPLATE_MAX_POINTS] __attribute__((aligned(32)));
+    double y[PHSP_TEMPLATE_MAX_POINTS] __attribute__((aligned(32)));
+    double z[PHSP_TEMPLATE_MAX_POINTS] __attribute__((aligned(32)));
+    double w[PHSP_TEMPLATE_MAX_POINTS] __attribute__((aligned(32)));
+};
+
+struct phsp_solver_ops {
+    void (*moments)(const struct phsp_solver_body *,
+                    const struct phsp_solver_points *, double *);
+    void (*residuals)(const struct phsp_solver_body *,
+                      const struct phsp_solver_points *, const double *,
+                      const double *, double *);
+};
+
+
+/* --- scalar ----------------------------------------------------------- */
+
+static void
+moments_scalar(const struct phsp_solver_body *b,
+               const struct phsp_solver_points *p, double *m)
+{
+    memset(m, 0, M_SIZE * sizeof(*m));
+    for (uint32_t i = 0; i < b->n; i++) {
+        double w = p->w[i];
+        double lx = w * b->lx[i], ly = w * b->ly[i], lz = w * b->lz[i];
+
+        m[M_W] += w;
+        m[M_LX] += lx; m[M_LY] += ly; m[M_LZ] += lz;
+        m[M_PX] += w * p->x[i]; m[M_PY] += w * p->y[i];
+        m[M_PZ] += w * p->z[i];
+        m[M_XX] += lx * p->x[i]; m[M_XY] += lx * p->y[i];
+        m[M_XZ] += lx * p->z[i];
+        m[M_YX] += ly * p->x[i]; m[M_YY] += ly * p->y[i];
+        m[M_YZ] += ly * p->z[i];
+        m[M_ZX] += lz * p->x[i]; m[M_ZY] += lz * p->y[i];
+        m[M_ZZ] += lz * p->z[i];
+    }
+}
+
+/* squared distances between R l + t and p */
+static void
+residuals_scalar(const struct phsp_solver_body *b,
+                 const struct phsp_solver_points *p, const double *R,
+                 const double *t, double *d2)
+{
+    for (uint32_t i = 0; i < b->n; i++) {
+        double dx = R[0]*b->lx[i] + R[1]*b->ly[i] + R[2]*b->lz[i] + t[0];
+        double dy = R[3]*b->lx[i] + R[4]*b->ly[i] + R[5]*b->lz[i] + t[1];
+        double dz = R[6]*b->lx[i] + R[7]*b->ly[i] + R[8]*b->lz[i] + t[2];
+
+        dx -= p->x[i]; dy -= p->y[i]; dz -= p->z[i];
+        d2[i] = dx*dx + dy*dy + dz*dz;
+    }
+}
+
+static const struct phsp_solver_ops ops_scalar = {
+    moments_scalar, residuals_scalar
+};
+
+
+#ifdef PHSP_SOLVER_X86
+
+/* --- AVX2 ------------------------------------------------------------- */
+
+__attribute__((target("avx2"))) static inline double
+hsum_avx2(__m256d v)
+{
+    __m128d s = _mm_add_pd(_mm256_castpd256_pd128(v),
+                           _mm256_extractf128_pd(v, 1));
+
+    return _mm_cvtsd_f64(_mm_add_sd(s, _mm_unpackhi_pd(s, s)));
+}
+
+__attribute__((target("avx2"))) static void
+moments_avx2(const struct phsp_solver_body *b,
+             const struct phsp_solver_points *p, double *m)
+{
+    __m256d s[M_SIZE];
+    uint32_t i;
+    int k;
+
+    for (k = 0; k < M_SIZE; k++) s[k] = _mm256_setzero_pd();
+
+    /* n is a multiple of 4 */
+    for (i = 0; i < b->n; i += 4) {
+        __m256d w = _mm256_load_pd(p->w + i);
+        __m256d lx = _mm256_mul_pd(w, _mm256_load_pd(b->lx + i));
+        __m256d ly = _mm256_mul_pd(w, _mm256_load_pd(b->ly + i));
+        __m256d lz = _mm256_mul_pd(w, _mm256_load_pd(b->lz + i));
+        __m256d px = _mm256_load_pd(p->x + i);
+        __m256d py = _mm256_load_pd(p->y + i);
+        __m256d pz = _mm256_load_pd(p->z + i);
+
+        s[M_W] = _mm256_add_pd(s[M_W], w);
+        s[M_LX] = _mm256_add_pd(s[M_LX], lx);
+        s[M_LY] = _mm256_add_pd(s[M_LY], ly);
+        s[M_LZ] = _mm256_add_pd(s[M_LZ], lz);
+        s[M_PX] = _mm256_add_pd(s[M_PX], _mm256_mul_pd(w, px));
+        s[M_PY] = _mm256_add_pd(s[M_PY], _mm256_mul_pd(w, py));
+        s[M_PZ] = _mm256_add_pd(s[M_PZ], _mm256_mul_pd(w, pz));
+        s[M_XX] = _mm256_add_pd(s[M_XX], _mm256_mul_pd(lx, px));
+        s[M_XY] = _mm256_add_pd(s[M_XY], _mm256_mul_pd(lx, py));
+        s[M_XZ] = _mm256_add_pd(s[M_XZ], _mm256_mul_pd(lx, pz));
+        s[M_YX] = _mm256_add_pd(s[M_YX], _mm256_mul_pd(ly, px));
+        s[M_YY] = _mm256_add_pd(s[M_YY], _mm256_mul_pd(ly, py));
+        s[M_YZ] = _mm256_add_pd(s[M_YZ], _mm256_mul_pd(ly, pz));
+        s[M_ZX] = _mm256_add_pd(s[M_ZX], _mm256_mul_pd(lz, px));
+        s[M_ZY] = _mm256_add_pd(s[M_ZY], _mm256_mul_pd(lz, py));
+        s[M_ZZ] = _mm256_add_pd(s[M_ZZ], _mm256_mul_pd(lz, pz));
+    }
+
+    for (k = 0; k < M_SIZE; k++) m[k] = hsum_avx2(s[k]);
+}
+
+__attribute__((target("avx2"))) static void
+residuals_avx2(const struct phsp_solver_body *b,
+               const struct phsp_solver_points *p, const double *R,
+               const double *t, double *d2)
+{
+    __m256d r[9], tx = _mm256_set1_pd(t[0]), ty = _mm256_set1_pd(t[1]);
+    __m256d tz = _mm256_set1_pd(t[2]);
+    uint32_t i;
+    int k;
+
+    for (k = 0; k < 9; k++) r[k] = _mm256_set1_pd(R[k]);
+
+    for (i = 0; i < b->n; i += 4) {
+        __m256d lx = _mm256_load_pd(b->lx + i);
+        __m256d ly = _mm256_load_pd(b->ly + i);
+        __m256d lz = _mm256_load_pd(b->lz + i);
+        __m256d dx, dy, dz;
+
+        dx = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(r[0], lx),
+                                         _mm256_mul_pd(r[1], ly)),
+                           _mm256_add_pd(_mm256_mul_pd(r[2], lz), tx));
+        dy = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(r[3], lx),
+                                         _mm256_mul_pd(r[4], ly)),
+                           _mm256_add_pd(_mm256_mul_pd(r[5], lz), ty));
+        dz = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(r[6], lx),
+                                         _mm256_mul_pd(r[7], ly)),
+                           _mm256_add_pd(_mm256_mul_pd(r[8], lz), tz));
+        dx = _mm256_sub_pd(dx, _mm256_load_pd(p->x + i));
+        dy = _mm256_sub_pd(dy, _mm256_load_pd(p->y + i));
+        dz = _mm256_sub_pd(dz, _mm256_load_pd(p->z + i));
+        _mm256_storeu_pd(d2 + i,
+                         _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(dx, dx),
+                                                     _mm256_mul_pd(dy, dy)),
+                                       _mm256_mul_pd(dz, dz)));
+    }
+}
+
+static const struct phsp_solver_ops ops_avx2 = {
+    moments_avx2, residuals_avx2
+};
+
+#endif /* PHSP_SOLVER_X86 */
+
+
+/* --- dispatch --------------------------------------------------------- */
+
+static const struct phsp_solver_ops *
+phsp_solver_ops(void)
+{
+    static const struct phsp_solver_ops *ops;
+    const struct phsp_solver_ops *o;
+
+    o = __atomic_load_n(&ops, __ATOMIC_RELAXED);
+    if (o) return o;
+
+    o = &ops_scalar;
+#ifdef PHSP_SOLVER_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        o = &ops_avx2;
+#endif
+
+    __atomic_store_n(&ops, o, __ATOMIC_RELAXED);
+    return o;
+}
+
+
+/* --- fit -------------------------------------------------------------- */
+
+/*
+ * Eigen decomposition of the symmetric a with cyclic Jacobi rotations.
+ * On return, the diagonal of a holds the eigenvalues and the columns of v
+ * the eigenvectors.
+ */
+static void
+solver_eigen(double a[4][4], double v[4][4])
+{
+    double scale = 0., off, theta, t, c, s, x, y;
+    int sweep, p, q, k;
+
+    for (p = 0; p < 4; p++)
+        for (q = 0; q < 4; q++) {
+            v[p][q] = p == q;
+            scale += a[p][q] * a[p][q];
+        }
+
+    for (sweep = 0; sweep < 16; sweep++) {
+        off = 0.;
+        for (p = 0; p < 3; p++)
+            for (q = p + 1; q < 4; q++) off += a[p][q] * a[p][q];
+        if (off <= 1e-30 * scale) break;
+
+        for (p = 0; p < 3; p++)
+            for (q = p + 1; q < 4; q++) {
+                if (a[p][q] == 0.) continue;
+
+                theta = (a[q][q] - a[p][p]) / (2. * a[p][q]);
+                t = (theta < 0. ? -1. : 1.) /
+                    (fabs(theta) + sqrt(theta * theta + 1.));
+                c = 1. / sqrt(t * t + 1.);
+                s = t * c;
+
+                for (k = 0; k < 4; k++) {
+                    x = a[k][p]; y = a[k][q];
+                    a[k][p] = c * x - s * y;
+                    a[k][q] = s * x + c * y;
+                }
+                for (k = 0; k < 4; k++) {
+                    x = a[p][k]; y = a[q][k];
+                    a[p][k] = c * x - s * y;
+                    a[q][k] = s * x + c * y;
+                }
+                for (k = 0; k < 4; k++) {
+                    x = v[k][p]; y = v[k][q];
+                    v[k][p] = c * x - s * y;
+                    v[k][q] = s * x + c * y;
+                }
+            }
+    }
+}
+
+/*
+ * Rotation q and translation t minimizing the weighted squared distances
+ * between R(q) l + t and p. Returns false if the points are degenerate.
+ */
+static bool
+solver_horn(const double *m, double q[4], double R[9], double t[3])
+{
+    double W = m[M_W], S[9], N[4][4], V[4][4], cl[3], cp[3];
+    double l1 = -INFINITY, l2 = -INFINITY;
+    int i, best = 0;
+
+    if (!(W > 0.)) return false;
+    for (i = 0; i < 3; i++) {
+        cl[i] = m[M_LX + i] / W;
+        cp[i] = m[M_PX + i] / W;
+    }
+
+    /* centered cross-covariance sum w (l - cl)(p - cp)' */
+    for (i = 0; i < 9; i++)
+        S[i] = m[M_XX + i] - W * cl[i / 3] * cp[i % 3];
+
+    N[0][0] = S[0] + S[4] + S[8];
+    N[1][1] = S[0] - S[4] - S[8];
+    N[2][2] = -S[0] + S[4] - S[8];
+    N[3][3] = -S[0] - S[4] + S[8];
+    N[0][1] = N[1][0] = S[5] - S[7];
+    N[0][2] = N[2][0] = S[6] - S[2];
+    N[0][3] = N[3][0] = S[1] - S[3];
+    N[1][2] = N[2][1] = S[1] + S[3];
+    N[1][3] = N[3][1] = S[6] + S[2];
+    N[2][3] = N[3][2] = S[5] + S[7];
+
+    solver_eigen(N, V);
+    for (i = 0; i < 4; i++)
+        if (N[i][i] > l1) { l2 = l1; l1 = N[i][i]; best = i; }
+        else if (N[i][i] > l2) l2 = N[i][i];
+
+    /* collinear points leave the rotation about their line undefined */
+    if (!(l1 - l2 > PHSP_SOLVER_MIN_GAP * fabs(l1))) return false;
+
+    for (i = 0; i < 4; i++) q[i] = V[i][best];
+    if (q[0] < 0.) for (i = 0; i < 4; i++) q[i] = -q[i];
+
+    R[0] = 1 - 2*(q[2]*q[2] + q[3]*q[3]);
+    R[1] = 2*(q[1]*q[2] - q[0]*q[3]);
+    R[2] = 2*(q[1]*q[3] + q[0]*q[2]);
+    R[3] = 2*(q[1]*q[2] + q[0]*q[3]);
+    R[4] = 1 - 2*(q[1]*q[1] + q[3]*q[3]);
+    R[5] = 2*(q[2]*q[3] - q[0]*q[1]);
+    R[6] = 2*(q[1]*q[3] - q[0]*q[2]);
+    R[7] = 2*(q[2]*q[3] + q[0]*q[1]);
+    R[8] = 1 - 2*(q[1]*q[1] + q[2]*q[2]);
+
+    for (i = 0; i < 3; i++)
+        t[i] = cp[i] -
+            (R[3*i] * cl[0] + R[3*i + 1] * cl[1] + R[3*i + 2] * cl[2]);
+    return true;
+}
+
+/* index of marker id in bodies, trying the index of the last frame first */
+static inline int
+solver_marker(const phasespace_bodies *bodies, int32_t id, uint32_t *slot)
+{
+    size_t i;
+
+    if (*slot < bodies->num_markers && bodies->markers[*slot].id == id)
+        return *slot;
+    for (i = 0; i < bodies->num_markers; i++)
+        if (bodies->markers[i].id == id) return *slot = i;
+    return -1;
+}
+
+/* weighted rms residual of a fit, and the point of largest residual */
+static double
+solver_rms(const struct phsp_solver_ops *ops, const struct phsp_solver_body *b,
+           const struct phsp_solver_points *p, const double *m,
+           const double *R, const double *t, uint32_t *worst)
+{
+    double d2[PHSP_TEMPLATE_MAX_POINTS], e = 0., max = -1.;
+    uint32_t i;
+
+    ops->residuals(b, p, R, t, d2);
+    for (i = 0; i < b->n; i++) {
+        if (p->w[i] == 0.) continue;
+        e += p->w[i] * d2[i];
+        if (d2[i] > max) { max = d2[i]; *worst = i; }
+    }
+
+    return sqrt(e / m[M_W]);
+}
+
+/* fit template b on the markers of bodies into r */
+static void
+solver_fit(const struct phsp_solver_ops *ops, struct phsp_solver_body *b,
+           const phasespace_bodies *bodies, phasespace_rigid_s *r)
+{
+    struct phsp_solver_points p;
+    const phasespace_marker_s *mk;
+    double m[M_SIZE], ref[3] = { 0. }, q[4], R[9], t[3], rms;
+    uint32_t i, n = 0, worst = 0;
+    int k;
+
+    r->id = b->id;
+    r->flags = PHSP_FLAG_SOLVED;
+    r->cond = -1.;
+
+    for (i = 0; i < b->n; i++) {
+        k = i < b->num_points ?
+            solver_marker(bodies, b->marker[i], &b->slot[i]) : -1;
+        mk = k >= 0 ? &bodies->markers[k] : NULL;
+        if (!mk || !(mk->cond > 0.) || (mk->flags & PHSP_FLAG_REJECTED)) {
+            p.x[i] = p.y[i] = p.z[i] = p.w[i] = 0.;
+            continue;
+        }
+
+        /* relative to the first visible marker, for accuracy */
+        if (!n++) {
+            ref[0] = mk->x; ref[1] = mk->y; ref[2] = mk->z;
+            r->time = mk->time;
+        }
+        p.x[i] = mk->x - ref[0];
+        p.y[i] = mk->y - ref[1];
+        p.z[i] = mk->z - ref[2];
+        p.w[i] = 1. / mk->cond;
+    }
+    if (n < 3) return;
+
+    ops->moments(b, &p, m);
+    if (!solver_horn(m, q, R, t)) return;
+    rms = solver_rms(ops, b, &p, m, R, t, &worst);
+
+    /* one outlier rejection, keeping at least 3 markers */
+    if (rms > b->max_residual && n > 3) {
+        p.w[worst] = 0.;
+        ops->moments(b, &p, m);
+        if (!solver_horn(m, q, R, t)) return;
+        rms = solver_rms(ops, b, &p, m, R, t, &worst);
+    }
+    if (rms > b->max_residual) return;
+
+    r->x = t[0] + ref[0];
+    r->y = t[1] + ref[1];
+    r->z = t[2] + ref[2];
+    r->qw = q[0]; r->qx = q[1]; r->qy = q[2]; r->qz = q[3];
+    r->cond = rms > PHSP_SOLVER_COND_MIN ? rms : PHSP_SOLVER_COND_MIN;
+}
+
+
+/* ---------------------------------------------------------------------- */
+/* Solver                                                                 */
+/* ---------------------------------------------------------------------- */
+
+struct phasespace_solver_s *
+phsp_solver_create(void)
+{
+    struct phasespace_solver_s *solver;
+
+    /* templates are loaded with aligned AVX2 loads */
+    if (posix_memalign((void **)&solver, 64, sizeof(*solver))) return NULL;
+    memset(solver, 0, sizeof(*solver));
+    return solver;
+}
+
+void
+phsp_solver_destroy(struct phasespace_solver_s *solver)
+{
+    free(solver);
+}
+
+/*
+ * Register, replace or, with no points, remove the template of rigid
+ * t->id. Returns 0, or -1 with errno set to EINVAL for an invalid
+ * template (fewer than 3 points, duplicate marker ids or a negative
+ * tolerance), ENOENT when removing an unknown id or ENOSPC if all
+ * PHASESPACE_MAX_RIGIDS templates are in use.
+ */
+int
+phsp_solver_set(struct phasespace_solver_s *solver,
+                const phasespace_template *t)
+{
+    struct phsp_solver_body *b = NULL;
+    uint32_t i, j;
+
+    if (!solver || t->id <= 0 || t->num_points > PHSP_TEMPLATE_MAX_POINTS ||
+        (t->num_points && t->num_points < 3) || !(t->max_residual >= 0.)) {
+        errno = EINVAL;
+        return -1;
+    }
+    for (i = 0; i < t->num_points; i++)
+        for (j = 0; j < i; j++)
+            if (t->points[i].id == t->points[j].id) {
+                errno = EINVAL;
+                return -1;
+            }
+
+    for (i = 0; i < solver->num_bodies; i++)
+        if (solver->body[i].id == t->id) { b = &solver->body[i]; break; }
+
+    if (!t->num_points) {
+        if (!b) { errno = ENOENT; return -1; }
+        *b = solver->body[--solver->num_bodies];
+        return 0;
+    }
+    if (!b) {
+        if (solver->num_bodies >= PHASESPACE_MAX_RIGIDS) {
+            errno = ENOSPC;
+            return -1;
+        }
+        b = &solver->body[solver->num_bodies++];
+    }
+
+    memset(b, 0, sizeof(*b));
+    b->id = t->id;
+    b->num_points = t->num_points;
+    b->n = (t->num_points + 3) & ~3U;
+    b->max_residual = t->max_residual > 0. ?
+        t->max_residual : PHSP_SOLVER_MAX_RESIDUAL;
+    for (i = 0; i < t->num_points; i++) {
+        b->marker[i] = t->points[i].id;
+        b->slot[i] = i;
+        b->lx[i] = t->points[i].x;
+        b->ly[i] = t->points[i].y;
+        b->lz[i] = t->points[i].z;
+    }
+    return 0;
+}
+
+/*
+ * Fit the templates on the markers of a decoded frame, leaving out those
+ * rejected by the quality gate. A fitted rigid replaces a rigid of the
+ * same id that the server could not track (cond <= 0) or that was
+ * rejected, or is appended if the server has no such rigid; other rigids
+ * tracked by the server are kept. Fitted rigids are flagged
+ * PHSP_FLAG_SOLVED and their cond is the rms residual in mm, or -1 if the
+ * fit failed.
+ */
+void
+phsp_solver_update(struct phasespace_solver_s *solver,
+                   phasespace_bodies *bodies)
+{
+    const struct phsp_solver_ops *ops;
+    struct phsp_solver_body *b;
+    phasespace_rigid_s *r;
+    uint32_t i;
+    size_t j;
+
+    if (!solver || !solver->num_bodies) return;
+    ops = phsp_solver_ops();
+
+    for (i = 0; i < solver->num_bodies; i++) {
+        b = &solver->body[i];
+
+        for (j = 0; j < bodies->num_rigids; j++)
+            if (bodies->rigids[j].id == b->id) break;
+        if (j < bodies->num_rigids) {
+            r = &bodies->rigids[j];
+            if (r->cond > 0. && !(r->flags & PHSP_FLAG_REJECTED)) continue;
+        } else if (bodies->num_rigids < PHASESPACE_MAX_RIGIDS) {
+            r = &bodies->rigids[bodies->num_rigids++];
+            r->time = bodies->num_markers ? bodies->markers[0].time : 0;
+            r->x = r->y = r->z = 0.;
+            r->qw = 1.; r->qx = r->qy = r->qz = 0.;
+        } else
+            continue;
+
+        solver_fit(ops, b, bodies, r);
+    }
+}
@@ -0,0 +1,343 @@
+/*
+ * Copyright (c) 2025 UCL
+ * All rights reserved.
+ *
+ * Redistribution and use  in source  and binary  forms,  with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *   1. Redistributions of  source  code must retain the  above copyright
+ *      notice and this list of conditions.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice and  this list of  conditions in the  documentation and/or
+ *      other materials provided with the distribution.
+ *
+ * phsp_track.c — persistent marker ids across frames
+ *
+ * The server numbers markers by their position in the frame, so a marker
+ * id changes when other markers drop in or out. When enabled, the tracker
+ * replaces those ids: each track predicts the position of a marker at the
+ * frame time with a constant velocity, and the visible markers are matched
+ * to the predicted tracks within a gate. Tracks are binned in a hashed
+ * uniform grid, and each marker only visits the cells its gate overlaps.
+ * Matching is stable with respect to distance (a marker and a track
+ * matched to others are never closer to each other than to their
+ * matches), found by markers proposing to their nearest candidates in
+ * turn. Unmatched markers start new tracks, and tracks not seen for the
+ * timeout are retired with their id. Tracks are timed with the frame
+ * clock, so that frames received together still move them.
+ */
+#include "acphasespace.h"
+
+#include <errno.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "phasespace_c_types.h"
+#include "phsp.h"
+
+static const phasespace_track_params phsp_track_default = {
+    .enable = false,
+    .gate = 20.,
+    .timeout = 0.2,
+};
+
+
+/* --- grid ------------------------------------------------------------- */
+
+/* floor() without a libm call on targets lacking a rounding instruction */
+static inline int32_t
+track_floor(double v)
+{
+    int32_t i = v;
+
+    return i - (v < i);
+}
+
+static inline uint32_t
+track_cell(int32_t ix, int32_t iy, int32_t iz)
+{
+    return ((uint32_t)ix * 73856093U ^ (uint32_t)iy * 19349663U ^
+            (uint32_t)iz * 83492791U) & (PHSP_TRACK_CELLS - 1);
+}
+
+/* cell of a position scaled by 1/(2 gate), and the neighbours on the side
+ * of the nearest cell boundary on each axis, -1 or 1 */
+static inline uint32_t
+track_locate(double fx, double fy, double fz, int32_t i[3], int32_t d[3])
+{
+    i[0] = track_floor(fx); d[0] = fx - i[0] < .5 ? -1 : 1;
+    i[1] = track_floor(fy); d[1] = fy - i[1] < .5 ? -1 : 1;
+    i[2] = track_floor(fz); d[2] = fz - i[2] < .5 ? -1 : 1;
+    return track_cell(i[0], i[1], i[2]);
+}
+
+/*
+ * Bin the tracks predicted at time t in cells of twice the gate. Bins are
+ * sorted by cell with a counting sort over the cells used in this frame
+ * only: the others are not cleared but left with an older stamp, so the
+ * cost does not depend on the size of the grid.
+ */
+static void
+track_predict(struct phasespace_track_s *tr, int64_t t, double inv)
+{
+    const struct phsp_track *k;
+    struct phsp_track_cell *g;
+    int32_t ix[3], dx[3];
+    uint32_t i, c, j, s = 0;
+    double dt;
+
+    if (!++tr->frame) {
+        for (c = 0; c < PHSP_TRACK_CELLS; c++) tr->grid[c].stamp = 0;
+        tr->frame = 1;
+    }
+    tr->num_touched = 0;
+
+    for (i = 0; i < tr->num_tracks; i++) {
+        k = &tr->track[i];
+        dt = (t - k->time) * 1e-9;
+        tr->pred[i].x = k->x + k->vx * dt;
+        tr->pred[i].y = k->y + k->vy * dt;
+        tr->pred[i].z = k->z + k->vz * dt;
+        tr->owner[i] = -1;
+
+        c = track_locate(tr->pred[i].x * inv, tr->pred[i].y * inv,
+                         tr->pred[i].z * inv, ix, dx);
+        g = &tr->grid[c];
+        if (g->stamp != tr->frame) {
+            g->stamp = tr->frame;
+            g->count = 0;
+            tr->touched[tr->num_touched++] = c;
+        }
+        g->count++;
+        tr->cell[i] = c;
+    }
+
+    /* end of the bins of each cell, then filled down to their start */
+    for (i = 0; i < tr->num_touched; i++) {
+        g = &tr->grid[tr->touched[i]];
+        s += g->count;
+        g->start = s;
+    }
+    for (i = 0; i < tr->num_tracks; i++) {
+        j = --tr->grid[tr->cell[i]].start;
+        tr->bin[j].x = tr->pred[i].x;
+        tr->bin[j].y = tr->pred[i].y;
+        tr->bin[j].z = tr->pred[i].z;
+        tr->bin[j].track = i;
+    }
+}
+
+/*
+ * Nearest tracks within the gate of marker m, by increasing distance. The
+ * gate overlaps the cell of the marker and, on each axis, the neighbour
+ * on the side of the nearest cell boundary: 8 cells in all.
+ */
+static void
+track_candidates(struct phasespace_track_s *tr, uint32_t m,
+                 const phasespace_marker_s *mk, double inv, double gate2)
+{
+    struct phsp_track_candidate *cand = tr->cand[m];
+    const struct phsp_track_bin *bin, *end;
+    const struct phsp_track_cell *g[8];
+    double d2, ex, ey, ez;
+    int32_t ix[3], dx[3];
+    uint32_t n = 0, j;
+    int e;
+
+    /* the cells are scattered in the grid: fetch them all first */
+    track_locate(mk->x * inv, mk->y * inv, mk->z * inv, ix, dx);
+    for (e = 0; e < 8; e++) {
+        g[e] = &tr->grid[track_cell(ix[0] + (e & 1 ? dx[0] : 0),
+                                    ix[1] + (e & 2 ? dx[1] : 0),
+                                    ix[2] + (e & 4 ? dx[2] : 0))];
+        __builtin_prefetch(g[e]);
+    }
+
+    for (e = 0; e < 8; e++) {
+        if (g[e]->stamp != tr->frame) continue;
+
+        end = tr->bin + g[e]->start + g[e]->count;
+        for (bin = tr->bin + g[e]->start; bin < end; bin++) {
+            ex = bin->x - mk->x;
+            ey = bin->y - mk->y;
+            ez = bin->z - mk->z;
+            d2 = ex*ex + ey*ey + ez*ez;
+            if (d2 > gate2) continue;
+
+            /* hash collisions may list a cell twice */
+            for (j = 0; j < n && cand[j].track != bin->track; j++);
+            if (j < n) continue;
+
+            /* insertion into the sorted candidates */
+            if (n < PHSP_TRACK_CANDIDATES) n++;
+            else if (d2 >= cand[n - 1].d2) continue;
+            for (j = n - 1; j > 0 && cand[j - 1].d2 > d2; j--)
+                cand[j] = cand[j - 1];
+            cand[j].track = bin->track;
+            cand[j].d2 = d2;
+        }
+    }
+
+    tr->num_cand[m] = n;
+    tr->tried[m] = 0;
+}
+
+
+/* --- tracks ----------------------------------------------------------- */
+
+static void
+track_observe(struct phsp_track *k, const phasespace_marker_s *mk,
+              int64_t t)
+{
+    double dt = (t - k->time) * 1e-9;
+    double a = k->hits > 1 ? 0.5 : 1.;	/* no velocity to blend yet */
+
+    if (dt > 0.) {
+        dt = 1. / dt;
+        k->vx += a * ((mk->x - k->x) * dt - k->vx);
+        k->vy += a * ((mk->y - k->y) * dt - k->vy);
+        k->vz += a * ((mk->z - k->z) * dt - k->vz);
+    }
+    k->x = mk->x; k->y = mk->y; k->z = mk->z;
+    k->time = t;
+    k->hits++;
+}
+
+/* start a track on an unmatched marker, return its id or 0 if full */
+static int32_t
+track_start(struct phasespace_track_s *tr, const phasespace_marker_s *mk,
+            int64_t t)
+{
+    struct phsp_track *k;
+
+    if (tr->num_tracks >= PHSP_TRACK_MAX) return 0;
+    k = &tr->track[tr->num_tracks++];
+
+    k->id = tr->next_id;
+    tr->next_id = tr->next_id < INT32_MAX ? tr->next_id + 1 : 1;
+    k->hits = 1;
+    k->time = t;
+    k->x = mk->x; k->y = mk->y; k->z = mk->z;
+    k->vx = k->vy = k->vz = 0.;
+    return k->id;
+}
+
+
+/* ---------------------------------------------------------------------- */
+/* Tracker                                                                */
+/* ---------------------------------------------------------------------- */
+
+struct phasespace_track_s *
+phsp_track_create(void)
+{
+    struct phasespace_track_s *tr = calloc(1, sizeof(*tr));
+
+    if (!tr) return NULL;
+    tr->params = phsp_track_default;
+    tr->next_id = 1;
+    return tr;
+}
+
+void
+phsp_track_destroy(struct phasespace_track_s *tr)
+{
+    free(tr);
+}
+
+/* set the tuning, gate and timeout strictly positive; enabling or
+ * disabling the tracker restarts it, and new ids start at 1 */
+int
+phsp_track_params(struct phasespace_track_s *tr,
+                  const phasespace_track_params *p)
+{
+    if (!tr || !(p->gate > 0.) || !(p->timeout > 0.)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (p->enable != tr->params.enable) {
+        tr->num_tracks = 0;
+        tr->next_id = 1;
+        memset(&tr->clock, 0, sizeof(tr->clock));
+    }
+    tr->params = *p;
+    return 0;
+}
+
+/*
+ * Replace the marker ids of a decoded frame with persistent ids, if the
+ * tracker is enabled. Markers that are not visible (cond <= 0) have no
+ * position to be matched on and get id 0, like markers seen while all
+ * PHSP_TRACK_MAX tracks are in use.
+ */
+void
+phsp_track_update(struct phasespace_track_s *tr, phasespace_bodies *bodies)
+{
+    const double inv = 1. / (2. * tr->params.gate);
+    const double gate2 = tr->params.gate * tr->params.gate;
+    int64_t timeout = tr->params.timeout * 1e9, t;
+    phasespace_marker_s *mk;
+    struct phsp_track *k;
+    uint32_t i, n, m, q = 0;
+    int32_t j;
+
+    if (!tr->params.enable || !bodies->num_markers) return;
+    t = phsp_frame_clock(&tr->clock, bodies->markers[0].time, timeout);
+
+    /* retire lost tracks, and restart if time goes back */
+    for (i = 0; i < tr->num_tracks;) {
+        k = &tr->track[i];
+        if (t - k->time > timeout || k->time > t)
+            *k = tr->track[--tr->num_tracks];
+        else
+            i++;
+    }
+
+    track_predict(tr, t, inv);
+
+    n = bodies->num_markers;
+    for (m = 0; m < n; m++) {
+        mk = &bodies->markers[m];
+        if (!(mk->cond > 0.)) {
+            tr->num_cand[m] = tr->tried[m] = 0;
+            continue;
+        }
+        track_candidates(tr, m, mk, inv, gate2);
+        if (tr->num_cand[m]) tr->queue[q++] = m;
+    }
+
+    /* markers propose to their candidates from the nearest; a track keeps
+     * the nearest proposer and the other goes on with its next one */
+    while (q) {
+        const struct phsp_track_candidate *c;
+
+        m = tr->queue[--q];
+        if (tr->tried[m] >= tr->num_cand[m]) continue;
+        c = &tr->cand[m][tr->tried[m]++];
+
+        j = tr->owner[c->track];
+        if (j < 0 || c->d2 < tr->owner_d2[c->track]) {
+            tr->owner[c->track] = m;
+            tr->owner_d2[c->track] = c->d2;
+            if (j >= 0) tr->queue[q++] = j;
+        } else
+            tr->queue[q++] = m;
+    }
+
+    /* ids of matched markers, from before new tracks are appended */
+    for (m = 0; m < n; m++) bodies->markers[m].id = 0;
+    for (i = 0; i < tr->num_tracks; i++) {
+        j = tr->owner[i];
+        if (j < 0) continue;
+        track_observe(&tr->track[i], &bodies->markers[j], t);
+        bodies->markers[j].id = tr->track[i].id;
+    }
+
+    for (m = 0; m < n; m++) {
+        mk = &bodies->markers[m];
+        if (mk->id || !(mk->cond > 0.)) continue;
+        mk->id = track_start(tr, mk, t);
+    }
+}
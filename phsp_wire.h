@@ -0,0 +1,87 @@
+/*
+ * Copyright (c) 2025 UCL
+ * All rights reserved.
+ *
+ * Redistribution and use  in source  and binary  forms,  with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *   1. Redistributions of  source  code must retain the  above copyright
+ *      notice and this list of conditions.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice and  this list of  conditions in the  documentation and/or
+ *      other materials provided with the distribution.
+ */
+
+#ifndef H_PHASESPACE_WIRE
+#define H_PHASESPACE_WIRE
+
+#include <stdint.h>
+
+/* ---------------------------------------------------------------------- */
+/* OWL TCP frame format                                                   */
+/* ---------------------------------------------------------------------- */
+/*
+ * header:  numMarkers(2, network order), numRigids(2, network order),
+ *          4 reserved bytes
+ * markers: x, y, z, cond as float32 (16 bytes per marker)
+ * rigids:  x, y, z, qw, qx, qy, qz, cond as float32 (32 bytes per rigid)
+ *
+ * Shared by the codels and the standalone tools (phsp-sim), so that it
+ * must not depend on genom headers.
+ */
+#define OWL_HEADER_SIZE	8
+#define OWL_MARKER_SIZE	16
+#define OWL_RIGID_SIZE	32
+
+#define OWL_FRAME_SIZE(nm, nr)						\
+  (OWL_HEADER_SIZE + (nm) * OWL_MARKER_SIZE + (nr) * OWL_RIGID_SIZE)
+
+/* ---------------------------------------------------------------------- */
+/* OWL UDP frame format                                                   */
+/* ---------------------------------------------------------------------- */
+/*
+ * The client subscribes by sending the 8 bytes OWL_UDP_SUBSCRIBE to the
+ * server port, which then streams one frame per datagram:
+ *
+ * header:  seq(4, network order), 4 reserved bytes
+ * frame:   a whole frame in the TCP format above
+ *
+ * seq increments by one per frame produced, so that gaps reveal lost
+ * datagrams and lower numbers late ones.
+ */
+#define OWL_UDP_SUBSCRIBE	"PHSPSUB"
+#define OWL_UDP_HEADER_SIZE	8
+
+
+/* ---------------------------------------------------------------------- */
+/* Raw stream capture file                                                */
+/* ---------------------------------------------------------------------- */
+/*
+ * A file header followed by one chunk per successful recv() on the OWL
+ * socket: a chunk header then 'len' bytes exactly as they were received.
+ * All integers are little-endian. 't' is the CLOCK_MONOTONIC time of the
+ * read in ns relative to the capture start, 'start' is the CLOCK_REALTIME
+ * of the capture start in ns.
+ */
+#define OWL_CAPTURE_MAGIC	"PHSPCAP"
+#define OWL_CAPTURE_VERSION	1
+
+struct owl_capture_hdr {
+  char magic[8];
+  uint16_t version;
+  uint16_t hdr_size;
+  uint32_t reserved;
+  uint64_t start;
+};
+
+struct owl_capture_chunk {
+  uint64_t t;
+  uint32_t len;
+  uint32_t reserved;
+};
+
+_Static_assert(sizeof(struct owl_capture_hdr) == 24, "capture header");
+_Static_assert(sizeof(struct owl_capture_chunk) == 16, "capture chunk");
+
+#endif /* H_PHASESPACE_WIRE */